@@ -0,0 +1,111 @@
+#include <QByteArray>
+#include <QDataStream>
+#include <QElapsedTimer>
+#include <QTextStream>
+
+#include <cstring>
+
+#include "utils/pixelpack.h"
+
+/*
+ * Pixel packing micro-benchmark
+ * Compares the old per pixel QDataStream and memcpy packing against packInterleavedRows
+ *
+ * Usage: JXLFrameStitchingPackBench [width height [rounds]], defaults to a 24 MP frame
+ */
+namespace
+{
+// the packing jxlutils.h used to do, kept here as the baseline
+void legacyDataStream(const uchar *src, QByteArray &out, size_t pxsize, size_t bpc, bool alpha)
+{
+    QDataStream ds(&out, QIODevice::WriteOnly);
+    const size_t chan = (alpha) ? 4 : 3;
+    QByteArray tempb;
+    tempb.resize(static_cast<qsizetype>(bpc * chan));
+    for (size_t i = 0; i < pxsize; i++) {
+        memcpy(tempb.data(), src, bpc * chan);
+        ds.writeRawData(tempb.constData(), tempb.size());
+        src += 4 * bpc;
+    }
+}
+
+void legacyMemcpy(const uchar *src, QByteArray &out, size_t pxsize, size_t bpc, bool alpha)
+{
+    auto *dst = reinterpret_cast<uchar *>(out.data());
+    const size_t chan = (alpha) ? 4 : 3;
+    for (size_t i = 0; i < pxsize; i++) {
+        memcpy(dst, src, bpc * chan);
+        src += 4 * bpc;
+        dst += bpc * chan;
+    }
+}
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    QTextStream out(stdout);
+
+    const size_t width = (argc > 2) ? static_cast<size_t>(QByteArray(argv[1]).toULongLong()) : 6000;
+    const size_t height = (argc > 2) ? static_cast<size_t>(QByteArray(argv[2]).toULongLong()) : 4000;
+    const int rounds = (argc > 3) ? qMax(1, QByteArray(argv[3]).toInt()) : 5;
+    const size_t pxsize = width * height;
+
+    out << "Frame " << width << "x" << height << ", " << rounds << " round(s), kernel: " << jxfrstch::packKernelName()
+        << "\n";
+
+    const auto report = [&](const char *name, size_t srcBytes, qint64 ns) {
+        const double gbps = static_cast<double>(srcBytes) * rounds / static_cast<double>(ns);
+        out << "    " << qSetFieldWidth(12) << Qt::left << name << qSetFieldWidth(0) << QString::number(gbps, 'f', 2)
+            << " GB/s\n";
+    };
+
+    for (const size_t bpc : {size_t(1), size_t(2), size_t(4)}) {
+        for (const bool alpha : {false, true}) {
+            const size_t srcBytes = pxsize * 4 * bpc;
+            const size_t dstBytes = pxsize * ((alpha) ? 4 : 3) * bpc;
+            QByteArray src(static_cast<qsizetype>(srcBytes), Qt::Uninitialized);
+            for (qsizetype i = 0; i < src.size(); i++) {
+                src[i] = static_cast<char>(i * 31);
+            }
+            const auto *srcPtr = reinterpret_cast<const uchar *>(src.constData());
+
+            out << (bpc * 8) << " bit " << ((alpha) ? "RGBA -> RGBA" : "RGBX -> RGB") << "\n";
+
+            QElapsedTimer elt;
+            QByteArray streamed;
+            elt.start();
+            for (int r = 0; r < rounds; r++) {
+                streamed.clear();
+                legacyDataStream(srcPtr, streamed, pxsize, bpc, alpha);
+            }
+            report("QDataStream", srcBytes, elt.nsecsElapsed());
+
+            QByteArray copied(static_cast<qsizetype>(dstBytes), Qt::Uninitialized);
+            elt.restart();
+            for (int r = 0; r < rounds; r++) {
+                legacyMemcpy(srcPtr, copied, pxsize, bpc, alpha);
+            }
+            report("per pixel", srcBytes, elt.nsecsElapsed());
+
+            QByteArray packed(static_cast<qsizetype>(dstBytes), Qt::Uninitialized);
+            elt.restart();
+            for (int r = 0; r < rounds; r++) {
+                jxfrstch::packInterleavedRows(srcPtr,
+                                              width * 4 * bpc,
+                                              packed.data(),
+                                              width * ((alpha) ? 4 : 3) * bpc,
+                                              width,
+                                              height,
+                                              bpc,
+                                              alpha);
+            }
+            report("rows", srcBytes, elt.nsecsElapsed());
+
+            if (packed != streamed || packed != copied) {
+                out << "    MISMATCH!\n";
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,267 @@
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QDir>
+#include <QFileInfo>
+#include <QImageReader>
+#include <QTextStream>
+
+#include "jxfrstchconfig.h"
+#include "jxlutils.h"
+#include "utils/encodescheduler.h"
+#include "utils/jxlencoderobject.h"
+#include "utils/projectfile.h"
+#include "utils/workpool.h"
+
+/*
+ * Headless batch encoder, runs .frstch projects without QtWidgets
+ * Several projects are encoded side by side through EncodeScheduler, each to <output dir>/<project name>.jxl
+ *
+ * Exit codes:
+ * 0 = success, 1 = invalid arguments or project, 2 = unable to read first frame, 3 = encode failed
+ */
+int main(int argc, char *argv[])
+{
+    QCoreApplication a(argc, argv);
+    QCoreApplication::setApplicationName("JXLFrameStitchingCli");
+    QCoreApplication::setApplicationVersion(PROJECT_VERSION);
+
+    QTextStream err(stderr);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Encode a JXL Frame Stitching project (.frstch) without GUI");
+    parser.addHelpOption();
+    parser.addVersionOption();
+    parser.addPositionalArgument("projects", "Project file(s) (.frstch) to encode", "project [project...]");
+
+    const QCommandLineOption outputOpt(QStringList{"o", "output"}, "Output JXL file (required, - for stdout), or directory for several projects.", "file");
+    const QCommandLineOption distanceOpt(QStringList{"d", "distance"}, "Override distance (0 = lossless).", "distance");
+    const QCommandLineOption effortOpt(QStringList{"e", "effort"}, "Override effort (1-10, 11 is allowed).", "effort");
+    const QCommandLineOption threadsOpt(QStringList{"t", "threads"}, "Encoder thread count (0 = auto).", "threads");
+    const QCommandLineOption decThreadsOpt("decode-threads", "Decode worker count (0 = auto).", "threads");
+    const QCommandLineOption lookaheadOpt("lookahead", "Override lookahead frames.", "frames");
+    const QCommandLineOption spillOpt("spill-threshold", "Spill frames bigger than this to disk (0 = never).", "MiB");
+    const QCommandLineOption scratchOpt("scratch-dir", "Directory for spill files (default: system temp).", "dir");
+    const QCommandLineOption cacheOpt("frame-cache", "Keep up to this much of decoded frames in RAM (0 = off).", "MiB");
+    const QCommandLineOption cacheDiskOpt("frame-cache-disk", "Keep up to this much of decoded frames on disk (0 = off).", "MiB");
+    const QCommandLineOption cacheDirOpt("frame-cache-dir", "Directory for the on-disk frame cache (default: user cache).", "dir");
+    const QCommandLineOption chunkedOpt("chunked", "Use chunked input.");
+    const QCommandLineOption streamOpt("stream-inputs", "Decode huge still JPEG inputs in row strips (needs --chunked).");
+    const QCommandLineOption coalesceOpt("coalesce", "Coalesce JXL input layers.");
+    const QCommandLineOption jobsOpt("jobs", "Encode up to this many projects at once (default: as the thread budget allows).", "jobs");
+    const QCommandLineOption budgetOpt("thread-budget", "Encoder threads shared by all projects (0 = all cores).", "threads");
+    const QCommandLineOption pinOpt("pin-threads", "Pin the shared worker threads to cores (Linux only).");
+    const QCommandLineOption quietOpt(QStringList{"q", "quiet"}, "Only print errors.");
+    parser.addOptions(
+        {outputOpt,
+         distanceOpt,
+         effortOpt,
+         threadsOpt,
+         decThreadsOpt,
+         lookaheadOpt,
+         spillOpt,
+         scratchOpt,
+         cacheOpt,
+         cacheDiskOpt,
+         cacheDirOpt,
+         chunkedOpt,
+         streamOpt,
+         coalesceOpt,
+         jobsOpt,
+         budgetOpt,
+         pinOpt,
+         quietOpt});
+
+    parser.process(a);
+
+    const QStringList positional = parser.positionalArguments();
+    if (positional.isEmpty()) {
+        err << "Error: expected at least one project file\n";
+        err << parser.helpText();
+        return 1;
+    }
+
+    const auto readNumber = [&](const QCommandLineOption &opt, double minVal, double maxVal, double &val) {
+        if (!parser.isSet(opt)) {
+            return true;
+        }
+        bool ok = false;
+        const double v = parser.value(opt).toDouble(&ok);
+        if (!ok || v < minVal || v > maxVal) {
+            err << "Error: invalid value for --" << opt.names().last() << ": " << parser.value(opt) << "\n";
+            return false;
+        }
+        val = v;
+        return true;
+    };
+
+    double maxJobs = 0;
+    double threadBudget = 0;
+    if (!readNumber(jobsOpt, 1.0, 1024.0, maxJobs) || !readNumber(budgetOpt, 0.0, 4096.0, threadBudget)) {
+        return 1;
+    }
+    const bool useScheduler = positional.size() > 1 || parser.isSet(jobsOpt) || parser.isSet(budgetOpt);
+
+    const QString output = parser.value(outputOpt);
+    if (output.isEmpty()) {
+        err << "Error: output file is required (-o)\n";
+        return 1;
+    }
+    const bool toStdout = output == "-";
+    if (useScheduler && !QFileInfo(output).isDir()) {
+        err << "Error: with several projects, -o has to be an existing directory\n";
+        return 1;
+    }
+
+    QVector<jxfrstch::ProjectData> projects;
+    for (const QString &projectFile : positional) {
+        jxfrstch::ProjectData project;
+        if (!jxfrstch::readProjectFile(projectFile, project)) {
+            err << "Error: failed to read project file " << projectFile << "\n";
+            return 1;
+        }
+        if (project.files.isEmpty()) {
+            err << "Error: project " << projectFile << " has no input files\n";
+            return 1;
+        }
+
+        jxfrstch::EncodeParams &params = project.params;
+
+        double effort = params.effort;
+        double threads = params.encodeThreads;
+        double decThreads = params.decodeThreads;
+        double lookahead = params.lookaheadFrames;
+        double spill = params.spillThresholdMiB;
+        double frameCache = params.frameCacheMiB;
+        double frameCacheDisk = params.frameCacheDiskMiB;
+        if (!readNumber(distanceOpt, 0.0, 25.0, params.distance) || !readNumber(effortOpt, 1.0, 11.0, effort)
+            || !readNumber(threadsOpt, 0.0, 1024.0, threads) || !readNumber(decThreadsOpt, 0.0, 1024.0, decThreads)
+            || !readNumber(lookaheadOpt, 1.0, 64.0, lookahead) || !readNumber(spillOpt, 0.0, 1048576.0, spill)
+            || !readNumber(cacheOpt, 0.0, 1048576.0, frameCache)
+            || !readNumber(cacheDiskOpt, 0.0, 16777216.0, frameCacheDisk)) {
+            return 1;
+        }
+        params.effort = static_cast<int>(effort);
+        params.encodeThreads = static_cast<int>(threads);
+        params.decodeThreads = static_cast<int>(decThreads);
+        params.lookaheadFrames = static_cast<int>(lookahead);
+        params.spillThresholdMiB = static_cast<int>(spill);
+        params.frameCacheMiB = static_cast<int>(frameCache);
+        params.frameCacheDiskMiB = static_cast<int>(frameCacheDisk);
+        if (parser.isSet(scratchOpt)) {
+            params.scratchDir = parser.value(scratchOpt);
+        }
+        if (parser.isSet(cacheDirOpt)) {
+            params.frameCacheDir = parser.value(cacheDirOpt);
+        }
+
+        if (useScheduler) {
+            params.outputFileName = QDir(output).absoluteFilePath(QFileInfo(projectFile).completeBaseName() + ".jxl");
+        } else if (toStdout) {
+            params.outputFileName = output;
+        } else {
+            params.outputFileName = QFileInfo(output).absoluteFilePath();
+        }
+
+        params.autoCropFrame = params.animation ? params.autoCropFrame : false;
+        params.onlyCropAnimatedFile = params.animation ? params.onlyCropAnimatedFile : false;
+        params.coalesceJxlInput = params.autoCropFrame ? true : parser.isSet(coalesceOpt);
+        params.chunkedFrame = parser.isSet(chunkedOpt);
+        params.streamInputs = params.chunkedFrame && parser.isSet(streamOpt);
+
+        projects.append(project);
+    }
+
+    QImageReader::setAllocationLimit(0);
+    jxfrstch::WorkPool::instance().setPinning(parser.isSet(pinOpt));
+
+    const bool quiet = parser.isSet(quietOpt);
+    // stdout carries the image itself then
+    QTextStream out(toStdout ? stderr : stdout);
+
+    if (useScheduler) {
+        EncodeScheduler scheduler;
+        scheduler.setThreadBudget(static_cast<int>(threadBudget));
+        scheduler.setMaxConcurrentJobs(static_cast<int>(maxJobs));
+
+        QVector<int> currentFrames(projects.size(), 0);
+        bool allSucceeded = true;
+
+        QObject::connect(&scheduler, &EncodeScheduler::sigJobStatus, [&](int job, const QString &status) {
+            if (!quiet) {
+                out << "{" << QFileInfo(positional.at(job)).fileName() << "} [" << currentFrames.at(job) << "/"
+                    << projects.at(job).files.size() << "] " << status << "\n";
+                out.flush();
+            }
+        });
+        QObject::connect(&scheduler, &EncodeScheduler::sigJobThreadsChanged, [&](int job, int threads) {
+            if (!quiet) {
+                out << "{" << QFileInfo(positional.at(job)).fileName() << "} using " << threads << " encoder thread(s)\n";
+                out.flush();
+            }
+        });
+        QObject::connect(&scheduler, &EncodeScheduler::sigJobProgress, [&](int job, int frame, int) {
+            currentFrames[job] = frame;
+        });
+        QObject::connect(&scheduler, &EncodeScheduler::sigJobError, [&](int job, const QString &status) {
+            err << "Error: {" << QFileInfo(positional.at(job)).fileName() << "} " << status << "\n";
+            err.flush();
+        });
+        QObject::connect(&scheduler, &EncodeScheduler::sigJobFinished, [&](int, bool success) {
+            allSucceeded = allSucceeded && success;
+        });
+        QObject::connect(&scheduler, &EncodeScheduler::sigAllFinished, &a, &QCoreApplication::quit, Qt::QueuedConnection);
+
+        // job ids follow the order they're added in, same as positional
+        for (const auto &project : projects) {
+            scheduler.addJob(project.params, project.files);
+        }
+        scheduler.start();
+        a.exec();
+
+        return allSucceeded ? 0 : 3;
+    }
+
+    const jxfrstch::ProjectData &project = projects.first();
+    const jxfrstch::EncodeParams &params = project.params;
+
+    JXLEncoderObject encObj;
+    int currentFrame = 0;
+
+    // everything runs on this thread, so direct connections are fine
+    QObject::connect(&encObj, &JXLEncoderObject::sigStatusText, [&](const QString &status) {
+        if (!quiet) {
+            out << "[" << currentFrame << "/" << project.files.size() << "] " << status << "\n";
+            out.flush();
+        }
+    });
+    QObject::connect(&encObj, &JXLEncoderObject::sigSpeedStats, [&](const QString &status) {
+        if (!quiet) {
+            out << "    " << status << "\n";
+            out.flush();
+        }
+    });
+    QObject::connect(&encObj, &JXLEncoderObject::sigCurrentMainProgressBar, [&](const int &progress, const bool &) {
+        currentFrame = progress;
+    });
+    QObject::connect(&encObj, &JXLEncoderObject::sigThrowError, [&](const QString &status) {
+        err << "Error: " << status << "\n";
+        err.flush();
+    });
+
+    encObj.resetEncoder();
+    encObj.setEncodeParams(params);
+    for (const auto &ifd : project.files) {
+        encObj.appendInputFiles(ifd);
+    }
+
+    if (!encObj.canEncode()) {
+        err << "Error: unable to read first frame data!\n";
+        return 2;
+    }
+
+    const bool success = encObj.doEncode();
+    encObj.cleanupEncoder();
+    encObj.resetEncoder();
+
+    return success ? 0 : 3;
+}
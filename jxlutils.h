@@ -15,6 +15,10 @@
 
 #include <jxl/encode_cxx.h>
 
+#include "utils/outputwriter.h"
+#include "utils/pixelpack.h"
+#include "utils/workpool.h"
+
 enum EncodeBitDepth {
     ENC_BIT_8 = 0,
     ENC_BIT_16,
@@ -50,35 +54,47 @@ struct MethodToCCallbackHelper<R (T::*)(Args...)> {
 #define METHOD_TO_C_CALLBACK(method) jxfrstch::MethodToCCallbackHelper<decltype(method)>::Call<method>
 
 // this one referenced from https://github.com/libjxl/libjxl/blob/main/tools/cjxl_main.cc
-// refitting for Qt file handling and bytearray
+// refitting for Qt file handling, the actual buffering and writing lives in OutputFileWriter
 struct JxlOutputProcessor {
     bool SetOutputPath(QString pat)
     {
-        outFile.setFileName(pat);
-        outFile.open(QIODevice::WriteOnly);
-        if (!outFile.isWritable()) {
-            outFile.close();
-            return false;
-        }
-        return true;
+        return writer.open(pat);
+    }
+
+    // keeps the encoded file in memory, see TakeBuffer
+    bool SetOutputBuffer()
+    {
+        return writer.openBuffer();
+    }
+
+    QByteArray TakeBuffer()
+    {
+        return writer.takeBuffer();
     }
 
-    void CloseOutputFile()
+    // the output file only appears (or gets replaced) here
+    bool CloseOutputFile()
     {
-        outFile.close();
+        return writer.commit();
     }
 
     void DeleteOutputFile()
     {
-        outFile.remove();
+        writer.discard();
+    }
+
+    QString ErrorString() const
+    {
+        return writer.errorString();
     }
 
     JxlEncoderOutputProcessor GetOutputProcessor()
     {
+        // no seek for pipes, libjxl then holds data back until it's final
         return JxlEncoderOutputProcessor{this,
                                          METHOD_TO_C_CALLBACK(&JxlOutputProcessor::GetBuffer),
                                          METHOD_TO_C_CALLBACK(&JxlOutputProcessor::ReleaseBuffer),
-                                         METHOD_TO_C_CALLBACK(&JxlOutputProcessor::Seek),
+                                         writer.isSeekable() ? METHOD_TO_C_CALLBACK(&JxlOutputProcessor::Seek) : nullptr,
                                          METHOD_TO_C_CALLBACK(&JxlOutputProcessor::SetFinalizedPosition)};
 
         // Non-macro version for personal references, see definitions below
@@ -91,32 +107,17 @@ struct JxlOutputProcessor {
 
     void *GetBuffer(size_t *size)
     {
-        *size = std::min<size_t>(*size, 1u << 16);
-        if (output.size() < *size) {
-            output.resize(*size);
-        }
-        return output.data();
+        return writer.getBuffer(size);
     }
 
     void ReleaseBuffer(size_t written_bytes)
     {
-        if (outFile.isOpen()) {
-            if (outFile.write(reinterpret_cast<const char *>(output.data()), written_bytes) != written_bytes) {
-                qWarning() << "Failed to write" << written_bytes << "bytes to output";
-            }
-        } else {
-            qWarning() << "ReleaseBuffer failed, file not open";
-        }
-        output.clear();
+        writer.releaseBuffer(written_bytes);
     }
 
     void Seek(uint64_t position)
     {
-        if (outFile.isOpen()) {
-            outFile.seek(position);
-        } else {
-            qWarning() << "Seek failed, file not open";
-        }
+        writer.seek(position);
     }
 
     void SetFinalizedPosition(uint64_t finalized_position)
@@ -169,11 +170,32 @@ struct JxlOutputProcessor {
     }
     */
 
-    QFile outFile;
-    QByteArray output;
+    OutputFileWriter writer;
     size_t finalized_position = 0;
 };
 
+// what probing an input found out, valid as long as the file keeps its size and mtime
+struct InputProbe {
+    qint64 fileSize{-1}; // -1 = not probed
+    qint64 modifiedMs{0};
+    QSize size{};
+    int frameCount{0};
+    int bitDepth{0};
+    bool animation{false};
+    bool hasAlpha{false};
+    bool coalesced{false}; // JXL layers are counted as frames without coalescing
+    QByteArray icc{};
+
+    bool isCurrent(const QString &fileName) const
+    {
+        if (fileSize < 0) {
+            return false;
+        }
+        const QFileInfo fi(fileName);
+        return fi.exists() && fi.size() == fileSize && fi.lastModified().toMSecsSinceEpoch() == modifiedMs;
+    }
+};
+
 struct InputFileData {
     uint8_t isRefFrame{0};
     uint32_t frameDuration{1};
@@ -182,8 +204,13 @@ struct InputFileData {
     int16_t frameYPos{0};
     bool isPageEnd{false};
     JxlBlendMode blendMode{JXL_BLEND_BLEND};
+    // first and last (inclusive) frame of the input to keep, -1 = up to its last frame, then every frameStep-th
+    int frameIn{0};
+    int frameOut{-1};
+    int frameStep{1};
     QString filename{};
     QString frameName{};
+    InputProbe probe{};
 
     // lexical comparison
     bool operator<(const InputFileData &rhs) const
@@ -212,6 +239,12 @@ struct EncodeParams {
     int numerator{1};
     int denominator{1};
     int loops{0};
+    int lookaheadFrames{4};
+    int decodeThreads{0}; // 0 = auto
+    int encodeThreads{0}; // 0 = auto
+    int spillThresholdMiB{0}; // 0 = never spill frames to disk
+    int frameCacheMiB{0}; // decoded frames kept in RAM across encodes, 0 = off
+    int frameCacheDiskMiB{0}; // and on disk, 0 = off
 
     EncodeColorSpace colorSpace{ENC_CS_SRGB};
     EncodeBitDepth bitDepth{ENC_BIT_8};
@@ -225,180 +258,73 @@ struct EncodeParams {
     bool autoCropFrame{false};
     bool onlyCropAnimatedFile{false};
     bool chunkedFrame{false};
+    bool streamInputs{false}; // decode huge still images tile by tile, chunked only
 
     QString outputFileName{};
+    QString scratchDir{}; // empty = system temp
+    QString frameCacheDir{}; // empty = user cache location
 };
 
-template<typename T>
-void QImageToBuffer(const QImage &img, QByteArray &ba, size_t pxsize, bool alpha)
+inline size_t bytesPerChannel(EncodeBitDepth bitDepth)
 {
-    auto srcPointer = reinterpret_cast<const T *>(img.constBits());
-    auto dstPointer = reinterpret_cast<T *>(ba.data());
-    const size_t chan = (alpha) ? 4 : 3;
-    for (size_t i = 0; i < pxsize; i++) {
-        memcpy(dstPointer, srcPointer, sizeof(T) * chan);
-        srcPointer += 4;
-        dstPointer += chan;
+    switch (bitDepth) {
+    case ENC_BIT_8:
+        return 1;
+    case ENC_BIT_16:
+    case ENC_BIT_16F:
+        return 2;
+    case ENC_BIT_32F:
+        return 4;
+    default:
+        break;
     }
+    return 1;
 }
 
-template<typename T>
-void QImageToBuffer(const QImage &img, QDataStream &ds, size_t pxsize, bool alpha)
+// QImage format frames are brought to before packing, RGBX when alpha isn't encoded
+inline QImage::Format encodeImageFormat(EncodeBitDepth bitDepth, bool alpha)
 {
-    auto srcPointer = reinterpret_cast<const T *>(img.constBits());
-    const size_t chan = (alpha) ? 4 : 3;
-    QByteArray tempb;
-    tempb.resize(sizeof(T) * chan);
-    for (size_t i = 0; i < pxsize; i++) {
-        memcpy(tempb.data(), srcPointer, sizeof(T) * chan);
-        ds.writeRawData(tempb.constData(), tempb.size());
-        srcPointer += 4;
+    switch (bitDepth) {
+    case ENC_BIT_8:
+        return alpha ? QImage::Format_RGBA8888 : QImage::Format_RGBX8888;
+    case ENC_BIT_16:
+        return alpha ? QImage::Format_RGBA64 : QImage::Format_RGBX64;
+    case ENC_BIT_16F:
+        return alpha ? QImage::Format_RGBA16FPx4 : QImage::Format_RGBX16FPx4;
+    case ENC_BIT_32F:
+        return alpha ? QImage::Format_RGBA32FPx4 : QImage::Format_RGBX32FPx4;
+    default:
+        break;
     }
+    return QImage::Format_Invalid;
 }
 
-// WIP
-struct ChunkedImageFrame {
-    ChunkedImageFrame(JxlPixelFormat infmt, size_t bytesperchan, QSize imSize)
-        : format(infmt)
-        , bytesPerChannel(bytesperchan)
-        , numChannels(infmt.num_channels)
-        , imgSize(imSize)
-    {
-        // qDebug() << "Chunked struct";
-        bytesPerPixel = numChannels * bytesPerChannel;
-    }
-
-    JxlChunkedFrameInputSource getChunkedStruct()
-    {
-        return JxlChunkedFrameInputSource{this,
-                                          GetColorChannelsPixelFormat,
-                                          GetColorChannelDataAt,
-                                          GetExtraChannelPixelFormat,
-                                          GetExtraChannelDataAt,
-                                          ReleaseCurrentData};
-    }
-
-    void inputData(QIODevice *dvc)
-    {
-        dev = dvc;
-    }
-
-    void inputData(const QByteArray *imin)
-    {
-        imgraw = imin;
-    }
-
-    static void GetColorChannelsPixelFormat(void *opaque, JxlPixelFormat *pixel_format)
-    {
-        ChunkedImageFrame *self = reinterpret_cast<ChunkedImageFrame *>(opaque);
-        *pixel_format = self->format;
-    }
-
-    static const void *
-    GetColorChannelDataAt(void *opaque, size_t xpos, size_t ypos, size_t xsize, size_t ysize, size_t *row_offset)
-    {
-        ChunkedImageFrame *self = reinterpret_cast<ChunkedImageFrame *>(opaque);
-        // qDebug() << "GetColorChannelDataAt xpos" << xpos << "ypos" << ypos << "xsize" << xsize << "ysize" << ysize
-        //          << "arr" << self->rawImageArray.size();
-        if (self->dev) {
-            self->mutex.lock();
-
-            // [[maybe_unused]]
-            // const QRect roi{static_cast<int>(xpos),
-            //                 static_cast<int>(ypos),
-            //                 static_cast<int>(xsize),
-            //                 static_cast<int>(ysize)};
-
-            const size_t rowOffset = self->imgSize.width() * self->bytesPerPixel;
-
-            const size_t xoffset = xpos * self->bytesPerPixel;
-            const size_t yoffset = ypos * rowOffset;
-            const size_t xyoffset = xoffset + yoffset;
-
-            {
-                QByteArray rawPatch;
-                for (int y = 0; y < ysize; y++) {
-                    const size_t rowBegin = xyoffset + (y * rowOffset);
-                    self->dev->seek(rowBegin);
-                    const QByteArray xyc = self->dev->read(xsize * self->bytesPerPixel);
-                    rawPatch.append(xyc);
-                }
-
-                self->rawImageArray.append(rawPatch);
-            }
-
-            *row_offset = xsize * self->bytesPerPixel;
-
-            self->mutex.unlock();
-            // qDebug() << "arrnum" << self->rawImageArray.size();
-
-            return self->rawImageArray.last().data();
-        } else if (self->imgraw) {
-            *row_offset = self->imgSize.width() * self->bytesPerPixel;
-            const size_t offset = ypos * *row_offset + xpos * self->bytesPerPixel;
-            return self->imgraw->data() + offset;
-        }
-        return nullptr;
-    }
-
-    static void GetExtraChannelPixelFormat(void *opaque, size_t ec_index, JxlPixelFormat *pixel_format)
-    {
-        // qDebug() << "GetExtraChannelPixelFormat at" << ec_index;
-        ChunkedImageFrame *self = reinterpret_cast<ChunkedImageFrame *>(opaque);
-        *pixel_format = self->format;
-    }
-
-    static const void *GetExtraChannelDataAt(void *opaque,
-                                             size_t ec_index,
-                                             size_t xpos,
-                                             size_t ypos,
-                                             size_t xsize,
-                                             size_t ysize,
-                                             size_t *row_offset)
-    {
-        // qDebug() << "GetExtraChannelDataAt at" << ec_index;
-        ChunkedImageFrame *self = reinterpret_cast<ChunkedImageFrame *>(opaque);
-        *row_offset = 0;
-        return nullptr;
-    }
-
-    static void ReleaseCurrentData(void *opaque, const void *buffer)
-    {
-        // qDebug() << "release at" << &buffer;
-        ChunkedImageFrame *self = reinterpret_cast<ChunkedImageFrame *>(opaque);
-        self->mutex.lock();
-        for (int i = 0; i < self->rawImageArray.size(); i++) {
-            if (self->rawImageArray.at(i).data() == buffer) {
-                self->rawImageArray[i].clear();
-                // qDebug() << "release at data" << i;
-            }
-        }
-        self->mutex.unlock();
-    }
-
-    bool isLarge{false};
-
-    size_t bytesPerChannel{0};
-    size_t numChannels{0};
-    JxlPixelFormat format{};
-
-    const QByteArray *imgraw{nullptr};
-    QIODevice *dev{nullptr};
-
-    QSize imgSize;
-    size_t bytesPerPixel{0};
+// pack the roi part of a converted 4 channel image into a freshly sized interleaved buffer
+inline void packImageToBuffer(const QImage &img, const QRect &roi, QByteArray &ba, EncodeBitDepth bitDepth, bool alpha)
+{
+    const size_t bpc = bytesPerChannel(bitDepth);
+    const size_t dstRow = ((alpha) ? 4 : 3) * bpc * static_cast<size_t>(roi.width());
+    ba.resize(static_cast<qsizetype>(dstRow * static_cast<size_t>(roi.height())));
+    const uchar *src = img.constScanLine(roi.y()) + static_cast<size_t>(roi.x()) * 4 * bpc;
+    const size_t srcStride = static_cast<size_t>(img.bytesPerLine());
+    char *dst = ba.data();
+    // big frames are split into row bands over the shared pool
+    WorkPool::instance().parallelRows(roi.height(), 128, [&](int y0, int y1) {
+        packInterleavedRows(src + static_cast<size_t>(y0) * srcStride,
+                            srcStride,
+                            dst + static_cast<size_t>(y0) * dstRow,
+                            dstRow,
+                            static_cast<size_t>(roi.width()),
+                            static_cast<size_t>(y1 - y0),
+                            bpc,
+                            alpha);
+    });
+}
 
-    // QString fname;
-    // int framenum{0};
-    // EncodeParams params;
-    // const QByteArray *rootICC;
-    // QByteArray imagerawdata;
-    QVector<QByteArray> rawImageArray;
-    // QVector<QSize> imgrawsizevec;
-    // QImageReader reader;
-    // bool isJxl{false};
-    QMutex mutex;
-};
+inline void packImageToBuffer(const QImage &img, QByteArray &ba, EncodeBitDepth bitDepth, bool alpha)
+{
+    packImageToBuffer(img, img.rect(), ba, bitDepth, alpha);
+}
 
 static constexpr char aboutData[] = {
     R"(<html><head/><body>
@@ -450,6 +376,9 @@ static constexpr char basicUsage[] = {
 <li><b>Alpha lossless</b>: if checked, alpha channel will set as lossless regardless of distance setting</li>
 <li><b>Alpha premultiply</b>: sets the alpha premultiply flag on libjxl</li>
 <li><b>Photon noise</b>: sets the ISO noise on encode</li>
+<li><b>Lookahead frames</b>: number of frames decoded and converted in the background ahead of the encoder, higher values use more RAM</li>
+<li><b>Stream huge inputs</b> (menu, needs chunked input): very large still images whose reader can decode regions (eg. JPEG) are decoded tile by tile while encoding instead of all at once</li>
+<li><b>Spill to disk</b>: frames bigger than this (in MiB, after packing) wait for the encoder in a temporary file inside the scratch directory instead of RAM, 0 = never</li>
 <li><b>Auto crop</b>: enables automatic frame cropping on animated input, set the color difference threshold with the spin box. Take note that enabling this will also explicitly enable JXL coalescing on input</li>
 </ul>
 </body></html>
@@ -2,22 +2,19 @@
 #include "./ui_mainwindow.h"
 
 #include <QColorSpace>
+#include <QCoreApplication>
 #include <QDebug>
 #include <QDragEnterEvent>
 #include <QFile>
 #include <QFileDialog>
 #include <QFileInfo>
+#include <QHash>
 #include <QImage>
 #include <QImageReader>
 #include <QMessageBox>
 #include <QMimeData>
-
-#include <QCborMap>
-#include <QCborValue>
-#include <QJsonArray>
-#include <QJsonDocument>
-#include <QJsonObject>
-#include <QJsonValue>
+#include <QPointer>
+#include <QThreadPool>
 
 #include <QCollator>
 #include <QTreeWidgetItem>
@@ -28,7 +25,9 @@
 
 #include "jxfrstchconfig.h"
 #include "jxlutils.h"
+#include "utils/inputprobe.h"
 #include "utils/jxlencoderobject.h"
+#include "utils/projectfile.h"
 
 #define USE_STREAMING_OUTPUT // need libjxl >= 0.10.0
 
@@ -85,6 +84,8 @@ public:
 
     QCollator collator;
     QVector<jxfrstch::InputFileData> inputFileList;
+    // probe records by file name, saved with the project and handed to the encoder
+    QHash<QString, jxfrstch::InputProbe> probes;
     QScopedPointer<JXLEncoderObject> encObj;
 
     QScopedPointer<QLabel> statLabel;
@@ -184,6 +185,12 @@ MainWindow::MainWindow(QWidget *parent)
     connect(ui->bitDepthCmb, &QComboBox::currentIndexChanged, this, &MainWindow::setUnsaved);
     connect(ui->alphaLosslessChk, &QCheckBox::toggled, this, &MainWindow::setUnsaved);
     connect(ui->alphaPremulChk, &QCheckBox::toggled, this, &MainWindow::setUnsaved);
+    connect(ui->lookaheadSpn, &QSpinBox::valueChanged, this, &MainWindow::setUnsaved);
+    connect(ui->spillThresholdSpn, &QSpinBox::valueChanged, this, &MainWindow::setUnsaved);
+    connect(ui->scratchDirLine, &QLineEdit::textChanged, this, &MainWindow::setUnsaved);
+    connect(ui->frameCacheSpn, &QSpinBox::valueChanged, this, &MainWindow::setUnsaved);
+    connect(ui->frameCacheDiskSpn, &QSpinBox::valueChanged, this, &MainWindow::setUnsaved);
+    connect(ui->frameCacheDirLine, &QLineEdit::textChanged, this, &MainWindow::setUnsaved);
 
     connect(ui->applyFrameBtn, &QPushButton::clicked, this, &MainWindow::currentFrameSettingChanged);
     connect(ui->outFileDirBtn, &QPushButton::clicked, this, &MainWindow::selectOutputFile);
@@ -298,6 +305,7 @@ void MainWindow::resetApp()
     }
     d->configSaveFile.clear();
     d->inputFileList.clear();
+    d->probes.clear();
     ui->treeWidget->clear();
     setWindowTitle(d->windowTitle);
     ui->isAnimatedBox->setChecked(true);
@@ -316,6 +324,12 @@ void MainWindow::resetApp()
     ui->photonNoiseSpn->setValue(0.0);
     ui->autoCropChk->setChecked(false);
     ui->autoCropTreshSpn->setValue(0.0);
+    ui->lookaheadSpn->setValue(4);
+    ui->spillThresholdSpn->setValue(0);
+    ui->scratchDirLine->clear();
+    ui->frameCacheSpn->setValue(0);
+    ui->frameCacheDiskSpn->setValue(0);
+    ui->frameCacheDirLine->clear();
 }
 
 void MainWindow::setUnsaved()
@@ -392,6 +406,9 @@ void MainWindow::resetOrder()
         ifd.frameYPos = itm->data(5, 0).toInt();
         ifd.blendMode = jxfrstch::stringToBlendMode(itm->data(6, 0).toString());
         ifd.frameName = itm->data(7, 0).toString();
+        ifd.frameIn = itm->data(8, 0).toInt();
+        ifd.frameOut = (itm->data(9, 0).toString() == "END") ? -1 : itm->data(9, 0).toInt();
+        ifd.frameStep = qMax(1, itm->data(10, 0).toInt());
         d->inputFileList.append(ifd);
     }
     std::sort(d->inputFileList.begin(),
@@ -410,6 +427,9 @@ void MainWindow::resetOrder()
         item->setData(5, 0, ifd.frameYPos);
         item->setData(6, 0, jxfrstch::blendModeToString(ifd.blendMode));
         item->setData(7, 0, ifd.frameName);
+        item->setData(8, 0, ifd.frameIn);
+        item->setData(9, 0, ifd.frameOut < 0 ? QVariant("END") : QVariant(ifd.frameOut));
+        item->setData(10, 0, ifd.frameStep);
         item->setBackground(0, {});
         item->setFlags(item->flags() & ~Qt::ItemIsDropEnabled);
         if (ifd.isRefFrame) {
@@ -475,6 +495,9 @@ void MainWindow::appendFilesFromList(const QStringList &lst) {
             item->setData(5, 0, ifd.frameYPos);
             item->setData(6, 0, jxfrstch::blendModeToString(ifd.blendMode));
             item->setData(7, 0, ifd.frameName);
+            item->setData(8, 0, ifd.frameIn);
+            item->setData(9, 0, ifd.frameOut < 0 ? QVariant("END") : QVariant(ifd.frameOut));
+            item->setData(10, 0, ifd.frameStep);
             item->setBackground(0, {});
             item->setFlags(item->flags() & ~Qt::ItemIsDropEnabled);
             if (ifd.isRefFrame) {
@@ -487,7 +510,61 @@ void MainWindow::appendFilesFromList(const QStringList &lst) {
         d->inputFileList.clear();
         ui->progressBar->hide();
         setUnsaved();
+        probeInputs(lst);
+    }
+}
+
+void MainWindow::probeInputs(const QStringList &lst, bool reportIssues)
+{
+    jxfrstch::EncodeParams params;
+    params.alpha = ui->alphaEnableChk->isChecked();
+    params.bitDepth = static_cast<EncodeBitDepth>(ui->bitDepthCmb->currentIndex());
+    params.colorSpace = static_cast<EncodeColorSpace>(ui->colorSpaceCmb->currentIndex());
+    params.coalesceJxlInput = ui->autoCropChk->isChecked() || ui->actionCoalesce_JXL_input->isChecked();
+
+    // the first input of the list is what the new ones get compared to
+    QVector<jxfrstch::InputFileData> files;
+    const QTreeWidgetItem *firstItem = ui->treeWidget->topLevelItem(0);
+    const QString firstFile = firstItem ? firstItem->data(0, 0).toString() : QString();
+    if (!firstFile.isEmpty() && !lst.contains(firstFile)) {
+        jxfrstch::InputFileData ifd;
+        ifd.filename = firstFile;
+        ifd.probe = d->probes.value(firstFile);
+        files.append(ifd);
+    }
+    for (const QString &fn : lst) {
+        jxfrstch::InputFileData ifd;
+        ifd.filename = fn;
+        files.append(ifd);
     }
+
+    ui->statusBar->showMessage(QString("Probing %1 inputs...").arg(lst.size()));
+    const QPointer<MainWindow> self(this);
+    QThreadPool::globalInstance()->start([self, files, params, reportIssues]() mutable {
+        jxfrstch::refreshProbes(files, params);
+        const QVector<jxfrstch::ProbeIssue> issues =
+            reportIssues ? jxfrstch::checkInputs(files, params) : QVector<jxfrstch::ProbeIssue>();
+        // qApp outlives the window, the window may be gone by then
+        QMetaObject::invokeMethod(
+            qApp,
+            [self, files, issues]() {
+                if (!self) {
+                    return;
+                }
+                for (const auto &ifd : files) {
+                    if (ifd.probe.fileSize >= 0) {
+                        self->d->probes.insert(ifd.filename, ifd.probe);
+                    }
+                }
+                self->ui->statusBar->showMessage("Inputs probed");
+                if (!issues.isEmpty()) {
+                    QMessageBox::warning(self,
+                                         "Input check",
+                                         QString("Some inputs don't fit the project:\n%1").arg(jxfrstch::formatIssues(issues)));
+                }
+            },
+            Qt::QueuedConnection);
+    });
 }
 
 void MainWindow::removeSelected()
@@ -518,6 +595,9 @@ void MainWindow::selectingFrames()
         ui->frameYPosSpn->setValue(currentSelItem->data(5, 0).toInt());
         ui->blendModeCmb->setCurrentIndex(5);
         ui->frameNameLine->setText("<unchanged>");
+        ui->frameInSpn->setValue(-1);
+        ui->frameOutSpn->setValue(-2);
+        ui->frameStepSpn->setValue(0);
 
         ui->frameXPosSpn->setEnabled(true);
         ui->frameYPosSpn->setEnabled(true);
@@ -539,6 +619,9 @@ void MainWindow::selectingFrames()
         ui->frameXPosSpn->setValue(currentSelItem->data(4, 0).toInt());
         ui->frameYPosSpn->setValue(currentSelItem->data(5, 0).toInt());
         ui->frameNameLine->setText(currentSelItem->data(7, 0).toString());
+        ui->frameInSpn->setValue(currentSelItem->data(8, 0).toInt());
+        ui->frameOutSpn->setValue((currentSelItem->data(9, 0).toString() == "END") ? -1 : currentSelItem->data(9, 0).toInt());
+        ui->frameStepSpn->setValue(qMax(1, currentSelItem->data(10, 0).toInt()));
         if (ui->saveAsRefSpn->value() > 0) {
             ui->frameDurationSpn->setEnabled(false);
             ui->frameRefSpinBox->setEnabled(false);
@@ -602,50 +685,52 @@ bool MainWindow::saveConfigAs(bool forceDialog)
     if (ui->treeWidget->topLevelItemCount() == 0) {
         return false;
     }
-    QJsonArray files;
+    jxfrstch::ProjectData project;
     for (int i = 0; i < ui->treeWidget->topLevelItemCount(); i++) {
         const auto *itm = ui->treeWidget->topLevelItem(i);
 
-        QJsonObject jsobj;
-
-        jsobj["filename"] = itm->data(0, 0).toString();
-        jsobj["isRef"] = itm->data(1, 0).toInt();
+        jxfrstch::InputFileData ifd;
         bool isDurInt = true;
-        int fDur = itm->data(2, 0).toInt(&isDurInt);
+        ifd.filename = itm->data(0, 0).toString();
+        ifd.isRefFrame = itm->data(1, 0).toInt();
+        ifd.frameDuration = itm->data(2, 0).toInt(&isDurInt);
         if (!isDurInt) {
-            jsobj["frameDur"] = 1;
-            jsobj["frameEndP"] = true;
-        } else {
-            jsobj["frameDur"] = itm->data(2, 0).toInt();
-            jsobj["frameEndP"] = false;
+            ifd.frameDuration = 1;
+            ifd.isPageEnd = true;
         }
-        jsobj["frameRef"] = itm->data(3, 0).toInt();
-        jsobj["frameXPos"] = itm->data(4, 0).toInt();
-        jsobj["frameYPos"] = itm->data(5, 0).toInt();
-        jsobj["blend"] = jxfrstch::stringToBlendMode(itm->data(6, 0).toString());
-        jsobj["frameName"] = itm->data(7, 0).toString();
-        files.append(jsobj);
+        ifd.frameReference = itm->data(3, 0).toInt();
+        ifd.frameXPos = itm->data(4, 0).toInt();
+        ifd.frameYPos = itm->data(5, 0).toInt();
+        ifd.blendMode = jxfrstch::stringToBlendMode(itm->data(6, 0).toString());
+        ifd.frameName = itm->data(7, 0).toString();
+        ifd.frameIn = itm->data(8, 0).toInt();
+        ifd.frameOut = (itm->data(9, 0).toString() == "END") ? -1 : itm->data(9, 0).toInt();
+        ifd.frameStep = qMax(1, itm->data(10, 0).toInt());
+        project.files.append(ifd);
     }
 
-    QJsonObject sets;
-    sets["useAlpha"] = ui->alphaEnableChk->isChecked();
-    sets["usePremulAlpha"] = ui->alphaPremulChk->isChecked();
-    sets["useLosslessAlpha"] = ui->alphaLosslessChk->isChecked();
-    sets["bitdepth"] = ui->bitDepthCmb->currentIndex();
-    sets["encDistance"] = ui->distanceSpn->value();
-    sets["encEffort"] = ui->effortSpn->value();
-    sets["numerator"] = ui->numeratorSpn->value();
-    sets["denominator"] = ui->denominatorSpn->value();
-    sets["numLoops"] = ui->loopsSpinBox->value();
-    sets["useAnimation"] = ui->isAnimatedBox->isChecked();
-    sets["colorSpace"] = ui->colorSpaceCmb->currentIndex();
-    sets["photonNoise"] = ui->photonNoiseSpn->value();
-    sets["autoCrop"] = ui->autoCropChk->isChecked();
-    sets["autoCropThr"] = ui->autoCropTreshSpn->value();
-    sets["autoCropOnlyFile"] = ui->onlyCropAnimatedChk->isChecked();
-    sets["fileList"] = files;
-
-    const QByteArray binsave = QCborValue::fromJsonValue(sets).toCbor();
+    jxfrstch::EncodeParams &params = project.params;
+    params.alpha = ui->alphaEnableChk->isChecked();
+    params.premulAlpha = ui->alphaPremulChk->isChecked();
+    params.losslessAlpha = ui->alphaLosslessChk->isChecked();
+    params.bitDepth = static_cast<EncodeBitDepth>(ui->bitDepthCmb->currentIndex());
+    params.distance = ui->distanceSpn->value();
+    params.effort = ui->effortSpn->value();
+    params.numerator = ui->numeratorSpn->value();
+    params.denominator = ui->denominatorSpn->value();
+    params.loops = ui->loopsSpinBox->value();
+    params.animation = ui->isAnimatedBox->isChecked();
+    params.colorSpace = static_cast<EncodeColorSpace>(ui->colorSpaceCmb->currentIndex());
+    params.photonNoise = ui->photonNoiseSpn->value();
+    params.autoCropFrame = ui->autoCropChk->isChecked();
+    params.autoCropFuzzyComparison = ui->autoCropTreshSpn->value();
+    params.onlyCropAnimatedFile = ui->onlyCropAnimatedChk->isChecked();
+    params.lookaheadFrames = ui->lookaheadSpn->value();
+    params.spillThresholdMiB = ui->spillThresholdSpn->value();
+    params.scratchDir = ui->scratchDirLine->text();
+    params.frameCacheMiB = ui->frameCacheSpn->value();
+    params.frameCacheDiskMiB = ui->frameCacheDiskSpn->value();
+    params.frameCacheDir = ui->frameCacheDirLine->text();
 
     const QString tmpfn = [&]() {
         if (forceDialog || d->configSaveFile.isEmpty()) {
@@ -658,16 +743,27 @@ bool MainWindow::saveConfigAs(bool forceDialog)
     }();
 
     if (!tmpfn.isEmpty()) {
-        QFile outF(tmpfn);
-        outF.open(QIODevice::WriteOnly);
-        if (outF.isWritable()) {
-            outF.write(binsave);
+        // only records still matching their file are saved, missing ones are probed in the background
+        // for the next save, encoding checks the rest anyway
+        QStringList unprobed;
+        for (auto &ifd : project.files) {
+            const jxfrstch::InputProbe probe = d->probes.value(ifd.filename);
+            if (probe.isCurrent(ifd.filename)) {
+                ifd.probe = probe;
+            } else if (!unprobed.contains(ifd.filename)) {
+                unprobed.append(ifd.filename);
+            }
+        }
+        if (!unprobed.isEmpty()) {
+            probeInputs(unprobed, false);
+        }
+
+        if (jxfrstch::writeProjectFile(tmpfn, project)) {
             d->configSaveFile = tmpfn;
             QFileInfo outFInfo(tmpfn);
             setWindowTitle(QString("%1 - %2").arg(d->windowTitle, outFInfo.fileName()));
             ui->statusBar->showMessage("Config saved");
         }
-        outF.close();
     } else {
         return false;
     }
@@ -714,117 +810,65 @@ void MainWindow::openConfig()
 
 void MainWindow::openConfig(const QString &tmpfn)
 {
-    QByteArray binsave;
-    if (!tmpfn.isEmpty()) {
-        QFile outF(tmpfn);
-        outF.open(QIODevice::ReadOnly);
-        if (outF.isReadable()) {
-            binsave = outF.readAll();
-        } else {
-            outF.close();
-            ui->statusBar->showMessage("Failed to read config file");
-            return;
-        }
-        outF.close();
-    }
-
-    if (binsave.isEmpty()) {
+    jxfrstch::ProjectData project;
+    if (!jxfrstch::readProjectFile(tmpfn, project)) {
         ui->statusBar->showMessage("Failed to read config file");
         return;
     }
 
-    const QJsonObject loadjs = QCborValue::fromCbor(binsave).toMap().toJsonObject();
-    if (!loadjs.isEmpty()) {
-        const bool useAlpha = loadjs.value("useAlpha").toBool(true);
-        const bool usePremulAlpha = loadjs.value("usePremulAlpha").toBool(false);
-        const bool useLosslessAlpha = loadjs.value("useLosslessAlpha").toBool(true);
-        const int bitdepth = loadjs.value("bitdepth").toInt(0);
-        const double encDistance = loadjs.value("encDistance").toDouble(0.0);
-        const int encEffort = loadjs.value("encEffort").toInt(1);
-        const int numerator = loadjs.value("numerator").toInt(1);
-        const int denominator = loadjs.value("denominator").toInt(1);
-        const int numLoops = loadjs.value("numLoops").toInt(0);
-        const bool useAnimation = loadjs.value("useAnimation").toBool(true);
-        const int colorSpace = loadjs.value("colorSpace").toInt(0);
-        const double photonNoise = loadjs.value("photonNoise").toDouble(0.0);
-        const bool autoCrop = loadjs.value("autoCrop").toBool(false);
-        const double autoCropThr = loadjs.value("autoCropThr").toDouble(0.0);
-        const bool autoCropOnlyFile = loadjs.value("autoCropOnlyFile").toBool(false);
-
-        ui->alphaEnableChk->setChecked(useAlpha);
-        ui->alphaPremulChk->setChecked(usePremulAlpha);
-        ui->alphaLosslessChk->setChecked(useLosslessAlpha);
-        ui->bitDepthCmb->setCurrentIndex(bitdepth);
-        ui->distanceSpn->setValue(encDistance);
-        ui->effortSpn->setValue(encEffort);
-        ui->numeratorSpn->setValue(numerator);
-        ui->denominatorSpn->setValue(denominator);
-        ui->loopsSpinBox->setValue(numLoops);
-        ui->isAnimatedBox->setChecked(useAnimation);
-        ui->colorSpaceCmb->setCurrentIndex(colorSpace);
-        ui->photonNoiseSpn->setValue(photonNoise);
-        ui->autoCropChk->setChecked(autoCrop);
-        ui->autoCropTreshSpn->setValue(autoCropThr);
-        ui->onlyCropAnimatedChk->setChecked(autoCropOnlyFile);
-
-        if (loadjs.value("fileList").isArray()) {
-            const QJsonArray farray = loadjs.value("fileList").toArray();
-            d->inputFileList.clear();
-
-            ui->treeWidget->clear();
-            foreach (const auto &fs, farray) {
-                const QJsonObject ff = fs.toObject();
-                const QString tmpFile = ff.value("filename").toString();
-                const JxlBlendMode tmpBlend = static_cast<JxlBlendMode>(ff.value("blend").toInt(2));
-                const int tmpFrameDur = ff.value("frameDur").toInt(1);
-                const int tmpFrameRef = ff.value("frameRef").toInt(0);
-                const bool tmpFrameEndPage = ff.value("frameEndP").toBool(false);
-                const int tmpIsRef = [&]() {
-                    if (ff.value("isRef").isBool()) {
-                        return ff.value("isRef").toBool(false) ? 1 : 0;
-                    }
-                    return ff.value("isRef").toInt(0);
-                }();
-                const int tmpFrameX = ff.value("frameXPos").toInt(0);
-                const int tmpFrameY = ff.value("frameYPos").toInt(0);
-                const QString tmpFrameName = ff.value("frameName").toString();
-
-                if (!tmpFile.isEmpty()) {
-
-                    jxfrstch::InputFileData ifd;
-                    ifd.filename = tmpFile;
-                    ifd.blendMode = tmpBlend;
-                    ifd.frameDuration = tmpFrameDur;
-                    ifd.frameReference = tmpFrameRef;
-                    ifd.isRefFrame = tmpIsRef;
-                    ifd.frameXPos = tmpFrameX;
-                    ifd.frameYPos = tmpFrameY;
-                    ifd.frameName = tmpFrameName;
-                    ifd.isPageEnd = tmpFrameEndPage;
-
-                    QTreeWidgetItem *item = new QTreeWidgetItem(ui->treeWidget);
-                    item->setData(0, 0, ifd.filename);
-                    item->setData(1, 0, ifd.isRefFrame);
-                    item->setData(2, 0, ifd.frameDuration);
-                    if (ifd.isPageEnd)
-                        item->setData(2, 0, "END");
-                    item->setData(3, 0, ifd.frameReference);
-                    item->setData(4, 0, ifd.frameXPos);
-                    item->setData(5, 0, ifd.frameYPos);
-                    item->setData(6, 0, jxfrstch::blendModeToString(ifd.blendMode));
-                    item->setData(7, 0, ifd.frameName);
-                    item->setBackground(0, {});
-                    item->setFlags(item->flags() & ~Qt::ItemIsDropEnabled);
-                    if (ifd.isRefFrame) {
-                        item->setBackground(1, QColor(128, 255, 128));
-                    }
-                    if (ifd.isPageEnd) {
-                        item->setBackground(2, QColor(255, 255, 128));
-                    }
-                    ui->treeWidget->addTopLevelItem(item);
-                }
-            }
+    const jxfrstch::EncodeParams &params = project.params;
+    ui->alphaEnableChk->setChecked(params.alpha);
+    ui->alphaPremulChk->setChecked(params.premulAlpha);
+    ui->alphaLosslessChk->setChecked(params.losslessAlpha);
+    ui->bitDepthCmb->setCurrentIndex(params.bitDepth);
+    ui->distanceSpn->setValue(params.distance);
+    ui->effortSpn->setValue(params.effort);
+    ui->numeratorSpn->setValue(params.numerator);
+    ui->denominatorSpn->setValue(params.denominator);
+    ui->loopsSpinBox->setValue(params.loops);
+    ui->isAnimatedBox->setChecked(params.animation);
+    ui->colorSpaceCmb->setCurrentIndex(params.colorSpace);
+    ui->photonNoiseSpn->setValue(params.photonNoise);
+    ui->autoCropChk->setChecked(params.autoCropFrame);
+    ui->autoCropTreshSpn->setValue(params.autoCropFuzzyComparison);
+    ui->onlyCropAnimatedChk->setChecked(params.onlyCropAnimatedFile);
+    ui->lookaheadSpn->setValue(params.lookaheadFrames);
+    ui->spillThresholdSpn->setValue(params.spillThresholdMiB);
+    ui->scratchDirLine->setText(params.scratchDir);
+    ui->frameCacheSpn->setValue(params.frameCacheMiB);
+    ui->frameCacheDiskSpn->setValue(params.frameCacheDiskMiB);
+    ui->frameCacheDirLine->setText(params.frameCacheDir);
+
+    d->inputFileList.clear();
+    d->probes.clear();
+    ui->treeWidget->clear();
+    foreach (const auto &ifd, project.files) {
+        if (ifd.probe.fileSize >= 0) {
+            d->probes.insert(ifd.filename, ifd.probe);
         }
+        QTreeWidgetItem *item = new QTreeWidgetItem(ui->treeWidget);
+        item->setData(0, 0, ifd.filename);
+        item->setData(1, 0, ifd.isRefFrame);
+        item->setData(2, 0, ifd.frameDuration);
+        if (ifd.isPageEnd)
+            item->setData(2, 0, "END");
+        item->setData(3, 0, ifd.frameReference);
+        item->setData(4, 0, ifd.frameXPos);
+        item->setData(5, 0, ifd.frameYPos);
+        item->setData(6, 0, jxfrstch::blendModeToString(ifd.blendMode));
+        item->setData(7, 0, ifd.frameName);
+        item->setData(8, 0, ifd.frameIn);
+        item->setData(9, 0, ifd.frameOut < 0 ? QVariant("END") : QVariant(ifd.frameOut));
+        item->setData(10, 0, ifd.frameStep);
+        item->setBackground(0, {});
+        item->setFlags(item->flags() & ~Qt::ItemIsDropEnabled);
+        if (ifd.isRefFrame) {
+            item->setBackground(1, QColor(128, 255, 128));
+        }
+        if (ifd.isPageEnd) {
+            item->setBackground(2, QColor(255, 255, 128));
+        }
+        ui->treeWidget->addTopLevelItem(item);
     }
 
     d->configSaveFile = tmpfn;
@@ -848,6 +892,9 @@ void MainWindow::currentFrameSettingChanged()
     const bool changeFrameName = (ui->frameNameLine->text() != "<unchanged>");
     const bool changeSaveRef = (ui->saveAsRefSpn->value() >= 0);
     const bool changePageEnd = (ui->pageEndChk->checkState() != Qt::PartiallyChecked);
+    const bool changeFrameIn = (ui->frameInSpn->value() >= 0);
+    const bool changeFrameOut = (ui->frameOutSpn->value() >= -1);
+    const bool changeFrameStep = (ui->frameStepSpn->value() >= 1);
 
     foreach (const auto &v, selItemList) {
         if (changeSaveRef) {
@@ -880,6 +927,12 @@ void MainWindow::currentFrameSettingChanged()
         if (changeFrameName) {
             v->setData(7, 0, ui->frameNameLine->text());
         }
+        if (changeFrameIn)
+            v->setData(8, 0, ui->frameInSpn->value());
+        if (changeFrameOut)
+            v->setData(9, 0, (ui->frameOutSpn->value() < 0) ? QVariant("END") : QVariant(ui->frameOutSpn->value()));
+        if (changeFrameStep)
+            v->setData(10, 0, ui->frameStepSpn->value());
         if (changeFrameBlend) {
             JxlBlendMode bld;
             switch (ui->blendModeCmb->currentIndex()) {
@@ -961,6 +1014,13 @@ void MainWindow::doEncode()
     params.autoCropFuzzyComparison = ui->autoCropTreshSpn->value();
     params.coalesceJxlInput = ui->autoCropChk ? true : ui->actionCoalesce_JXL_input->isChecked();
     params.chunkedFrame = ui->actionUse_chunked_input->isChecked();
+    params.streamInputs = params.chunkedFrame && ui->actionStream_huge_inputs->isChecked();
+    params.lookaheadFrames = ui->lookaheadSpn->value();
+    params.spillThresholdMiB = ui->spillThresholdSpn->value();
+    params.scratchDir = ui->scratchDirLine->text();
+    params.frameCacheMiB = ui->frameCacheSpn->value();
+    params.frameCacheDiskMiB = ui->frameCacheDiskSpn->value();
+    params.frameCacheDir = ui->frameCacheDirLine->text();
 
     if (encEffort > 10) {
         const auto diag = QMessageBox::warning(this,
@@ -1030,6 +1090,11 @@ void MainWindow::doEncode()
         ind.frameYPos = itm->data(5, 0).toInt();
         ind.blendMode = jxfrstch::stringToBlendMode(itm->data(6, 0).toString());
         ind.frameName = itm->data(7, 0).toString();
+        ind.frameIn = itm->data(8, 0).toInt();
+        ind.frameOut = (itm->data(9, 0).toString() == "END") ? -1 : itm->data(9, 0).toInt();
+        ind.frameStep = qMax(1, itm->data(10, 0).toInt());
+        // checked against the file before anything trusts it
+        ind.probe = d->probes.value(ind.filename);
 
         d->encObj->appendInputFiles(ind);
     }
@@ -1037,7 +1102,7 @@ void MainWindow::doEncode()
     if (d->encObj->canEncode()) {
         d->encObj->start();
     } else {
-        ui->statusBar->showMessage("Encode aborted: unable to read first frame data!");
+        ui->statusBar->showMessage("Encode aborted: input check failed!");
         ui->encodeBtn->setText("Encode");
         ui->menuBar->setEnabled(true);
         ui->frameListGrp->setEnabled(true);
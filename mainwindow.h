@@ -34,6 +34,9 @@ private slots:
     void resetOrder();
 
 private:
+    // header probing of files in the background, reports what doesn't fit once done if asked to
+    void probeInputs(const QStringList &lst, bool reportIssues = true);
+
     void dragEnterEvent(QDragEnterEvent *event) override;
     void dragMoveEvent(QDragMoveEvent *event) override;
     void dropEvent(QDropEvent *event) override;
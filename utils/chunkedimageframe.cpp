@@ -0,0 +1,286 @@
+#include "chunkedimageframe.h"
+#include "streamedimage.h"
+
+#include <QFileDevice>
+
+#if defined(Q_OS_UNIX)
+#include <cerrno>
+#include <unistd.h>
+#define CHUNKED_PREAD
+#endif
+
+namespace jxfrstch
+{
+ChunkedImageFrame::ChunkedImageFrame(JxlPixelFormat infmt, size_t bytesperchan, QSize imSize)
+    : format(infmt)
+    , bytesPerChannel(bytesperchan)
+    , numChannels(infmt.num_channels)
+    , imgSize(imSize)
+{
+    bytesPerPixel = numChannels * bytesPerChannel;
+}
+
+ChunkedImageFrame::~ChunkedImageFrame() = default;
+
+JxlChunkedFrameInputSource ChunkedImageFrame::getChunkedStruct()
+{
+    return JxlChunkedFrameInputSource{this,
+                                      GetColorChannelsPixelFormat,
+                                      GetColorChannelDataAt,
+                                      GetExtraChannelPixelFormat,
+                                      GetExtraChannelDataAt,
+                                      ReleaseCurrentData};
+}
+
+void ChunkedImageFrame::inputData(const QByteArray *imin)
+{
+    imgraw = reinterpret_cast<const uchar *>(imin->constData());
+}
+
+void ChunkedImageFrame::inputData(const uchar *raw)
+{
+    imgraw = raw;
+}
+
+void ChunkedImageFrame::inputData(QFileDevice *dev)
+{
+    file = dev;
+    fileHandle = dev->handle();
+}
+
+void ChunkedImageFrame::inputData(const QImage *img, const QRect &roi)
+{
+    qimg = img;
+    origin = roi.topLeft();
+    imgSize = roi.size();
+}
+
+void ChunkedImageFrame::inputData(StreamedImageSource *src)
+{
+    stream = src;
+}
+
+void ChunkedImageFrame::setPlanarAlpha(bool planar)
+{
+    planarAlpha = planar && numChannels == 4;
+}
+
+void ChunkedImageFrame::GetColorChannelsPixelFormat(void *opaque, JxlPixelFormat *pixel_format)
+{
+    ChunkedImageFrame *self = reinterpret_cast<ChunkedImageFrame *>(opaque);
+    *pixel_format = self->format;
+    pixel_format->num_channels = static_cast<uint32_t>(self->colorChannels());
+}
+
+const void *ChunkedImageFrame::GetColorChannelDataAt(void *opaque,
+                                                     size_t xpos,
+                                                     size_t ypos,
+                                                     size_t xsize,
+                                                     size_t ysize,
+                                                     size_t *row_offset)
+{
+    ChunkedImageFrame *self = reinterpret_cast<ChunkedImageFrame *>(opaque);
+    // qDebug() << "GetColorChannelDataAt xpos" << xpos << "ypos" << ypos << "xsize" << xsize << "ysize" << ysize;
+
+    const SourceRows rows = self->sourceRows(xpos, ypos, xsize, ysize);
+    if (!rows.data) {
+        return nullptr;
+    }
+    if (self->colorChannels() == self->sourceChannels()) {
+        self->pinRegion(rows);
+        *row_offset = rows.stride;
+        return rows.data;
+    }
+
+    // drop the 4th channel, either X or alpha going in separately
+    // (libjxl refuses interleaved alpha on images without one)
+    *row_offset = xsize * self->colorChannels() * self->bytesPerChannel;
+    uchar *tile = self->acquireTile(*row_offset * ysize);
+    packInterleavedRows(rows.data, rows.stride, tile, *row_offset, xsize, ysize, self->bytesPerChannel, false);
+    if (rows.pooled) {
+        self->releaseTile(rows.data);
+    }
+    return tile;
+}
+
+void ChunkedImageFrame::GetExtraChannelPixelFormat(void *opaque, size_t ec_index, JxlPixelFormat *pixel_format)
+{
+    // qDebug() << "GetExtraChannelPixelFormat at" << ec_index;
+    Q_UNUSED(ec_index);
+    ChunkedImageFrame *self = reinterpret_cast<ChunkedImageFrame *>(opaque);
+    *pixel_format = self->format;
+    pixel_format->num_channels = 1;
+}
+
+const void *ChunkedImageFrame::GetExtraChannelDataAt(void *opaque,
+                                                     size_t ec_index,
+                                                     size_t xpos,
+                                                     size_t ypos,
+                                                     size_t xsize,
+                                                     size_t ysize,
+                                                     size_t *row_offset)
+{
+    // qDebug() << "GetExtraChannelDataAt at" << ec_index;
+    ChunkedImageFrame *self = reinterpret_cast<ChunkedImageFrame *>(opaque);
+    *row_offset = 0;
+
+    // alpha is the only extra channel we ever set up
+    if (!self->planarAlpha || ec_index != 0) {
+        return nullptr;
+    }
+
+    const SourceRows rows = self->sourceRows(xpos, ypos, xsize, ysize);
+    if (!rows.data) {
+        return nullptr;
+    }
+    *row_offset = xsize * self->bytesPerChannel;
+    uchar *tile = self->acquireTile(*row_offset * ysize);
+    extractChannelRows(rows.data, rows.stride, tile, *row_offset, xsize, ysize, self->bytesPerChannel, 4, 3);
+    if (rows.pooled) {
+        self->releaseTile(rows.data);
+    }
+    return tile;
+}
+
+ChunkedImageFrame::SourceRows ChunkedImageFrame::sourceRows(size_t xpos, size_t ypos, size_t xsize, size_t ysize)
+{
+    SourceRows rows;
+    const size_t srcBytesPerPixel = sourceChannels() * bytesPerChannel;
+
+    if (imgraw) {
+        rows.stride = imgSize.width() * srcBytesPerPixel;
+        rows.data = imgraw + ypos * rows.stride + xpos * srcBytesPerPixel;
+    } else if (qimg) {
+        rows.stride = static_cast<size_t>(qimg->bytesPerLine());
+        rows.data = qimg->constScanLine(origin.y() + static_cast<int>(ypos)) + (origin.x() + xpos) * srcBytesPerPixel;
+    } else if (file) {
+        const size_t rowBytes = imgSize.width() * srcBytesPerPixel;
+        const size_t tileRow = xsize * srcBytesPerPixel;
+        uchar *tile = acquireTile(tileRow * ysize);
+        const qint64 begin = static_cast<qint64>(ypos * rowBytes + xpos * srcBytesPerPixel);
+
+        bool ok = true;
+        if (tileRow == rowBytes) {
+            // full width tile is a single contiguous read
+            ok = readFile(tile, begin, tileRow * ysize);
+        } else {
+            for (size_t y = 0; y < ysize && ok; y++) {
+                ok = readFile(tile + y * tileRow, begin + static_cast<qint64>(y * rowBytes), tileRow);
+            }
+        }
+        if (!ok) {
+            releaseTile(tile);
+            return rows;
+        }
+        rows.data = tile;
+        rows.stride = tileRow;
+        rows.pooled = true;
+    } else if (stream) {
+        rows.region = stream->region(
+            QRect(static_cast<int>(xpos), static_cast<int>(ypos), static_cast<int>(xsize), static_cast<int>(ysize)));
+        if (!rows.region.isNull()) {
+            rows.data = rows.region.constBits();
+            rows.stride = static_cast<size_t>(rows.region.bytesPerLine());
+        }
+    }
+    return rows;
+}
+
+void ChunkedImageFrame::pinRegion(const SourceRows &rows)
+{
+    if (rows.region.isNull()) {
+        return;
+    }
+    // the same cached region can be handed out to several threads at once, so one pin per request
+    QMutexLocker locker(&poolMutex);
+    pinned.insert(rows.data, rows.region);
+}
+
+size_t ChunkedImageFrame::sourceChannels() const
+{
+    // converted QImages are always 4 channels, packed buffers follow the encode format
+    return (qimg || stream) ? 4 : numChannels;
+}
+
+size_t ChunkedImageFrame::colorChannels() const
+{
+    return planarAlpha ? 3 : numChannels;
+}
+
+void ChunkedImageFrame::ReleaseCurrentData(void *opaque, const void *buffer)
+{
+    // qDebug() << "release at" << &buffer;
+    ChunkedImageFrame *self = reinterpret_cast<ChunkedImageFrame *>(opaque);
+    self->releaseTile(buffer);
+}
+
+uchar *ChunkedImageFrame::acquireTile(size_t bytes)
+{
+    int slot = -1;
+    Tile *t = nullptr;
+    {
+        QMutexLocker locker(&poolMutex);
+        if (!freeSlots.empty()) {
+            slot = freeSlots.back();
+            freeSlots.pop_back();
+        } else {
+            slot = static_cast<int>(tiles.size());
+            tiles.emplace_back();
+        }
+        t = &tiles[slot];
+    }
+
+    // the slot belongs to this thread now, grow it without holding the lock
+    if (t->capacity < bytes) {
+        t->data.reset(new uchar[bytes]);
+        t->capacity = bytes;
+    }
+
+    QMutexLocker locker(&poolMutex);
+    slotOf.insert(t->data.get(), slot);
+    return t->data.get();
+}
+
+void ChunkedImageFrame::releaseTile(const void *buffer)
+{
+    // pointers into the source were never taken from the pool, decoded regions only need unpinning
+    QMutexLocker locker(&poolMutex);
+    const auto it = slotOf.constFind(buffer);
+    if (it == slotOf.constEnd()) {
+        const auto pin = pinned.find(buffer);
+        if (pin != pinned.end()) {
+            pinned.erase(pin);
+        }
+        return;
+    }
+    freeSlots.push_back(it.value());
+    slotOf.erase(it);
+}
+
+bool ChunkedImageFrame::readFile(uchar *dst, qint64 offset, size_t bytes)
+{
+#if defined(CHUNKED_PREAD)
+    if (fileHandle >= 0) {
+        while (bytes > 0) {
+            const ssize_t got = ::pread(fileHandle, dst, bytes, static_cast<off_t>(offset));
+            if (got < 0 && errno == EINTR) {
+                continue;
+            }
+            if (got <= 0) {
+                return false;
+            }
+            dst += got;
+            offset += got;
+            bytes -= static_cast<size_t>(got);
+        }
+        return true;
+    }
+#endif
+    // shared file cursor, one reader at a time
+    QMutexLocker locker(&fileMutex);
+    if (!file->seek(offset)) {
+        return false;
+    }
+    return file->read(reinterpret_cast<char *>(dst), static_cast<qint64>(bytes)) == static_cast<qint64>(bytes);
+}
+} // namespace jxfrstch
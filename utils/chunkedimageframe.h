@@ -0,0 +1,107 @@
+#ifndef CHUNKEDIMAGEFRAME_H
+#define CHUNKEDIMAGEFRAME_H
+
+#include "jxlutils.h"
+
+#include <QHash>
+#include <QMutex>
+
+#include <deque>
+#include <memory>
+#include <vector>
+
+class QFileDevice;
+class StreamedImageSource;
+
+namespace jxfrstch
+{
+/*
+ * JxlChunkedFrameInputSource over one frame, fed from either a packed buffer (memory or mapped file),
+ * a packed file read with positional reads, a converted 4 channel QImage, or regions decoded on demand
+ *
+ * libjxl asks for tiles from its worker threads concurrently. Tiles that can be pointed at are returned
+ * as is, everything else is read/packed into buffers recycled from a small pool. The lock only guards
+ * taking and returning pool slots, never the reads themselves
+ */
+class ChunkedImageFrame
+{
+public:
+    ChunkedImageFrame(JxlPixelFormat infmt, size_t bytesperchan, QSize imSize);
+    ~ChunkedImageFrame();
+
+    JxlChunkedFrameInputSource getChunkedStruct();
+
+    void inputData(const QByteArray *imin);
+    // packed frame living somewhere else, eg. a mapped spill file
+    void inputData(const uchar *raw);
+    // packed frame in a file, read on demand
+    void inputData(QFileDevice *file);
+    // read straight from a converted 4 channel image, roi is the part encoded as this frame
+    void inputData(const QImage *img, const QRect &roi);
+    // decode only the requested tiles from a huge still image
+    void inputData(StreamedImageSource *src);
+
+    // feed alpha as a planar extra channel instead of interleaved with color (only with a 4 channel format)
+    void setPlanarAlpha(bool planar);
+
+private:
+    static void GetColorChannelsPixelFormat(void *opaque, JxlPixelFormat *pixel_format);
+    static const void *
+    GetColorChannelDataAt(void *opaque, size_t xpos, size_t ypos, size_t xsize, size_t ysize, size_t *row_offset);
+    static void GetExtraChannelPixelFormat(void *opaque, size_t ec_index, JxlPixelFormat *pixel_format);
+    static const void *GetExtraChannelDataAt(void *opaque,
+                                             size_t ec_index,
+                                             size_t xpos,
+                                             size_t ypos,
+                                             size_t xsize,
+                                             size_t ysize,
+                                             size_t *row_offset);
+    static void ReleaseCurrentData(void *opaque, const void *buffer);
+
+    // source pixels of a tile, either pointing into the source or read into a pool tile
+    struct SourceRows {
+        const uchar *data{nullptr};
+        size_t stride{0};
+        bool pooled{false};
+        QImage region{}; // decoded region data points into, has to live until released
+    };
+    SourceRows sourceRows(size_t xpos, size_t ypos, size_t xsize, size_t ysize);
+    size_t sourceChannels() const;
+    size_t colorChannels() const;
+
+    void pinRegion(const SourceRows &rows);
+    uchar *acquireTile(size_t bytes);
+    void releaseTile(const void *buffer);
+    bool readFile(uchar *dst, qint64 offset, size_t bytes);
+
+    struct Tile {
+        std::unique_ptr<uchar[]> data;
+        size_t capacity{0};
+    };
+
+    JxlPixelFormat format{};
+    size_t bytesPerChannel{0};
+    size_t numChannels{0};
+    size_t bytesPerPixel{0};
+    QSize imgSize;
+
+    const uchar *imgraw{nullptr};
+    QFileDevice *file{nullptr};
+    int fileHandle{-1};
+    const QImage *qimg{nullptr};
+    QPoint origin;
+    StreamedImageSource *stream{nullptr};
+    bool planarAlpha{false};
+
+    QMutex poolMutex;
+    std::deque<Tile> tiles; // deque, so a slot stays put while others are added
+    std::vector<int> freeSlots;
+    QHash<const void *, int> slotOf;
+    QMultiHash<const void *, QImage> pinned;
+
+    // only for platforms without positional reads
+    QMutex fileMutex;
+};
+} // namespace jxfrstch
+
+#endif // CHUNKEDIMAGEFRAME_H
@@ -0,0 +1,235 @@
+#include "colortransform.h"
+#include "workpool.h"
+
+#include <QCryptographicHash>
+#include <QHash>
+#include <QList>
+#include <QMutex>
+#include <QSharedPointer>
+
+#include <lcms2.h>
+
+namespace
+{
+// transforms kept around, a project rarely has more than a couple of source profiles
+constexpr int MAX_CACHED_TRANSFORMS = 16;
+// don't split frames into bands thinner than this
+constexpr int MIN_BAND_ROWS = 64;
+
+struct TargetProfile {
+    QByteArray icc;
+    QByteArray fingerprint;
+    QColorSpace colorSpace;
+};
+
+struct TransformKey {
+    QByteArray src;
+    QByteArray dst;
+    int format{0};
+
+    bool operator==(const TransformKey &rhs) const
+    {
+        return format == rhs.format && src == rhs.src && dst == rhs.dst;
+    }
+};
+
+size_t qHash(const TransformKey &key, size_t seed = 0)
+{
+    return qHashMulti(seed, key.src, key.dst, key.format);
+}
+
+// null when lcms2 can't build it
+using TransformPtr = QSharedPointer<void>;
+
+QByteArray fingerprint(const QByteArray &icc)
+{
+    return QCryptographicHash::hash(icc, QCryptographicHash::Sha1);
+}
+
+cmsUInt32Number lcmsFormat(QImage::Format format)
+{
+    // X is carried along like alpha, cmsFLAGS_COPY_ALPHA keeps both untouched
+    switch (format) {
+    case QImage::Format_RGBA8888:
+    case QImage::Format_RGBX8888:
+        return TYPE_RGBA_8;
+    case QImage::Format_RGBA64:
+    case QImage::Format_RGBX64:
+        return TYPE_RGBA_16;
+    case QImage::Format_RGBA16FPx4:
+    case QImage::Format_RGBX16FPx4:
+        return TYPE_RGBA_HALF_FLT;
+    case QImage::Format_RGBA32FPx4:
+    case QImage::Format_RGBX32FPx4:
+        return TYPE_RGBA_FLT;
+    default:
+        break;
+    }
+    return 0;
+}
+
+class TransformCache
+{
+public:
+    TargetProfile target(EncodeColorSpace cs, const QByteArray &rootICC)
+    {
+        QMutexLocker locker(&mutex);
+        if (cs == ENC_CS_INHERIT_FIRST && !rootICC.isEmpty()) {
+            // parse the root profile once per encode instead of once per frame
+            if (inheritRoot != rootICC) {
+                inheritRoot = rootICC;
+                inheritTarget.icc = rootICC;
+                inheritTarget.fingerprint = fingerprint(rootICC);
+                inheritTarget.colorSpace = QColorSpace::fromIccProfile(rootICC);
+            }
+            return inheritTarget;
+        }
+
+        const QColorSpace::NamedColorSpace named = [&]() {
+            switch (cs) {
+            case ENC_CS_SRGB_LINEAR:
+                return QColorSpace::SRgbLinear;
+            case ENC_CS_P3:
+                return QColorSpace::DisplayP3;
+            default:
+                return QColorSpace::SRgb;
+            }
+        }();
+        auto it = builtinTargets.find(named);
+        if (it == builtinTargets.end()) {
+            TargetProfile tp;
+            tp.colorSpace = QColorSpace(named);
+            tp.icc = tp.colorSpace.iccProfile();
+            tp.fingerprint = fingerprint(tp.icc);
+            it = builtinTargets.insert(named, tp);
+        }
+        return it.value();
+    }
+
+    TransformPtr transform(const TransformKey &key, const QByteArray &srcIcc, const QByteArray &dstIcc)
+    {
+        QMutexLocker locker(&mutex);
+        const auto it = transforms.constFind(key);
+        if (it != transforms.constEnd()) {
+            order.removeOne(key);
+            order.append(key);
+            return it.value();
+        }
+
+        TransformPtr xform;
+        cmsHPROFILE srcProfile = cmsOpenProfileFromMem(srcIcc.constData(), static_cast<cmsUInt32Number>(srcIcc.size()));
+        cmsHPROFILE dstProfile = cmsOpenProfileFromMem(dstIcc.constData(), static_cast<cmsUInt32Number>(dstIcc.size()));
+        if (srcProfile && dstProfile) {
+            const auto fmt = static_cast<cmsUInt32Number>(key.format);
+            // no cache, so the same transform can run on several threads at once
+            cmsHTRANSFORM t = cmsCreateTransform(srcProfile,
+                                                 fmt,
+                                                 dstProfile,
+                                                 fmt,
+                                                 INTENT_RELATIVE_COLORIMETRIC,
+                                                 cmsFLAGS_NOCACHE | cmsFLAGS_COPY_ALPHA);
+            if (t) {
+                xform = TransformPtr(t, [](void *p) {
+                    cmsDeleteTransform(p);
+                });
+            }
+        }
+        if (srcProfile) {
+            cmsCloseProfile(srcProfile);
+        }
+        if (dstProfile) {
+            cmsCloseProfile(dstProfile);
+        }
+
+        // failures are cached too, those go through Qt without trying again
+        transforms.insert(key, xform);
+        order.append(key);
+        while (order.size() > MAX_CACHED_TRANSFORMS) {
+            transforms.remove(order.takeFirst());
+        }
+        return xform;
+    }
+
+private:
+    QMutex mutex;
+    QHash<TransformKey, TransformPtr> transforms;
+    QList<TransformKey> order; // least recently used first
+    QHash<int, TargetProfile> builtinTargets;
+    QByteArray inheritRoot;
+    TargetProfile inheritTarget;
+};
+
+TransformCache &cache()
+{
+    static TransformCache c;
+    return c;
+}
+
+void applyTransform(cmsHTRANSFORM xform, QImage &image)
+{
+    const int width = image.width();
+    const int height = image.height();
+    const qsizetype bpl = image.bytesPerLine();
+    // detach once here, not from the bands
+    uchar *bits = image.bits();
+
+    jxfrstch::WorkPool::instance().parallelRows(height, MIN_BAND_ROWS, [&](int y0, int y1) {
+        uchar *rows = bits + static_cast<qsizetype>(y0) * bpl;
+        cmsDoTransformLineStride(xform,
+                                 rows,
+                                 rows,
+                                 static_cast<cmsUInt32Number>(width),
+                                 static_cast<cmsUInt32Number>(y1 - y0),
+                                 static_cast<cmsUInt32Number>(bpl),
+                                 static_cast<cmsUInt32Number>(bpl),
+                                 0,
+                                 0);
+    });
+}
+} // namespace
+
+namespace jxfrstch
+{
+void convertToColorSpace(QImage &image, EncodeColorSpace target, const QByteArray &rootICC)
+{
+    if (image.isNull()) {
+        return;
+    }
+    // treat untagged as sRGB
+    if (!image.colorSpace().isValid()) {
+        image.setColorSpace(QColorSpace::SRgb);
+    }
+
+    const TargetProfile dst = cache().target(target, rootICC);
+    if (image.colorSpace() == dst.colorSpace) {
+        return;
+    }
+
+    const QByteArray srcIcc = image.colorSpace().iccProfile();
+    const cmsUInt32Number fmt = lcmsFormat(image.format());
+    if (srcIcc.isEmpty() || dst.icc.isEmpty() || fmt == 0) {
+        image.convertToColorSpace(dst.colorSpace);
+        return;
+    }
+
+    const QByteArray srcFp = fingerprint(srcIcc);
+    if (srcFp == dst.fingerprint) {
+        // same profile, only the tag differs
+        image.setColorSpace(dst.colorSpace);
+        return;
+    }
+
+    const TransformPtr xform = cache().transform(TransformKey{srcFp, dst.fingerprint, static_cast<int>(fmt)}, srcIcc, dst.icc);
+    if (!xform) {
+        image.convertToColorSpace(dst.colorSpace);
+        return;
+    }
+    applyTransform(xform.data(), image);
+    image.setColorSpace(dst.colorSpace);
+}
+
+QColorSpace targetColorSpace(EncodeColorSpace target, const QByteArray &rootICC)
+{
+    return cache().target(target, rootICC).colorSpace;
+}
+} // namespace jxfrstch
@@ -0,0 +1,22 @@
+#ifndef COLORTRANSFORM_H
+#define COLORTRANSFORM_H
+
+#include "jxlutils.h"
+
+namespace jxfrstch
+{
+/*
+ * Converts an already format-converted (RGBA/RGBX 8/16/16F/32F) image in place to the target color space
+ * with lcms2, untagged images are taken as sRGB
+ *
+ * Transforms are cached by (source ICC fingerprint, target, pixel format) and shared between threads,
+ * matching profiles only get retagged, and the transform itself is applied in row bands over the shared WorkPool
+ * Falls back to QImage::convertToColorSpace when lcms2 can't handle a profile
+ */
+void convertToColorSpace(QImage &image, EncodeColorSpace target, const QByteArray &rootICC);
+
+// the color space convertToColorSpace() tags its results with, for decoders that can output it directly
+QColorSpace targetColorSpace(EncodeColorSpace target, const QByteArray &rootICC);
+} // namespace jxfrstch
+
+#endif // COLORTRANSFORM_H
@@ -0,0 +1,321 @@
+#include "encodescheduler.h"
+#include "jxlencoderobject.h"
+
+#include <QList>
+#include <QSharedPointer>
+#include <QThread>
+
+#include <algorithm>
+
+namespace
+{
+enum class JobState {
+    Queued,
+    Running,
+    Done
+};
+
+struct Job {
+    int id{0};
+    JobState state{JobState::Queued};
+    jxfrstch::EncodeParams params{};
+    QVector<jxfrstch::InputFileData> files{};
+    QSharedPointer<JXLEncoderObject> enc{};
+    int want{1}; // threads it would use on its own
+    int threads{0}; // currently granted
+};
+} // namespace
+
+class Q_DECL_HIDDEN EncodeScheduler::Private
+{
+public:
+    void schedule();
+    void checkAllFinished();
+    bool startJob(Job &job);
+    void rebalance();
+    void jobFinished(int id);
+    Job *findJob(int id);
+    int budget() const;
+    int runningCount() const;
+
+    EncodeScheduler *q{nullptr};
+    QList<Job> jobs;
+    int nextId{0};
+    int threadBudget{0};
+    int maxConcurrent{0};
+    bool started{false};
+    // canEncode() spins the event loop, finished jobs can call back into schedule() from there
+    bool scheduling{false};
+    bool rescheduleNeeded{false};
+    bool allFinishedSent{false};
+};
+
+EncodeScheduler::EncodeScheduler(QObject *parent)
+    : QObject{parent}
+    , d(new Private)
+{
+    d->q = this;
+}
+
+EncodeScheduler::~EncodeScheduler()
+{
+    abortAll(false);
+    for (auto &job : d->jobs) {
+        if (job.enc) {
+            job.enc->wait();
+        }
+    }
+}
+
+void EncodeScheduler::setThreadBudget(int threads)
+{
+    d->threadBudget = qMax(0, threads);
+    if (d->started) {
+        d->rebalance();
+        d->schedule();
+    }
+}
+
+void EncodeScheduler::setMaxConcurrentJobs(int jobs)
+{
+    d->maxConcurrent = qMax(0, jobs);
+    if (d->started) {
+        d->schedule();
+    }
+}
+
+int EncodeScheduler::addJob(const jxfrstch::EncodeParams &params, const QVector<jxfrstch::InputFileData> &files)
+{
+    Job job;
+    job.id = d->nextId++;
+    job.params = params;
+    job.files = files;
+    d->jobs.append(job);
+    d->allFinishedSent = false;
+    if (d->started) {
+        d->schedule();
+    }
+    return job.id;
+}
+
+void EncodeScheduler::start()
+{
+    d->started = true;
+    d->schedule();
+}
+
+void EncodeScheduler::abortAll(bool completeFiles)
+{
+    d->started = false;
+    for (auto &job : d->jobs) {
+        if (job.state == JobState::Running && job.enc) {
+            job.enc->abortEncode(completeFiles);
+        } else if (job.state == JobState::Queued) {
+            job.state = JobState::Done;
+            emit sigJobFinished(job.id, false);
+        }
+    }
+    d->checkAllFinished();
+}
+
+bool EncodeScheduler::isRunning() const
+{
+    return std::any_of(d->jobs.cbegin(), d->jobs.cend(), [](const Job &job) {
+        return job.state == JobState::Running;
+    });
+}
+
+int EncodeScheduler::Private::budget() const
+{
+    return threadBudget > 0 ? threadBudget : qMax(1, QThread::idealThreadCount());
+}
+
+int EncodeScheduler::Private::runningCount() const
+{
+    return static_cast<int>(std::count_if(jobs.cbegin(), jobs.cend(), [](const Job &job) {
+        return job.state == JobState::Running;
+    }));
+}
+
+Job *EncodeScheduler::Private::findJob(int id)
+{
+    for (auto &job : jobs) {
+        if (job.id == id) {
+            return &job;
+        }
+    }
+    return nullptr;
+}
+
+void EncodeScheduler::Private::schedule()
+{
+    if (scheduling) {
+        rescheduleNeeded = true;
+        return;
+    }
+    scheduling = true;
+
+    do {
+        rescheduleNeeded = false;
+        for (int i = 0; i < jobs.size() && started; i++) {
+            if (jobs.at(i).state != JobState::Queued) {
+                continue;
+            }
+            const int running = runningCount();
+            if (maxConcurrent > 0 && running >= maxConcurrent) {
+                break;
+            }
+            // every running job keeps at least one thread
+            if (running >= budget()) {
+                break;
+            }
+            int wanted = 0;
+            for (const auto &job : jobs) {
+                if (job.state == JobState::Running) {
+                    wanted += job.want;
+                }
+            }
+            // the first job always runs, later ones only while the others are still short of the budget
+            if (running > 0 && wanted >= budget()) {
+                break;
+            }
+
+            const int id = jobs.at(i).id;
+            Job job = jobs.at(i);
+            const bool ok = startJob(job);
+            // the list may have changed while canEncode() was processing events
+            Job *stored = findJob(id);
+            if (!stored || stored->state != JobState::Queued) {
+                // aborted in the meantime
+                continue;
+            }
+            *stored = job;
+            if (!ok) {
+                stored->state = JobState::Done;
+                emit q->sigJobFinished(id, false);
+                continue;
+            }
+            rebalance();
+            emit q->sigJobStarted(id, stored->threads);
+            stored->enc->start();
+        }
+    } while (rescheduleNeeded);
+
+    scheduling = false;
+    checkAllFinished();
+}
+
+void EncodeScheduler::Private::checkAllFinished()
+{
+    if (scheduling || jobs.isEmpty() || allFinishedSent) {
+        return;
+    }
+    if (std::all_of(jobs.cbegin(), jobs.cend(), [](const Job &job) {
+            return job.state == JobState::Done;
+        })) {
+        allFinishedSent = true;
+        emit q->sigAllFinished();
+    }
+}
+
+bool EncodeScheduler::Private::startJob(Job &job)
+{
+    // deleteLater, the last reference usually goes away inside one of its own signals
+    job.enc = QSharedPointer<JXLEncoderObject>(new JXLEncoderObject(), &QObject::deleteLater);
+    JXLEncoderObject *enc = job.enc.get();
+    const int id = job.id;
+    const int totalFrames = static_cast<int>(job.files.size());
+
+    QObject::connect(enc, &JXLEncoderObject::sigStatusText, q, [this, id](const QString &status) {
+        emit q->sigJobStatus(id, status);
+    });
+    QObject::connect(enc, &JXLEncoderObject::sigThrowError, q, [this, id](const QString &status) {
+        emit q->sigJobError(id, status);
+    });
+    QObject::connect(enc,
+                     &JXLEncoderObject::sigCurrentMainProgressBar,
+                     q,
+                     [this, id, totalFrames](const int &progress, const bool &) {
+                         emit q->sigJobProgress(id, progress, totalFrames);
+                     });
+    QObject::connect(enc, &JXLEncoderObject::finished, q, [this, id]() {
+        jobFinished(id);
+    });
+
+    // decode workers share the machine too, don't let every job take half of it
+    if (job.params.decodeThreads <= 0) {
+        job.params.decodeThreads = qMax(1, budget() / (runningCount() + 1) / 2);
+    }
+
+    enc->resetEncoder();
+    enc->setEncodeParams(job.params);
+    for (const auto &ifd : job.files) {
+        enc->appendInputFiles(ifd);
+    }
+    if (!enc->canEncode()) {
+        emit q->sigJobError(id, "Input check failed!");
+        job.enc.reset();
+        return false;
+    }
+
+    job.want = qMax(1, enc->suggestedThreads());
+    job.state = JobState::Running;
+    return true;
+}
+
+void EncodeScheduler::Private::rebalance()
+{
+    QList<Job *> running;
+    for (auto &job : jobs) {
+        if (job.state == JobState::Running) {
+            running.append(&job);
+        }
+    }
+    if (running.isEmpty()) {
+        return;
+    }
+
+    // water-filling: smallest wants are met first, the rest split what's left evenly
+    std::sort(running.begin(), running.end(), [](const Job *a, const Job *b) {
+        return a->want < b->want;
+    });
+    QVector<int> grant(running.size(), 0);
+    int left = budget();
+    for (int i = 0; i < running.size(); i++) {
+        const int fair = qMax(1, left / static_cast<int>(running.size() - i));
+        grant[i] = qMin(running.at(i)->want, fair);
+        left -= grant[i];
+    }
+    // nothing queued can use the rest, so running jobs get it even past what they asked for
+    for (int i = running.size() - 1; left > 0 && i >= 0; i--) {
+        const int extra = qMax(1, left / (i + 1));
+        grant[i] += extra;
+        left -= extra;
+    }
+
+    for (int i = 0; i < running.size(); i++) {
+        Job *job = running.at(i);
+        if (job->threads != grant.at(i)) {
+            job->threads = grant.at(i);
+            job->enc->setThreadBudget(job->threads);
+            emit q->sigJobThreadsChanged(job->id, job->threads);
+        }
+    }
+}
+
+void EncodeScheduler::Private::jobFinished(int id)
+{
+    Job *job = findJob(id);
+    if (!job || !job->enc) {
+        return;
+    }
+    job->enc->wait();
+    const bool success = job->enc->encodeSucceeded();
+    job->state = JobState::Done;
+    job->threads = 0;
+    job->enc.reset();
+    emit q->sigJobFinished(id, success);
+
+    rebalance();
+    schedule();
+}
@@ -0,0 +1,49 @@
+#ifndef ENCODESCHEDULER_H
+#define ENCODESCHEDULER_H
+
+#include <QObject>
+#include <QVector>
+
+#include "jxlutils.h"
+
+/*
+ * Runs a queue of encodes (one JXLEncoderObject each) side by side under a single encoder thread budget
+ *
+ * Jobs are started while the threads they'd use on their own (JxlResizableParallelRunnerSuggestThreads,
+ * or their encodeThreads) still fit in the budget, and the budget is re-split between running jobs
+ * whenever one starts or finishes, so many small encodes fill a big machine instead of idling it
+ * Lives on the thread it was created on, canEncode() of each job runs there too
+ */
+class EncodeScheduler : public QObject
+{
+    Q_OBJECT
+public:
+    explicit EncodeScheduler(QObject *parent = nullptr);
+    ~EncodeScheduler();
+
+    // total encoder threads of all running jobs, 0 = QThread::idealThreadCount()
+    void setThreadBudget(int threads);
+    // 0 = as many as the budget allows
+    void setMaxConcurrentJobs(int jobs);
+
+    // returns the job id, jobs added while running are picked up as threads free up
+    int addJob(const jxfrstch::EncodeParams &params, const QVector<jxfrstch::InputFileData> &files);
+    void start();
+    void abortAll(bool completeFiles);
+    bool isRunning() const;
+
+signals:
+    void sigJobStarted(int job, int threads);
+    void sigJobThreadsChanged(int job, int threads);
+    void sigJobProgress(int job, int frame, int totalFrames);
+    void sigJobStatus(int job, const QString &status);
+    void sigJobError(int job, const QString &error);
+    void sigJobFinished(int job, bool success);
+    void sigAllFinished();
+
+private:
+    class Private;
+    QScopedPointer<Private> d;
+};
+
+#endif // ENCODESCHEDULER_H
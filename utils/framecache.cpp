@@ -0,0 +1,460 @@
+#include "framecache.h"
+
+#include <QCache>
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDir>
+#include <QHash>
+#include <QMap>
+#include <QMutex>
+#include <QSaveFile>
+#include <QStandardPaths>
+
+#include <cstring>
+
+namespace
+{
+constexpr quint32 FRAME_MAGIC = 0x4d524658; // "XFRM"
+constexpr quint32 INPUT_MAGIC = 0x504e4958; // "XINP"
+constexpr quint32 DISK_VERSION = 3;
+// pixels start on a cache line, QImage only asks for 4 byte alignment
+constexpr qint64 PIXEL_ALIGN = 64;
+// input records are tiny, just don't let them grow forever in a long session
+constexpr int MAX_INPUT_RECORDS = 65536;
+
+// header of a .frame file, followed by the frame name and, at pixelOffset, the QImage rows as is
+struct DiskFrameHeader {
+    quint32 magic;
+    quint32 version;
+    qint32 width;
+    qint32 height;
+    qint32 format;
+    qint32 nameBytes;
+    qint64 bytesPerLine;
+    qint64 pixelOffset;
+    qint32 rect[4];
+    qint32 frameDelay;
+    qint32 skippedFrames;
+    qint32 skippedDelay;
+    qint32 isJxl;
+    // JxlFrameHeader field by field, its layout is libjxl's to change
+    quint32 duration;
+    quint32 timecode;
+    quint32 nameLength;
+    qint32 isLast;
+    qint32 haveCrop;
+    qint32 cropX0;
+    qint32 cropY0;
+    quint32 xsize;
+    quint32 ysize;
+    qint32 blendMode;
+    quint32 blendSource;
+    quint32 blendAlpha;
+    qint32 blendClamp;
+    quint32 saveAsReference;
+};
+
+void headerToDisk(const JxlFrameHeader &src, DiskFrameHeader &dst)
+{
+    dst.duration = src.duration;
+    dst.timecode = src.timecode;
+    dst.nameLength = src.name_length;
+    dst.isLast = src.is_last;
+    dst.haveCrop = src.layer_info.have_crop;
+    dst.cropX0 = src.layer_info.crop_x0;
+    dst.cropY0 = src.layer_info.crop_y0;
+    dst.xsize = src.layer_info.xsize;
+    dst.ysize = src.layer_info.ysize;
+    dst.blendMode = src.layer_info.blend_info.blendmode;
+    dst.blendSource = src.layer_info.blend_info.source;
+    dst.blendAlpha = src.layer_info.blend_info.alpha;
+    dst.blendClamp = src.layer_info.blend_info.clamp;
+    dst.saveAsReference = src.layer_info.save_as_reference;
+}
+
+JxlFrameHeader headerFromDisk(const DiskFrameHeader &src)
+{
+    JxlFrameHeader dst{};
+    dst.duration = src.duration;
+    dst.timecode = src.timecode;
+    dst.name_length = src.nameLength;
+    dst.is_last = src.isLast;
+    dst.layer_info.have_crop = src.haveCrop;
+    dst.layer_info.crop_x0 = src.cropX0;
+    dst.layer_info.crop_y0 = src.cropY0;
+    dst.layer_info.xsize = src.xsize;
+    dst.layer_info.ysize = src.ysize;
+    dst.layer_info.blend_info.blendmode = static_cast<JxlBlendMode>(src.blendMode);
+    dst.layer_info.blend_info.source = src.blendSource;
+    dst.layer_info.blend_info.alpha = src.blendAlpha;
+    dst.layer_info.blend_info.clamp = src.blendClamp;
+    dst.layer_info.save_as_reference = src.saveAsReference;
+    return dst;
+}
+
+struct DiskInputRecord {
+    quint32 magic;
+    quint32 version;
+    qint32 frameCount;
+    qint32 imageCount;
+    qint32 isImageAnim;
+};
+
+QString hashedName(const QString &key, const char *suffix)
+{
+    return QString::fromLatin1(QCryptographicHash::hash(key.toUtf8(), QCryptographicHash::Sha1).toHex()) + suffix;
+}
+
+void deleteMappedFile(void *file)
+{
+    // closing unmaps it
+    delete static_cast<QFile *>(file);
+}
+} // namespace
+
+namespace jxfrstch
+{
+class Q_DECL_HIDDEN FrameCache::Private
+{
+public:
+    QString framePath(const QString &key, int sourceFrame) const;
+    QString inputPath(const QString &key) const;
+    bool loadFrame(const QString &path, CachedFrame &frame) const;
+    qint64 storeFrame(const QString &path, const CachedFrame &frame) const;
+    // with mutex held
+    void addDiskUsage(qint64 bytes);
+    void applyBudgets();
+
+    struct Budget {
+        qint64 memoryBytes;
+        qint64 diskBytes;
+        QString diskDir;
+    };
+    QMap<int, Budget> users;
+    int nextTicket{1};
+
+    QMutex mutex;
+    // cost is in KiB
+    QCache<QString, CachedFrame> memory;
+    QHash<QString, CachedInput> inputs;
+    qint64 memoryBytes{0};
+    qint64 diskBytes{0};
+    QString diskDir{};
+    // -1 = directory not scanned yet
+    qint64 diskUsage{-1};
+};
+
+FrameCache &FrameCache::instance()
+{
+    static FrameCache cache;
+    return cache;
+}
+
+FrameCache::FrameCache()
+    : d(new Private)
+{
+    d->memory.setMaxCost(0);
+}
+
+FrameCache::~FrameCache() = default;
+
+int FrameCache::acquire(qint64 memoryBytes, qint64 diskBytes, const QString &diskDir)
+{
+    QMutexLocker locker(&d->mutex);
+    const int ticket = d->nextTicket++;
+    d->users.insert(ticket, {qMax<qint64>(0, memoryBytes), qMax<qint64>(0, diskBytes), diskDir});
+    d->applyBudgets();
+    return ticket;
+}
+
+void FrameCache::release(int ticket)
+{
+    QMutexLocker locker(&d->mutex);
+    if (d->users.remove(ticket) > 0 && !d->users.isEmpty()) {
+        d->applyBudgets();
+    }
+}
+
+bool FrameCache::isEnabled() const
+{
+    QMutexLocker locker(&d->mutex);
+    return d->memoryBytes > 0 || d->diskBytes > 0;
+}
+
+QString FrameCache::inputKey(const QString &fileName, const EncodeParams &params, const QByteArray &rootICC)
+{
+    const QFileInfo fi(fileName);
+    if (!fi.exists()) {
+        return {};
+    }
+    return QString("%1|%2|%3|%4|%5|%6|%7")
+        .arg(fi.absoluteFilePath(),
+             QString::number(fi.size()),
+             QString::number(fi.lastModified().toMSecsSinceEpoch()),
+             QString::number(encodeImageFormat(params.bitDepth, params.alpha)),
+             QString::number(params.colorSpace),
+             QString::number(params.coalesceJxlInput),
+             QString::fromLatin1(QCryptographicHash::hash(rootICC, QCryptographicHash::Sha1).toHex()));
+}
+
+bool FrameCache::findInput(const QString &key, CachedInput &input)
+{
+    QString path;
+    {
+        QMutexLocker locker(&d->mutex);
+        const auto it = d->inputs.constFind(key);
+        if (it != d->inputs.constEnd()) {
+            input = it.value();
+            return true;
+        }
+        if (d->diskBytes == 0) {
+            return false;
+        }
+        path = d->inputPath(key);
+    }
+
+    QFile f(path);
+    DiskInputRecord rec{};
+    if (!f.open(QIODevice::ReadOnly) || f.read(reinterpret_cast<char *>(&rec), sizeof(rec)) != sizeof(rec)
+        || rec.magic != INPUT_MAGIC || rec.version != DISK_VERSION || rec.frameCount <= 0) {
+        return false;
+    }
+    input.frameCount = rec.frameCount;
+    input.imageCount = rec.imageCount;
+    input.isImageAnim = rec.isImageAnim != 0;
+    return true;
+}
+
+void FrameCache::insertInput(const QString &key, const CachedInput &input)
+{
+    QString path;
+    {
+        QMutexLocker locker(&d->mutex);
+        if (d->memoryBytes > 0) {
+            if (d->inputs.size() >= MAX_INPUT_RECORDS) {
+                d->inputs.clear();
+            }
+            d->inputs.insert(key, input);
+        }
+        if (d->diskBytes == 0) {
+            return;
+        }
+        path = d->inputPath(key);
+    }
+
+    const DiskInputRecord rec{INPUT_MAGIC, DISK_VERSION, input.frameCount, input.imageCount, input.isImageAnim ? 1 : 0};
+    QSaveFile f(path);
+    if (!f.open(QIODevice::WriteOnly) || f.write(reinterpret_cast<const char *>(&rec), sizeof(rec)) != sizeof(rec)
+        || !f.commit()) {
+        return;
+    }
+    QMutexLocker locker(&d->mutex);
+    d->addDiskUsage(sizeof(rec));
+}
+
+bool FrameCache::findFrame(const QString &key, int sourceFrame, CachedFrame &frame)
+{
+    const QString frameKey = key + '#' + QString::number(sourceFrame);
+    QString path;
+    {
+        QMutexLocker locker(&d->mutex);
+        if (const CachedFrame *cached = d->memory.object(frameKey)) {
+            frame = *cached;
+            return true;
+        }
+        if (d->diskBytes == 0) {
+            return false;
+        }
+        path = d->framePath(key, sourceFrame);
+    }
+    // mapped frames aren't moved up to the memory tier, every one of them keeps a file open
+    return d->loadFrame(path, frame);
+}
+
+void FrameCache::insertFrame(const QString &key, int sourceFrame, const CachedFrame &frame)
+{
+    if (frame.image.isNull()) {
+        return;
+    }
+    QString path;
+    {
+        QMutexLocker locker(&d->mutex);
+        if (d->memoryBytes > 0) {
+            // the image is shared with the pipeline, nothing is copied
+            d->memory.insert(key + '#' + QString::number(sourceFrame),
+                             new CachedFrame(frame),
+                             static_cast<qsizetype>(frame.image.sizeInBytes() / 1024 + 1));
+        }
+        if (d->diskBytes == 0 || frame.image.sizeInBytes() > d->diskBytes) {
+            return;
+        }
+        path = d->framePath(key, sourceFrame);
+    }
+
+    const qint64 written = d->storeFrame(path, frame);
+    if (written > 0) {
+        QMutexLocker locker(&d->mutex);
+        d->addDiskUsage(written);
+    }
+}
+
+QString FrameCache::Private::framePath(const QString &key, int sourceFrame) const
+{
+    return QDir(diskDir).filePath(hashedName(key + '#' + QString::number(sourceFrame), ".frame"));
+}
+
+QString FrameCache::Private::inputPath(const QString &key) const
+{
+    return QDir(diskDir).filePath(hashedName(key, ".input"));
+}
+
+bool FrameCache::Private::loadFrame(const QString &path, CachedFrame &frame) const
+{
+    auto *file = new QFile(path);
+    if (!file->open(QIODevice::ReadOnly) || file->size() < static_cast<qint64>(sizeof(DiskFrameHeader))) {
+        delete file;
+        return false;
+    }
+    const qint64 fileSize = file->size();
+    const uchar *data = file->map(0, fileSize);
+    if (!data) {
+        delete file;
+        return false;
+    }
+
+    DiskFrameHeader hdr{};
+    std::memcpy(&hdr, data, sizeof(hdr));
+    const bool valid = hdr.magic == FRAME_MAGIC && hdr.version == DISK_VERSION && hdr.width > 0 && hdr.height > 0
+        && hdr.format > QImage::Format_Invalid && hdr.format < QImage::NImageFormats && hdr.nameBytes >= 0
+        && hdr.pixelOffset >= static_cast<qint64>(sizeof(hdr)) + hdr.nameBytes && hdr.pixelOffset % PIXEL_ALIGN == 0
+        && hdr.bytesPerLine > 0 && hdr.bytesPerLine <= fileSize
+        && hdr.bytesPerLine * 8 >= static_cast<qint64>(hdr.width)
+                * QImage::toPixelFormat(static_cast<QImage::Format>(hdr.format)).bitsPerPixel()
+        && hdr.pixelOffset + hdr.bytesPerLine * hdr.height <= fileSize;
+    if (!valid) {
+        delete file;
+        return false;
+    }
+
+    frame.imageRect = QRect(hdr.rect[0], hdr.rect[1], hdr.rect[2], hdr.rect[3]);
+    frame.frameDelay = hdr.frameDelay;
+    frame.skippedFrames = hdr.skippedFrames;
+    frame.skippedDelay = hdr.skippedDelay;
+    frame.isJxl = hdr.isJxl != 0;
+    frame.jxlHeader = headerFromDisk(hdr);
+    frame.jxlFrameName = QString::fromUtf8(reinterpret_cast<const char *>(data + sizeof(hdr)), hdr.nameBytes);
+
+    // least recently used files are the first to go when the directory is trimmed
+    file->setFileTime(QDateTime::currentDateTime(), QFileDevice::FileModificationTime);
+
+    // read only, the mapping lives as long as the image (or any copy of it) does
+    frame.image = QImage(data + hdr.pixelOffset,
+                         hdr.width,
+                         hdr.height,
+                         static_cast<qsizetype>(hdr.bytesPerLine),
+                         static_cast<QImage::Format>(hdr.format),
+                         deleteMappedFile,
+                         file);
+    return true;
+}
+
+qint64 FrameCache::Private::storeFrame(const QString &path, const CachedFrame &frame) const
+{
+    const QByteArray name = frame.jxlFrameName.toUtf8();
+
+    DiskFrameHeader hdr{};
+    hdr.magic = FRAME_MAGIC;
+    hdr.version = DISK_VERSION;
+    hdr.width = frame.image.width();
+    hdr.height = frame.image.height();
+    hdr.format = frame.image.format();
+    hdr.nameBytes = static_cast<qint32>(name.size());
+    hdr.bytesPerLine = frame.image.bytesPerLine();
+    hdr.pixelOffset = (static_cast<qint64>(sizeof(hdr)) + name.size() + PIXEL_ALIGN - 1) / PIXEL_ALIGN * PIXEL_ALIGN;
+    hdr.rect[0] = frame.imageRect.x();
+    hdr.rect[1] = frame.imageRect.y();
+    hdr.rect[2] = frame.imageRect.width();
+    hdr.rect[3] = frame.imageRect.height();
+    hdr.frameDelay = frame.frameDelay;
+    hdr.skippedFrames = frame.skippedFrames;
+    hdr.skippedDelay = frame.skippedDelay;
+    hdr.isJxl = frame.isJxl ? 1 : 0;
+    headerToDisk(frame.jxlHeader, hdr);
+
+    // written under a temporary name, a concurrent reader never sees half a frame
+    QSaveFile f(path);
+    if (!f.open(QIODevice::WriteOnly)) {
+        return 0;
+    }
+    const qint64 paddingBytes = hdr.pixelOffset - static_cast<qint64>(sizeof(hdr)) - name.size();
+    const QByteArray padding(static_cast<qsizetype>(paddingBytes), '\0');
+    const qint64 pixelBytes = frame.image.sizeInBytes();
+    if (f.write(reinterpret_cast<const char *>(&hdr), sizeof(hdr)) != sizeof(hdr) || f.write(name) != name.size()
+        || f.write(padding) != padding.size()
+        || f.write(reinterpret_cast<const char *>(frame.image.constBits()), pixelBytes) != pixelBytes || !f.commit()) {
+        return 0;
+    }
+    return hdr.pixelOffset + pixelBytes;
+}
+
+void FrameCache::Private::applyBudgets()
+{
+    qint64 memoryBudget = 0;
+    qint64 diskBudget = 0;
+    for (const Budget &b : std::as_const(users)) {
+        memoryBudget = qMax(memoryBudget, b.memoryBytes);
+        diskBudget = qMax(diskBudget, b.diskBytes);
+    }
+
+    memoryBytes = memoryBudget;
+    memory.setMaxCost(static_cast<qsizetype>(memoryBytes / 1024));
+    if (memoryBytes == 0) {
+        inputs.clear();
+    }
+
+    diskBytes = diskBudget;
+    // tickets only go up, the first one is the oldest job
+    const QString requested = users.isEmpty() ? QString() : users.first().diskDir;
+    const QString dir = requested.isEmpty()
+        ? QDir(QStandardPaths::writableLocation(QStandardPaths::CacheLocation)).filePath("frames")
+        : requested;
+    if (dir != diskDir) {
+        diskDir = dir;
+        diskUsage = -1;
+    }
+    if (diskBytes > 0) {
+        QDir().mkpath(diskDir);
+        addDiskUsage(0);
+    }
+}
+
+void FrameCache::Private::addDiskUsage(qint64 bytes)
+{
+    const QDir dir(diskDir);
+    const QStringList filters{"*.frame", "*.input"};
+    if (diskUsage < 0) {
+        diskUsage = 0;
+        const QFileInfoList files = dir.entryInfoList(filters, QDir::Files);
+        for (const QFileInfo &fi : files) {
+            diskUsage += fi.size();
+        }
+    }
+    diskUsage += bytes;
+    if (diskUsage <= diskBytes) {
+        return;
+    }
+
+    // oldest first, down to 90% so not every insert ends up listing the directory
+    const qint64 target = diskBytes / 10 * 9;
+    const QFileInfoList files = dir.entryInfoList(filters, QDir::Files, QDir::Time | QDir::Reversed);
+    for (const QFileInfo &fi : files) {
+        if (diskUsage <= target) {
+            break;
+        }
+        // frames still mapped somewhere stay readable, only the name goes away
+        if (QFile::remove(fi.absoluteFilePath())) {
+            diskUsage -= fi.size();
+        }
+    }
+}
+} // namespace jxfrstch
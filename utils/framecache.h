@@ -0,0 +1,71 @@
+#ifndef FRAMECACHE_H
+#define FRAMECACHE_H
+
+#include <QImage>
+#include <QRect>
+#include <QScopedPointer>
+#include <QString>
+
+#include "jxlutils.h"
+
+namespace jxfrstch
+{
+// one decoded and converted input frame, plus what the pipeline reads from the decoder alongside it
+struct CachedFrame {
+    QImage image; // read only mapping when it comes from disk
+    QRect imageRect;
+    int frameDelay{0};
+    bool isJxl{false};
+    JxlFrameHeader jxlHeader{};
+    QString jxlFrameName;
+    // frames decimation dropped after this one when it was decoded, and their delays
+    int skippedFrames{0};
+    int skippedDelay{0};
+};
+
+// only stored once an input was decoded up to its last frame, so the count is exact
+struct CachedInput {
+    int frameCount{0};
+    int imageCount{0}; // what the decoder reported, frame timing depends on it
+    bool isImageAnim{false};
+};
+
+/*
+ * Process-wide cache of converted input frames, so encoding the same project again
+ * (eg. only with other encoder settings) doesn't decode and convert every input again
+ *
+ * The memory tier is an LRU bounded by size. The optional disk tier keeps raw frames in a
+ * directory, maps them back in on a hit, and drops the least recently used files when over budget
+ */
+class FrameCache
+{
+public:
+    static FrameCache &instance();
+    ~FrameCache();
+
+    /*
+     * Budget of one running pipeline, 0 turns that tier off, an empty directory picks one in the
+     * user's cache location. Running pipelines share the cache at the largest of their budgets,
+     * in the directory of the oldest one, so a new job never shrinks or moves it under another
+     * The cache keeps its settings after the last release, returns a ticket for release()
+     */
+    int acquire(qint64 memoryBytes, qint64 diskBytes, const QString &diskDir);
+    void release(int ticket);
+    bool isEnabled() const;
+
+    // file identity (path, size, mtime) and decode target, empty if the file can't be found
+    static QString inputKey(const QString &fileName, const EncodeParams &params, const QByteArray &rootICC);
+
+    bool findInput(const QString &key, CachedInput &input);
+    void insertInput(const QString &key, const CachedInput &input);
+    bool findFrame(const QString &key, int sourceFrame, CachedFrame &frame);
+    void insertFrame(const QString &key, int sourceFrame, const CachedFrame &frame);
+
+private:
+    FrameCache();
+    class Private;
+    QScopedPointer<Private> d;
+};
+} // namespace jxfrstch
+
+#endif // FRAMECACHE_H
@@ -0,0 +1,364 @@
+#include "framediff.h"
+#include "workpool.h"
+
+#include <QVector>
+#include <QtCore/qfloat16.h>
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define FRAMEDIFF_SSE2
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define FRAMEDIFF_NEON
+#endif
+
+namespace
+{
+// pixels tested at once before refining down to the exact pixel
+constexpr int BLOCK_PX = 16;
+// don't split frames into bands thinner than this
+constexpr int MIN_BAND_ROWS = 32;
+
+struct DiffThreshold {
+    int u8{0};
+    int u16{0};
+    float f{0.0f};
+};
+
+// true if any pixel in the range differs
+using RangeDiffFn = bool (*)(const uchar *a, const uchar *b, int npx, const DiffThreshold &thr);
+
+template<int BPP>
+bool exactDiffers(const uchar *a, const uchar *b, int npx, const DiffThreshold &)
+{
+    return memcmp(a, b, static_cast<size_t>(npx) * BPP) != 0;
+}
+
+bool fuzzyDiffersU8(const uchar *a, const uchar *b, int npx, const DiffThreshold &thr)
+{
+    const int n = npx * 4;
+    int i = 0;
+#if defined(FRAMEDIFF_SSE2)
+    // |a - b| > thr  <=>  saturated (|a - b| - thr) != 0
+    const __m128i vthr = _mm_set1_epi8(static_cast<char>(thr.u8));
+    __m128i acc = _mm_setzero_si128();
+    for (; i + 16 <= n; i += 16) {
+        const __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i));
+        const __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + i));
+        const __m128i absdiff = _mm_or_si128(_mm_subs_epu8(va, vb), _mm_subs_epu8(vb, va));
+        acc = _mm_or_si128(acc, _mm_subs_epu8(absdiff, vthr));
+    }
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) != 0xFFFF) {
+        return true;
+    }
+#elif defined(FRAMEDIFF_NEON)
+    const uint8x16_t vthr = vdupq_n_u8(static_cast<uint8_t>(thr.u8));
+    uint8x16_t acc = vdupq_n_u8(0);
+    for (; i + 16 <= n; i += 16) {
+        const uint8x16_t absdiff = vabdq_u8(vld1q_u8(a + i), vld1q_u8(b + i));
+        acc = vorrq_u8(acc, vcgtq_u8(absdiff, vthr));
+    }
+    if (vmaxvq_u8(acc) != 0) {
+        return true;
+    }
+#endif
+    bool diff = false;
+    for (; i < n; i++) {
+        diff |= (std::abs(static_cast<int>(a[i]) - static_cast<int>(b[i])) > thr.u8);
+    }
+    return diff;
+}
+
+bool fuzzyDiffersU16(const uchar *a, const uchar *b, int npx, const DiffThreshold &thr)
+{
+    const auto *pa = reinterpret_cast<const uint16_t *>(a);
+    const auto *pb = reinterpret_cast<const uint16_t *>(b);
+    const int n = npx * 4;
+    int i = 0;
+#if defined(FRAMEDIFF_SSE2)
+    // same saturation trick as 8 bit
+    const __m128i vthr = _mm_set1_epi16(static_cast<short>(thr.u16));
+    __m128i acc = _mm_setzero_si128();
+    for (; i + 8 <= n; i += 8) {
+        const __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pa + i));
+        const __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pb + i));
+        const __m128i absdiff = _mm_or_si128(_mm_subs_epu16(va, vb), _mm_subs_epu16(vb, va));
+        acc = _mm_or_si128(acc, _mm_subs_epu16(absdiff, vthr));
+    }
+    if (_mm_movemask_epi8(_mm_cmpeq_epi16(acc, _mm_setzero_si128())) != 0xFFFF) {
+        return true;
+    }
+#elif defined(FRAMEDIFF_NEON)
+    const uint16x8_t vthr = vdupq_n_u16(static_cast<uint16_t>(thr.u16));
+    uint16x8_t acc = vdupq_n_u16(0);
+    for (; i + 8 <= n; i += 8) {
+        const uint16x8_t absdiff = vabdq_u16(vld1q_u16(pa + i), vld1q_u16(pb + i));
+        acc = vorrq_u16(acc, vcgtq_u16(absdiff, vthr));
+    }
+    if (vmaxvq_u16(acc) != 0) {
+        return true;
+    }
+#endif
+    bool diff = false;
+    for (; i < n; i++) {
+        diff |= (std::abs(static_cast<int>(pa[i]) - static_cast<int>(pb[i])) > thr.u16);
+    }
+    return diff;
+}
+
+// shared by 32 and 16 bit float, n is in channels
+bool floatsDiffer(const float *pa, const float *pb, int n, float thr)
+{
+    int i = 0;
+#if defined(FRAMEDIFF_SSE2)
+    // abs by clearing the sign bit, NaN compares false like in the scalar tail
+    const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    const __m128 vthr = _mm_set1_ps(thr);
+    __m128 acc = _mm_setzero_ps();
+    for (; i + 4 <= n; i += 4) {
+        const __m128 absdiff = _mm_and_ps(_mm_sub_ps(_mm_loadu_ps(pa + i), _mm_loadu_ps(pb + i)), absMask);
+        acc = _mm_or_ps(acc, _mm_cmpgt_ps(absdiff, vthr));
+    }
+    if (_mm_movemask_ps(acc) != 0) {
+        return true;
+    }
+#elif defined(FRAMEDIFF_NEON)
+    const float32x4_t vthr = vdupq_n_f32(thr);
+    uint32x4_t acc = vdupq_n_u32(0);
+    for (; i + 4 <= n; i += 4) {
+        acc = vorrq_u32(acc, vcgtq_f32(vabdq_f32(vld1q_f32(pa + i), vld1q_f32(pb + i)), vthr));
+    }
+    if (vmaxvq_u32(acc) != 0) {
+        return true;
+    }
+#endif
+    bool diff = false;
+    for (; i < n; i++) {
+        diff |= (std::fabs(pa[i] - pb[i]) > thr);
+    }
+    return diff;
+}
+
+bool fuzzyDiffersF32(const uchar *a, const uchar *b, int npx, const DiffThreshold &thr)
+{
+    return floatsDiffer(reinterpret_cast<const float *>(a), reinterpret_cast<const float *>(b), npx * 4, thr.f);
+}
+
+bool fuzzyDiffersF16(const uchar *a, const uchar *b, int npx, const DiffThreshold &thr)
+{
+    const auto *pa = reinterpret_cast<const qfloat16 *>(a);
+    const auto *pb = reinterpret_cast<const qfloat16 *>(b);
+    float fa[BLOCK_PX * 4];
+    float fb[BLOCK_PX * 4];
+    for (int p = 0; p < npx; p += BLOCK_PX) {
+        const int n = std::min(BLOCK_PX, npx - p) * 4;
+        qFloatFromFloat16(fa, pa + p * 4, n);
+        qFloatFromFloat16(fb, pb + p * 4, n);
+        if (floatsDiffer(fa, fb, n, thr.f)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+struct RowScanner {
+    const QImage *cur{nullptr};
+    const QImage *prev{nullptr};
+    RangeDiffFn differs{nullptr};
+    DiffThreshold thr{};
+    int bpp{0};
+
+    // first changed pixel in [x0, x1), -1 if none
+    int firstDiff(int y, int x0, int x1) const
+    {
+        const uchar *a = cur->constScanLine(y);
+        const uchar *b = prev->constScanLine(y);
+        if (x0 >= x1 || !differs(a + x0 * bpp, b + x0 * bpp, x1 - x0, thr)) {
+            return -1;
+        }
+        for (int x = x0; x < x1; x += BLOCK_PX) {
+            const int n = std::min(BLOCK_PX, x1 - x);
+            if (differs(a + x * bpp, b + x * bpp, n, thr)) {
+                for (int px = x; px < x + n; px++) {
+                    if (differs(a + px * bpp, b + px * bpp, 1, thr)) {
+                        return px;
+                    }
+                }
+            }
+        }
+        return -1;
+    }
+
+    // last changed pixel in [x0, x1), -1 if none
+    int lastDiff(int y, int x0, int x1) const
+    {
+        const uchar *a = cur->constScanLine(y);
+        const uchar *b = prev->constScanLine(y);
+        for (int x = x1; x > x0; x -= BLOCK_PX) {
+            const int start = std::max(x0, x - BLOCK_PX);
+            if (differs(a + start * bpp, b + start * bpp, x - start, thr)) {
+                for (int px = x - 1; px >= start; px--) {
+                    if (differs(a + px * bpp, b + px * bpp, 1, thr)) {
+                        return px;
+                    }
+                }
+            }
+        }
+        return -1;
+    }
+};
+
+struct BandResult {
+    int top{-1};
+    int bottom{-1};
+    int left{INT_MAX};
+    int right{-1};
+};
+
+BandResult scanBand(const RowScanner &s, int y0, int y1, int width)
+{
+    BandResult res;
+
+    // from the top edge down to the first changed row
+    for (int y = y0; y < y1; y++) {
+        const int l = s.firstDiff(y, 0, width);
+        if (l >= 0) {
+            res.top = y;
+            res.bottom = y;
+            res.left = l;
+            res.right = s.lastDiff(y, l, width);
+            break;
+        }
+    }
+    if (res.top < 0) {
+        return res;
+    }
+
+    // from the bottom edge up to the last changed row
+    for (int y = y1 - 1; y > res.top; y--) {
+        const int l = s.firstDiff(y, 0, width);
+        if (l >= 0) {
+            res.bottom = y;
+            res.left = std::min(res.left, l);
+            res.right = std::max(res.right, s.lastDiff(y, l, width));
+            break;
+        }
+    }
+
+    // rows in between can only widen the box, so only look outside of it
+    for (int y = res.top + 1; y < res.bottom; y++) {
+        if (res.left == 0 && res.right == width - 1) {
+            break;
+        }
+        if (res.left > 0) {
+            const int l = s.firstDiff(y, 0, res.left);
+            if (l >= 0) {
+                res.left = l;
+            }
+        }
+        if (res.right < width - 1) {
+            const int r = s.lastDiff(y, res.right + 1, width);
+            if (r >= 0) {
+                res.right = r;
+            }
+        }
+    }
+
+    return res;
+}
+} // namespace
+
+namespace jxfrstch
+{
+QRect diffBoundingRect(const QImage &current, const QImage &previous, float threshold)
+{
+    if (current.isNull() || current.size() != previous.size()) {
+        return current.rect();
+    }
+    if (previous.format() != current.format()) {
+        return diffBoundingRect(current, previous.convertToFormat(current.format()), threshold);
+    }
+
+    const bool fuzzy = threshold > 0.0f;
+
+    RowScanner scanner;
+    scanner.cur = &current;
+    scanner.prev = &previous;
+    scanner.thr.u8 = static_cast<int>(std::floor(threshold * 255.0f));
+    scanner.thr.u16 = static_cast<int>(std::floor(threshold * 65535.0f));
+    scanner.thr.f = threshold;
+
+    // fuzzy comparison treats all 4 channels the same, so channel order doesn't matter
+    switch (current.format()) {
+    case QImage::Format_RGBA8888:
+    case QImage::Format_RGBX8888:
+    case QImage::Format_RGBA8888_Premultiplied:
+    case QImage::Format_ARGB32:
+    case QImage::Format_ARGB32_Premultiplied:
+    case QImage::Format_RGB32:
+        scanner.bpp = 4;
+        scanner.differs = fuzzy ? fuzzyDiffersU8 : exactDiffers<4>;
+        break;
+    case QImage::Format_RGBA64:
+    case QImage::Format_RGBX64:
+    case QImage::Format_RGBA64_Premultiplied:
+        scanner.bpp = 8;
+        scanner.differs = fuzzy ? fuzzyDiffersU16 : exactDiffers<8>;
+        break;
+    case QImage::Format_RGBA16FPx4:
+    case QImage::Format_RGBX16FPx4:
+    case QImage::Format_RGBA16FPx4_Premultiplied:
+        scanner.bpp = 8;
+        scanner.differs = fuzzy ? fuzzyDiffersF16 : exactDiffers<8>;
+        break;
+    case QImage::Format_RGBA32FPx4:
+    case QImage::Format_RGBX32FPx4:
+    case QImage::Format_RGBA32FPx4_Premultiplied:
+        scanner.bpp = 16;
+        scanner.differs = fuzzy ? fuzzyDiffersF32 : exactDiffers<16>;
+        break;
+    default:
+        // anything else goes through float
+        return diffBoundingRect(current.convertToFormat(QImage::Format_RGBA32FPx4),
+                                previous.convertToFormat(QImage::Format_RGBA32FPx4),
+                                threshold);
+    }
+
+    const int width = current.width();
+    const int height = current.height();
+    const int bands = qBound(1, height / MIN_BAND_ROWS, jxfrstch::WorkPool::instance().maxThreads());
+
+    QVector<BandResult> results(bands);
+    const auto runBand = [&](int b) {
+        const int y0 = static_cast<int>(static_cast<qint64>(height) * b / bands);
+        const int y1 = static_cast<int>(static_cast<qint64>(height) * (b + 1) / bands);
+        results[b] = scanBand(scanner, y0, y1, width);
+    };
+
+    jxfrstch::WorkPool::instance().parallelFor(0, static_cast<uint32_t>(bands), 0, {}, [&](uint32_t b, int) {
+        runBand(static_cast<int>(b));
+    });
+
+    BandResult total;
+    for (const auto &r : results) {
+        if (r.top < 0) {
+            continue;
+        }
+        total.top = (total.top < 0) ? r.top : std::min(total.top, r.top);
+        total.bottom = std::max(total.bottom, r.bottom);
+        total.left = std::min(total.left, r.left);
+        total.right = std::max(total.right, r.right);
+    }
+
+    if (total.top < 0) {
+        return QRect();
+    }
+    return QRect(total.left, total.top, total.right - total.left + 1, total.bottom - total.top + 1);
+}
+} // namespace jxfrstch
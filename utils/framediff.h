@@ -0,0 +1,20 @@
+#ifndef FRAMEDIFF_H
+#define FRAMEDIFF_H
+
+#include <QImage>
+#include <QRect>
+
+namespace jxfrstch
+{
+/*
+ * Returns the bounding box of pixels that differ between two frames of the same size,
+ * or a null QRect if they're identical (within threshold)
+ *
+ * threshold <= 0 compares exact values, otherwise any channel differing more than
+ * threshold (normalized 0.0-1.0) counts as a change
+ * Frames are split into row bands over the shared WorkPool and each row is scanned inward from its edges
+ */
+QRect diffBoundingRect(const QImage &current, const QImage &previous, float threshold);
+} // namespace jxfrstch
+
+#endif // FRAMEDIFF_H
@@ -0,0 +1,511 @@
+#include "framepipeline.h"
+#include "colortransform.h"
+#include "framecache.h"
+#include "jpegprobe.h"
+#include "jxldecoderobject.h"
+
+#include <QColorSpace>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QHashFunctions>
+#include <QMutex>
+#include <QQueue>
+#include <QThread>
+#include <QThreadPool>
+#include <QWaitCondition>
+
+#include <limits>
+
+namespace
+{
+size_t frameContentHash(const QImage &image, const QRect &imageRect)
+{
+    const size_t pixels = qHashBits(image.constBits(), static_cast<size_t>(image.sizeInBytes()));
+    // never 0, that's reserved for unhashed frames
+    return qHashMulti(pixels, image.format(), imageRect.x(), imageRect.y(), imageRect.width(), imageRect.height()) | 1;
+}
+} // namespace
+
+class Q_DECL_HIDDEN FramePipeline::Private
+{
+public:
+    void workerLoop();
+    void decodeInput(int index);
+    uint32_t frameTick(const jxfrstch::InputFileData &ind, bool hasFrames, bool isLastSubframe, int frameDelay) const;
+    // everything after conversion, false if decoding this input has to stop
+    bool finishFrame(jxfrstch::PipelineFrame &&frm, const QImage &currentFrame, const QElapsedTimer &elt);
+    bool readJpegInput(int index, QByteArray &data) const;
+    bool push(jxfrstch::PipelineFrame &&frame);
+    void finishInput(int index);
+
+    int depth{4};
+    int head{0};
+    int nextInput{0};
+    int buffered{0};
+    bool stopping{false};
+    bool started{false};
+    bool packFrames{true};
+    QSize jpegFrameSize{};
+    int cacheTicket{0}; // frame cache budget, held while running
+
+    jxfrstch::EncodeParams params{};
+    QVector<jxfrstch::InputFileData> idat{};
+    QByteArray rootICC{};
+
+    // one queue per input, so a slow input never lets a later one jump ahead
+    QVector<QQueue<jxfrstch::PipelineFrame>> queues;
+    QVector<bool> inputDone;
+
+    QMutex mutex;
+    QWaitCondition cond;
+    QThreadPool pool;
+};
+
+FramePipeline::FramePipeline()
+    : d(new Private)
+{
+}
+
+FramePipeline::~FramePipeline()
+{
+    stop();
+    d.reset();
+}
+
+void FramePipeline::setPackFrames(bool pack)
+{
+    d->packFrames = pack;
+}
+
+void FramePipeline::setJpegRecompression(const QSize &frameSize)
+{
+    d->jpegFrameSize = frameSize;
+}
+
+void FramePipeline::start(const QVector<jxfrstch::InputFileData> &idat,
+                          const jxfrstch::EncodeParams &params,
+                          const QByteArray &rootICC)
+{
+    stop();
+
+    d->idat = idat;
+    d->params = params;
+    d->rootICC = rootICC;
+    d->depth = qMax(1, params.lookaheadFrames);
+    d->cacheTicket = jxfrstch::FrameCache::instance().acquire(static_cast<qint64>(qMax(0, params.frameCacheMiB)) * 1024 * 1024,
+                                                              static_cast<qint64>(qMax(0, params.frameCacheDiskMiB)) * 1024 * 1024,
+                                                              params.frameCacheDir);
+    d->head = 0;
+    d->nextInput = 0;
+    d->buffered = 0;
+    d->stopping = false;
+    d->queues = QVector<QQueue<jxfrstch::PipelineFrame>>(idat.size());
+    d->inputDone = QVector<bool>(idat.size(), false);
+
+    const int workers = [&]() {
+        if (params.decodeThreads > 0) {
+            return params.decodeThreads;
+        }
+        return qBound(1, QThread::idealThreadCount() / 2, d->depth);
+    }();
+    d->pool.setMaxThreadCount(workers);
+    for (int i = 0; i < workers; i++) {
+        d->pool.start([this]() {
+            d->workerLoop();
+        });
+    }
+    d->started = true;
+}
+
+bool FramePipeline::next(jxfrstch::PipelineFrame &frame)
+{
+    QMutexLocker locker(&d->mutex);
+    for (;;) {
+        if (d->stopping || d->head >= d->queues.size()) {
+            return false;
+        }
+        if (!d->queues[d->head].isEmpty()) {
+            frame = d->queues[d->head].dequeue();
+            d->buffered--;
+            d->cond.wakeAll();
+            return true;
+        }
+        if (d->inputDone.at(d->head)) {
+            d->head++;
+            d->cond.wakeAll();
+            continue;
+        }
+        d->cond.wait(&d->mutex);
+    }
+}
+
+void FramePipeline::stop()
+{
+    if (!d->started) {
+        return;
+    }
+    d->mutex.lock();
+    d->stopping = true;
+    d->cond.wakeAll();
+    d->mutex.unlock();
+
+    d->pool.waitForDone();
+
+    d->queues.clear();
+    d->inputDone.clear();
+    jxfrstch::FrameCache::instance().release(d->cacheTicket);
+    d->cacheTicket = 0;
+    d->started = false;
+}
+
+bool FramePipeline::convertFrame(QImage &image, const jxfrstch::EncodeParams &params, const QByteArray &rootICC)
+{
+    const QImage::Format format = jxfrstch::encodeImageFormat(params.bitDepth, params.alpha);
+    if (format == QImage::Format_Invalid) {
+        return false;
+    }
+    // no-op for JXL inputs, those are decoded in this format already
+    image.convertTo(format);
+
+    if (params.colorSpace != ENC_CS_RAW) {
+        jxfrstch::convertToColorSpace(image, params.colorSpace, rootICC);
+    }
+    return true;
+}
+
+void FramePipeline::Private::workerLoop()
+{
+    for (;;) {
+        int index = 0;
+        {
+            QMutexLocker locker(&mutex);
+            // inputs are claimed in order, so the one the encoder waits for always has a worker
+            if (stopping || nextInput >= idat.size()) {
+                return;
+            }
+            index = nextInput++;
+        }
+        decodeInput(index);
+        finishInput(index);
+    }
+}
+
+void FramePipeline::Private::decodeInput(int index)
+{
+    const jxfrstch::InputFileData &ind = idat.at(index);
+
+    // JPEG that would come out of decoding exactly as it went in, hand its bitstream over instead
+    QByteArray jpegData;
+    if (readJpegInput(index, jpegData)) {
+        jxfrstch::PipelineFrame frm;
+        frm.inputIndex = index;
+        frm.jpegData = std::move(jpegData);
+        frm.frameSize = jpegFrameSize;
+        frm.imageRect = QRect(QPoint(0, 0), frm.frameSize);
+        frm.frameTick = ind.isPageEnd ? UINT32_MAX : ind.frameDuration;
+        push(std::move(frm));
+        return;
+    }
+
+    // huge still image, leave decoding to the chunked encoder one tile at a time
+    const bool cropped = params.autoCropFrame && !params.onlyCropAnimatedFile;
+    if (params.chunkedFrame && params.streamInputs && !cropped && QFileInfo(ind.filename).suffix().toLower() != "jxl"
+        && StreamedImageSource::canStream(ind.filename)) {
+        jxfrstch::PipelineFrame frm;
+        frm.inputIndex = index;
+        frm.stream.reset(new StreamedImageSource(ind.filename, params, rootICC));
+        frm.frameSize = frm.stream->size();
+        frm.imageRect = QRect(QPoint(0, 0), frm.frameSize);
+        frm.frameTick = ind.isPageEnd ? UINT32_MAX : ind.frameDuration;
+        push(std::move(frm));
+        return;
+    }
+
+    // trimmed or decimated inputs skip what they don't keep before it's decoded to pixels
+    const int frameIn = qMax(0, ind.frameIn);
+    const int frameOut = ind.frameOut < 0 ? std::numeric_limits<int>::max() : ind.frameOut;
+    const int frameStep = qMax(1, ind.frameStep);
+    const auto keptCount = [&](int sourceCount) {
+        const int last = qMin(frameOut, sourceCount - 1);
+        return last < frameIn ? 0 : (last - frameIn) / frameStep + 1;
+    };
+
+    jxfrstch::FrameCache &cache = jxfrstch::FrameCache::instance();
+    const QString cacheKey =
+        cache.isEnabled() ? jxfrstch::FrameCache::inputKey(ind.filename, params, rootICC) : QString();
+
+    int sourceFrame = frameIn;
+    int imageframenum = 0;
+
+    // decoded to the end before for the same target, serve the cached frames without opening the file
+    jxfrstch::CachedInput cachedInput;
+    if (!cacheKey.isEmpty() && cache.findInput(cacheKey, cachedInput)) {
+        const int lastFrame = qMin(frameOut, cachedInput.frameCount - 1);
+        jxfrstch::CachedFrame cached;
+        while (sourceFrame <= lastFrame && cache.findFrame(cacheKey, sourceFrame, cached)) {
+            QElapsedTimer elt;
+            elt.start();
+
+            jxfrstch::PipelineFrame frm;
+            frm.inputIndex = index;
+            frm.subframeIndex = imageframenum;
+            frm.isImageAnim = cachedInput.isImageAnim;
+            frm.imageRect = cached.imageRect;
+            frm.isJxl = cached.isJxl;
+            frm.jxlHeader = cached.jxlHeader;
+            frm.jxlFrameName = cached.jxlFrameName;
+
+            // decimated frames last until the next kept one, a miss on the frames in between falls back to decoding
+            const bool isLast = sourceFrame + frameStep > lastFrame;
+            int frameDelay = cached.frameDelay;
+            if (!isLast && frameStep > 1) {
+                if (cached.skippedFrames == frameStep - 1) {
+                    frameDelay += cached.skippedDelay;
+                } else {
+                    jxfrstch::CachedFrame skipped;
+                    int i = 1;
+                    for (; i < frameStep && cache.findFrame(cacheKey, sourceFrame + i, skipped); i++) {
+                        frameDelay += skipped.frameDelay;
+                    }
+                    if (i < frameStep) {
+                        break;
+                    }
+                }
+            }
+
+            sourceFrame += frameStep;
+            frm.isLastSubframe = isLast;
+            frm.imageCount = keptCount(cachedInput.frameCount);
+            frm.frameTick = frameTick(ind, cachedInput.isImageAnim || cachedInput.imageCount > 0, isLast, frameDelay);
+
+            QImage currentFrame = std::move(cached.image);
+            if (!finishFrame(std::move(frm), currentFrame, elt)) {
+                return;
+            }
+            imageframenum++;
+            if (isLast) {
+                return;
+            }
+        }
+        // evicted in the meantime, the decoder picks up from there
+    }
+
+    JXLDecoderObject reader;
+    reader.resetJxlDecoder();
+    reader.setEncodeParams(params);
+    reader.setOutputFormat(jxfrstch::encodeImageFormat(params.bitDepth, params.alpha));
+    reader.setOutputColorSpace(params.colorSpace, rootICC);
+    reader.setFileName(ind.filename);
+    if (ind.probe.coalesced == params.coalesceJxlInput && ind.probe.isCurrent(ind.filename)) {
+        reader.setFrameCountHint(ind.probe.frameCount);
+    }
+
+    const bool isImageAnim = reader.haveAnimation();
+    reader.skipFrames(sourceFrame);
+
+    while (reader.canRead() && sourceFrame <= frameOut) {
+        QElapsedTimer elt;
+        elt.start();
+
+        jxfrstch::PipelineFrame frm;
+        frm.inputIndex = index;
+        frm.subframeIndex = imageframenum;
+        frm.isImageAnim = isImageAnim;
+
+        QImage currentFrame(reader.read());
+        frm.imageRect = reader.currentImageRect();
+        if (!frm.imageRect.isValid()) {
+            frm.imageRect = currentFrame.rect();
+        }
+
+        if (currentFrame.isNull()) {
+            frm.decodeError = true;
+            frm.errorString = reader.errorString();
+            push(std::move(frm));
+            return;
+        }
+
+        // skipping moves the reader on, take what describes this frame first
+        const int frameDelay = reader.nextImageDelay();
+        frm.isJxl = reader.isJxl();
+        if (frm.isJxl) {
+            frm.jxlHeader = reader.getJxlFrameHeader();
+            frm.jxlFrameName = reader.getFrameName();
+        }
+        const int decodedFrame = sourceFrame;
+        // nothing skipped after the last frame, so the count is exact
+        const bool exhausted = !reader.canRead();
+
+        // a kept frame lasts until the next one, so it takes over the delays of the frames decimation drops
+        sourceFrame += frameStep;
+        int skippedFrames = 0;
+        int skippedDelay = 0;
+        if (frameStep > 1 && sourceFrame <= frameOut) {
+            reader.skipFrames(frameStep - 1, &skippedDelay);
+            skippedFrames = frameStep - 1;
+        }
+        frm.isLastSubframe = !reader.canRead() || sourceFrame > frameOut;
+        // JXL frame counts can be lower bounds until the last frame is read
+        frm.imageCount = frm.isLastSubframe ? imageframenum + 1 : qMax(imageframenum + 2, keptCount(reader.imageCount()));
+        frm.frameTick =
+            frameTick(ind, isImageAnim || reader.imageCount() > 0, frm.isLastSubframe, frameDelay + skippedDelay);
+
+        // JXL frames libjxl already rendered in the encode format and color space skip conversion altogether
+        const bool converted = reader.hasTargetColorSpace()
+            && currentFrame.format() == jxfrstch::encodeImageFormat(params.bitDepth, params.alpha);
+        if (!converted && !FramePipeline::convertFrame(currentFrame, params, rootICC)) {
+            frm.decodeError = true;
+            frm.errorString = "Unsupported bit depth!";
+            push(std::move(frm));
+            return;
+        }
+
+        if (!cacheKey.isEmpty()) {
+            cache.insertFrame(
+                cacheKey,
+                decodedFrame,
+                {currentFrame,
+                 frm.imageRect,
+                 frameDelay,
+                 frm.isJxl,
+                 frm.jxlHeader,
+                 frm.jxlFrameName,
+                 skippedFrames,
+                 skippedDelay});
+            if (exhausted) {
+                cache.insertInput(cacheKey, {decodedFrame + 1, reader.imageCount(), isImageAnim});
+            }
+        }
+
+        if (!finishFrame(std::move(frm), currentFrame, elt)) {
+            return;
+        }
+        imageframenum++;
+    }
+
+    if (imageframenum == 0) {
+        jxfrstch::PipelineFrame frm;
+        frm.inputIndex = index;
+        frm.decodeError = true;
+        frm.errorString = frameIn > 0 ? QString("No frames left in %1 after trimming!").arg(QFileInfo(ind.filename).fileName())
+                                      : reader.errorString();
+        push(std::move(frm));
+    }
+}
+
+uint32_t FramePipeline::Private::frameTick(const jxfrstch::InputFileData &ind,
+                                           bool hasFrames,
+                                           bool isLastSubframe,
+                                           int frameDelay) const
+{
+    // what the f-
+    if (!hasFrames || isLastSubframe) { // last kept frame == end of animation or just a single frame
+        return ind.isPageEnd ? UINT32_MAX : ind.frameDuration; // set the frame duration
+    } else if (frameDelay == 0 || !params.animation) {
+        return static_cast<uint32_t>(0);
+    } else {
+        return static_cast<uint32_t>(qRound(qMax(static_cast<float>(frameDelay) / params.frameTimeMs, 1.0)));
+    }
+}
+
+bool FramePipeline::Private::finishFrame(jxfrstch::PipelineFrame &&frm,
+                                         const QImage &currentFrame,
+                                         const QElapsedTimer &elt)
+{
+    const size_t uncropSize = static_cast<size_t>(currentFrame.width()) * static_cast<size_t>(currentFrame.height());
+    frm.autoCrop = (params.autoCropFrame && !params.onlyCropAnimatedFile)
+        || (frm.isImageAnim && params.onlyCropAnimatedFile && params.autoCropFrame) && uncropSize < 50'000'000;
+
+    frm.frameSize = currentFrame.size();
+    // repeats only turn into longer frames in animations, auto crop compares frames on its own
+    if (params.animation && !frm.autoCrop) {
+        frm.contentHash = frameContentHash(currentFrame, frm.imageRect);
+    }
+    const size_t packedBytes = ((params.alpha) ? 4 : 3) * jxfrstch::bytesPerChannel(params.bitDepth) * uncropSize;
+    const size_t spillBytes = static_cast<size_t>(qMax(0, params.spillThresholdMiB)) * 1024 * 1024;
+
+    // auto crop needs the previous frame, leave those to the encoder thread
+    if (!frm.autoCrop && spillBytes > 0 && packedBytes > spillBytes) {
+        // too big to sit in RAM while waiting for the encoder
+        frm.spill.reset(new FrameSpillFile(params.scratchDir));
+        if (!frm.spill->write(currentFrame, currentFrame.rect(), params.bitDepth, params.alpha)) {
+            frm.decodeError = true;
+            frm.errorString = frm.spill->errorString();
+            frm.spill.reset();
+            push(std::move(frm));
+            return false;
+        }
+    } else if (!frm.autoCrop && packFrames) {
+        jxfrstch::packImageToBuffer(currentFrame, frm.pixels, params.bitDepth, params.alpha);
+    } else {
+        frm.image = currentFrame;
+    }
+
+    frm.decodeNs = elt.nsecsElapsed();
+    return push(std::move(frm));
+}
+
+bool FramePipeline::Private::readJpegInput(int index, QByteArray &data) const
+{
+    const jxfrstch::InputFileData &ind = idat.at(index);
+    if (!jpegFrameSize.isValid() || ind.frameIn > 0 || ind.frameXPos != 0 || ind.frameYPos != 0) {
+        return false;
+    }
+    const QString suffix = QFileInfo(ind.filename).suffix().toLower();
+    if (suffix != "jpg" && suffix != "jpeg" && suffix != "jpe" && suffix != "jfif") {
+        return false;
+    }
+
+    QFile f(ind.filename);
+    if (!f.open(QIODevice::ReadOnly) || f.size() <= 0) {
+        return false;
+    }
+    // the probe stops at the first scan, so of a mapping only the headers get paged in
+    const uchar *mapped = f.map(0, f.size());
+    const QByteArray buf = mapped ? QByteArray::fromRawData(reinterpret_cast<const char *>(mapped), f.size()) : f.readAll();
+
+    jxfrstch::JpegProbe probe;
+    if (!jxfrstch::probeJpeg(buf, probe) || !probe.transcodable || probe.precision != 8 || probe.components != 3
+        || probe.size != jpegFrameSize) {
+        return false;
+    }
+
+    // decoding would have converted it otherwise
+    if (params.colorSpace != ENC_CS_RAW) {
+        const QColorSpace source =
+            probe.icc.isEmpty() ? QColorSpace(QColorSpace::SRgb) : QColorSpace::fromIccProfile(probe.icc);
+        if (!source.isValid() || source != jxfrstch::targetColorSpace(params.colorSpace, rootICC)) {
+            return false;
+        }
+    }
+
+    // only now the whole file is read, and copied out of the mapping before it goes away
+    data = mapped ? QByteArray(buf.constData(), buf.size()) : buf;
+    return true;
+}
+
+bool FramePipeline::Private::push(jxfrstch::PipelineFrame &&frame)
+{
+    QMutexLocker locker(&mutex);
+    const int index = frame.inputIndex;
+    // the frame the encoder is waiting for is always admitted, otherwise respect the lookahead depth
+    while (!stopping && buffered >= depth && !(index == head && queues.at(index).isEmpty())) {
+        cond.wait(&mutex);
+    }
+    if (stopping) {
+        return false;
+    }
+    queues[index].enqueue(std::move(frame));
+    buffered++;
+    cond.wakeAll();
+    return true;
+}
+
+void FramePipeline::Private::finishInput(int index)
+{
+    QMutexLocker locker(&mutex);
+    if (index < inputDone.size()) {
+        inputDone[index] = true;
+    }
+    cond.wakeAll();
+}
@@ -0,0 +1,73 @@
+#ifndef FRAMEPIPELINE_H
+#define FRAMEPIPELINE_H
+
+#include <QImage>
+#include <QRect>
+#include <QString>
+
+#include "framespill.h"
+#include "jxlutils.h"
+#include "streamedimage.h"
+
+#include <QSharedPointer>
+
+namespace jxfrstch
+{
+struct PipelineFrame {
+    int inputIndex{0};
+    int subframeIndex{0};
+    int imageCount{1};
+    bool isImageAnim{false};
+    bool isLastSubframe{true};
+    bool isJxl{false};
+    bool autoCrop{false};
+    bool decodeError{false};
+    uint32_t frameTick{0};
+    // converted pixels plus placement, 0 = not hashed
+    size_t contentHash{0};
+
+    // converted to target format and color space,
+    // null if the frame has already been packed into pixels
+    QImage image;
+    QByteArray pixels;
+    QSharedPointer<FrameSpillFile> spill; // packed on disk instead, when over the spill threshold
+    QSharedPointer<StreamedImageSource> stream; // not decoded at all, the encoder pulls tiles from it
+    QByteArray jpegData; // whole JPEG file, recompressed losslessly instead of encoded from pixels
+    QSize frameSize;
+    QRect imageRect;
+
+    JxlFrameHeader jxlHeader{};
+    QString jxlFrameName;
+    QString errorString;
+    qint64 decodeNs{0};
+};
+} // namespace jxfrstch
+
+/*
+ * Bounded producer/consumer frame pipeline
+ * Decode workers read and convert input frames ahead of the encoder,
+ * the encoder thread pops them back in the exact project order
+ */
+class FramePipeline
+{
+public:
+    FramePipeline();
+    ~FramePipeline();
+
+    void setPackFrames(bool pack);
+    // JPEG inputs that cover a frame of this size unchanged are passed on as is, invalid size = never
+    void setJpegRecompression(const QSize &frameSize);
+    void start(const QVector<jxfrstch::InputFileData> &idat,
+               const jxfrstch::EncodeParams &params,
+               const QByteArray &rootICC);
+    bool next(jxfrstch::PipelineFrame &frame);
+    void stop();
+
+    static bool convertFrame(QImage &image, const jxfrstch::EncodeParams &params, const QByteArray &rootICC);
+
+private:
+    class Private;
+    QScopedPointer<Private> d;
+};
+
+#endif // FRAMEPIPELINE_H
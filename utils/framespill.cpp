@@ -0,0 +1,141 @@
+#include "framespill.h"
+#include "workpool.h"
+
+#include <QDir>
+#include <QTemporaryFile>
+
+#if defined(Q_OS_LINUX)
+#include <fcntl.h>
+#endif
+
+namespace
+{
+// rows packed per write when the file can't be mapped
+constexpr size_t STRIPE_BYTES = 16 * 1024 * 1024;
+// rows per band when packing into the mapping over the pool
+constexpr int PACK_BAND_ROWS = 128;
+} // namespace
+
+class Q_DECL_HIDDEN FrameSpillFile::Private
+{
+public:
+    QTemporaryFile file;
+    uchar *mapped{nullptr};
+    size_t size{0};
+    QSize frameSize{};
+    QString errorString{};
+};
+
+FrameSpillFile::FrameSpillFile(const QString &scratchDir)
+    : d(new Private)
+{
+    const QString dir = scratchDir.isEmpty() ? QDir::tempPath() : scratchDir;
+    d->file.setFileTemplate(QDir(dir).filePath("jxfrstch-XXXXXX.spill"));
+    d->file.setAutoRemove(true);
+}
+
+FrameSpillFile::~FrameSpillFile()
+{
+    unmap();
+}
+
+bool FrameSpillFile::write(const QImage &img, const QRect &roi, EncodeBitDepth bitDepth, bool alpha)
+{
+    unmap();
+    if (!d->file.isOpen() && !d->file.open()) {
+        d->errorString = QString("Cannot create spill file in %1: %2")
+                             .arg(QFileInfo(d->file.fileTemplate()).absolutePath(), d->file.errorString());
+        return false;
+    }
+
+    const size_t bpc = jxfrstch::bytesPerChannel(bitDepth);
+    const size_t srcPx = 4 * bpc;
+    const size_t dstRow = ((alpha) ? 4 : 3) * bpc * static_cast<size_t>(roi.width());
+    const size_t height = static_cast<size_t>(roi.height());
+    d->size = dstRow * height;
+    d->frameSize = roi.size();
+
+    // reserve the blocks up front, running out of space while writing through a mapping is a crash
+#if defined(Q_OS_LINUX)
+    if (posix_fallocate(d->file.handle(), 0, static_cast<off_t>(d->size)) != 0) {
+        d->errorString = QString("Not enough space for %1 MiB spill file in %2")
+                             .arg(QString::number(d->size / 1024 / 1024), QFileInfo(d->file.fileName()).absolutePath());
+        return false;
+    }
+#endif
+    if (!d->file.resize(static_cast<qint64>(d->size))) {
+        d->errorString = QString("Cannot resize spill file: %1").arg(d->file.errorString());
+        return false;
+    }
+
+    const uchar *src = img.constScanLine(roi.y()) + static_cast<size_t>(roi.x()) * srcPx;
+    const size_t srcStride = static_cast<size_t>(img.bytesPerLine());
+
+    uchar *dst = d->file.map(0, static_cast<qint64>(d->size));
+    if (dst) {
+        jxfrstch::WorkPool::instance().parallelRows(static_cast<int>(height), PACK_BAND_ROWS, [&](int y0, int y1) {
+            jxfrstch::packInterleavedRows(src + static_cast<size_t>(y0) * srcStride,
+                                          srcStride,
+                                          dst + static_cast<size_t>(y0) * dstRow,
+                                          dstRow,
+                                          roi.width(),
+                                          static_cast<size_t>(y1 - y0),
+                                          bpc,
+                                          alpha);
+        });
+        d->file.unmap(dst);
+        return true;
+    }
+
+    // no mapping (eg. out of address space), go through a small stripe buffer instead
+    const size_t stripeRows = qMax<size_t>(1, STRIPE_BYTES / qMax<size_t>(1, dstRow));
+    QByteArray stripe;
+    d->file.seek(0);
+    for (size_t y = 0; y < height; y += stripeRows) {
+        const size_t rows = qMin(stripeRows, height - y);
+        stripe.resize(static_cast<qsizetype>(rows * dstRow));
+        jxfrstch::packInterleavedRows(src + y * srcStride, srcStride, stripe.data(), dstRow, roi.width(), rows, bpc, alpha);
+        if (d->file.write(stripe) != stripe.size()) {
+            d->errorString = QString("Failed writing spill file: %1").arg(d->file.errorString());
+            return false;
+        }
+    }
+    d->file.flush();
+    return true;
+}
+
+const uchar *FrameSpillFile::map()
+{
+    if (!d->mapped && d->file.isOpen() && d->size > 0) {
+        d->mapped = d->file.map(0, static_cast<qint64>(d->size));
+    }
+    return d->mapped;
+}
+
+void FrameSpillFile::unmap()
+{
+    if (d->mapped) {
+        d->file.unmap(d->mapped);
+        d->mapped = nullptr;
+    }
+}
+
+QFile *FrameSpillFile::file() const
+{
+    return &d->file;
+}
+
+size_t FrameSpillFile::size() const
+{
+    return d->size;
+}
+
+QSize FrameSpillFile::frameSize() const
+{
+    return d->frameSize;
+}
+
+QString FrameSpillFile::errorString() const
+{
+    return d->errorString;
+}
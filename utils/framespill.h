@@ -0,0 +1,38 @@
+#ifndef FRAMESPILL_H
+#define FRAMESPILL_H
+
+#include "jxlutils.h"
+#include <QString>
+
+class QFile;
+
+/*
+ * One packed frame parked on disk instead of RAM
+ * Pixels are written in the interleaved layout libjxl takes, so a mapped spill
+ * can be handed to the encoder as is. The temp file is unique per frame inside the
+ * scratch directory and is removed when this object goes away (including aborts)
+ */
+class FrameSpillFile
+{
+public:
+    FrameSpillFile(const QString &scratchDir);
+    ~FrameSpillFile();
+
+    // pack roi of a converted 4 channel image straight into the file
+    bool write(const QImage &img, const QRect &roi, EncodeBitDepth bitDepth, bool alpha);
+
+    // read only view of the whole frame, mapped on first call, nullptr if mapping failed
+    const uchar *map();
+    void unmap();
+
+    QFile *file() const;
+    size_t size() const;
+    QSize frameSize() const;
+    QString errorString() const;
+
+private:
+    class Private;
+    QScopedPointer<Private> d;
+};
+
+#endif // FRAMESPILL_H
@@ -0,0 +1,337 @@
+#include "imageheader.h"
+#include "jpegprobe.h"
+
+#include <QFile>
+#include <QSet>
+#include <QtEndian>
+
+#include <cstring>
+
+namespace
+{
+using jxfrstch::ImageHeader;
+
+inline bool startsWith(const uchar *p, qsizetype size, const char *magic, qsizetype magicSize)
+{
+    return size >= magicSize && memcmp(p, magic, magicSize) == 0;
+}
+
+bool readPng(const uchar *p, qsizetype size, ImageHeader &header)
+{
+    if (!startsWith(p, size, "\x89PNG\r\n\x1a\n", 8)) {
+        return false;
+    }
+
+    bool haveIhdr = false;
+    bool haveIccp = false;
+    bool haveColorChunk = false;
+    qsizetype pos = 8;
+    while (pos + 8 <= size) {
+        const quint32 length = qFromBigEndian<quint32>(p + pos);
+        const uchar *type = p + pos + 4;
+        const uchar *data = p + pos + 8;
+        if (length > quint32(size - pos - 8)) {
+            return false;
+        }
+
+        if (memcmp(type, "IHDR", 4) == 0 && length >= 13) {
+            haveIhdr = true;
+            header.size = QSize(qFromBigEndian<quint32>(data), qFromBigEndian<quint32>(data + 4));
+            const int colorType = data[9];
+            // palette indices are expanded to 8 bit
+            header.bitDepth = (colorType == 3) ? 8 : data[8];
+            header.hasAlpha = (colorType == 4 || colorType == 6);
+        } else if (memcmp(type, "tRNS", 4) == 0) {
+            header.hasAlpha = true;
+        } else if (memcmp(type, "acTL", 4) == 0 && length >= 8) {
+            header.frameCount = qMax<int>(1, qFromBigEndian<quint32>(data));
+            header.animation = true;
+        } else if (memcmp(type, "iCCP", 4) == 0) {
+            // profile name, compression method, then a zlib stream
+            const uchar *nameEnd = static_cast<const uchar *>(memchr(data, 0, length));
+            if (!nameEnd || nameEnd + 2 > data + length) {
+                return false;
+            }
+            const qsizetype zSize = data + length - (nameEnd + 2);
+            // qUncompress wants the expected size up front, it grows the buffer if the guess is short
+            QByteArray zData(4, Qt::Uninitialized);
+            qToBigEndian<quint32>(quint32(qMin<qsizetype>(zSize * 4, 1 << 20)), zData.data());
+            zData.append(reinterpret_cast<const char *>(nameEnd + 2), zSize);
+            header.icc = qUncompress(zData);
+            if (header.icc.isEmpty()) {
+                return false;
+            }
+            haveIccp = true;
+        } else if (memcmp(type, "gAMA", 4) == 0 || memcmp(type, "cHRM", 4) == 0 || memcmp(type, "sRGB", 4) == 0) {
+            haveColorChunk = true;
+        } else if (memcmp(type, "IDAT", 4) == 0 || memcmp(type, "IEND", 4) == 0) {
+            // everything of interest comes before the image data
+            break;
+        }
+        pos += 12 + qsizetype(length);
+    }
+    // Qt builds a color space out of these, only its own reader gives the same profile
+    if (haveColorChunk && !haveIccp) {
+        return false;
+    }
+    return haveIhdr && header.size.isValid();
+}
+
+bool readJpeg(const uchar *p, qsizetype size, ImageHeader &header)
+{
+    jxfrstch::JpegProbe probe;
+    if (!jxfrstch::probeJpeg(QByteArray::fromRawData(reinterpret_cast<const char *>(p), size), probe)) {
+        return false;
+    }
+    header.size = probe.size;
+    header.bitDepth = probe.precision;
+    header.icc = probe.icc;
+    return header.size.isValid();
+}
+
+bool readWebp(const uchar *p, qsizetype size, ImageHeader &header)
+{
+    if (size < 12 || memcmp(p, "RIFF", 4) != 0 || memcmp(p + 8, "WEBP", 4) != 0) {
+        return false;
+    }
+
+    header.bitDepth = 8;
+    bool haveVp8x = false;
+    int frames = 0;
+    qsizetype pos = 12;
+    while (pos + 8 <= size) {
+        const uchar *fourcc = p + pos;
+        const quint32 length = qFromLittleEndian<quint32>(p + pos + 4);
+        const uchar *data = p + pos + 8;
+        if (length > quint32(size - pos - 8)) {
+            return false;
+        }
+
+        if (memcmp(fourcc, "VP8X", 4) == 0 && length >= 10) {
+            haveVp8x = true;
+            header.hasAlpha = (data[0] & 0x10);
+            header.animation = (data[0] & 0x02);
+            const int w = 1 + (data[4] | (data[5] << 8) | (data[6] << 16));
+            const int h = 1 + (data[7] | (data[8] << 8) | (data[9] << 16));
+            header.size = QSize(w, h);
+        } else if (memcmp(fourcc, "ICCP", 4) == 0) {
+            header.icc = QByteArray(reinterpret_cast<const char *>(data), length);
+        } else if (memcmp(fourcc, "ANMF", 4) == 0) {
+            frames++;
+        } else if (memcmp(fourcc, "ALPH", 4) == 0) {
+            header.hasAlpha = true;
+        } else if (!haveVp8x && memcmp(fourcc, "VP8 ", 4) == 0 && length >= 10) {
+            // simple lossy file, size follows the frame tag and start code
+            if (data[3] != 0x9d || data[4] != 0x01 || data[5] != 0x2a) {
+                return false;
+            }
+            header.size = QSize(qFromLittleEndian<quint16>(data + 6) & 0x3fff, qFromLittleEndian<quint16>(data + 8) & 0x3fff);
+            break;
+        } else if (!haveVp8x && memcmp(fourcc, "VP8L", 4) == 0 && length >= 5) {
+            // simple lossless file, 14 bit width and height minus one, then the alpha hint
+            if (data[0] != 0x2f) {
+                return false;
+            }
+            const quint32 bits = qFromLittleEndian<quint32>(data + 1);
+            header.size = QSize(1 + (bits & 0x3fff), 1 + ((bits >> 14) & 0x3fff));
+            header.hasAlpha = (bits >> 28) & 1;
+            break;
+        }
+        // chunks are padded to an even size
+        pos += 8 + qsizetype(length) + (length & 1);
+    }
+    if (header.animation) {
+        header.frameCount = qMax(1, frames);
+    }
+    return header.size.isValid();
+}
+
+bool readTiff(const uchar *p, qsizetype size, ImageHeader &header)
+{
+    bool le = false;
+    if (size < 8) {
+        return false;
+    } else if (startsWith(p, size, "II*\0", 4)) {
+        le = true;
+    } else if (!startsWith(p, size, "MM\0*", 4)) {
+        return false;
+    }
+    const auto u16 = [&](qsizetype at) -> quint32 {
+        return le ? qFromLittleEndian<quint16>(p + at) : qFromBigEndian<quint16>(p + at);
+    };
+    const auto u32 = [&](qsizetype at) -> quint32 {
+        return le ? qFromLittleEndian<quint32>(p + at) : qFromBigEndian<quint32>(p + at);
+    };
+    // first value of an entry, values up to 4 bytes sit in the entry itself
+    const auto firstValue = [&](qsizetype entry) -> quint32 {
+        const quint32 type = u16(entry + 2);
+        const quint32 count = u32(entry + 4);
+        const qsizetype typeSize = (type == 3) ? 2 : (type == 4) ? 4 : 1;
+        qsizetype at = entry + 8;
+        if (count * typeSize > 4) {
+            at = u32(entry + 8);
+            if (at + typeSize > size) {
+                return 0;
+            }
+        }
+        return (type == 3) ? u16(at) : (type == 4) ? u32(at) : p[at];
+    };
+
+    qsizetype ifd = u32(4);
+    if (ifd < 8 || ifd + 2 > size) {
+        return false;
+    }
+
+    const int entries = u16(ifd);
+    if (ifd + 2 + entries * 12 > size) {
+        return false;
+    }
+    header.bitDepth = 1;
+    for (int i = 0; i < entries; i++) {
+        const qsizetype entry = ifd + 2 + i * 12;
+        switch (u16(entry)) {
+        case 256: // ImageWidth
+            header.size.setWidth(firstValue(entry));
+            break;
+        case 257: // ImageLength
+            header.size.setHeight(firstValue(entry));
+            break;
+        case 258: // BitsPerSample
+            header.bitDepth = firstValue(entry);
+            break;
+        case 338: { // ExtraSamples, associated or unassociated alpha
+            const quint32 extra = firstValue(entry);
+            header.hasAlpha = (extra == 1 || extra == 2);
+            break;
+        }
+        case 34675: { // ICC profile
+            const qsizetype count = u32(entry + 4);
+            const qsizetype at = (count > 4) ? qsizetype(u32(entry + 8)) : entry + 8;
+            if (at + count > size) {
+                return false;
+            }
+            header.icc = QByteArray(reinterpret_cast<const char *>(p + at), count);
+            break;
+        }
+        default:
+            break;
+        }
+    }
+
+    // pages, the IFD chain is all it takes
+    QSet<qsizetype> seen;
+    int pages = 0;
+    while (ifd >= 8 && ifd + 2 <= size && !seen.contains(ifd)) {
+        seen.insert(ifd);
+        pages++;
+        const qsizetype next = ifd + 2 + qsizetype(u16(ifd)) * 12;
+        if (next + 4 > size) {
+            break;
+        }
+        ifd = u32(next);
+    }
+    header.frameCount = qMax(1, pages);
+    return header.size.isValid();
+}
+
+bool readGif(const uchar *p, qsizetype size, ImageHeader &header)
+{
+    if (!startsWith(p, size, "GIF87a", 6) && !startsWith(p, size, "GIF89a", 6)) {
+        return false;
+    }
+    if (size < 13) {
+        return false;
+    }
+    header.size = QSize(qFromLittleEndian<quint16>(p + 6), qFromLittleEndian<quint16>(p + 8));
+    header.bitDepth = 8;
+
+    qsizetype pos = 13;
+    if (p[10] & 0x80) {
+        pos += 3 * (qsizetype(2) << (p[10] & 0x07));
+    }
+    const auto skipSubBlocks = [&]() {
+        while (pos < size && p[pos] != 0) {
+            pos += 1 + p[pos];
+        }
+        pos++;
+    };
+
+    int frames = 0;
+    while (pos < size) {
+        const uchar block = p[pos++];
+        if (block == 0x2c) {
+            // image descriptor, then an optional local color table and the LZW data
+            if (pos + 9 > size) {
+                break;
+            }
+            frames++;
+            const uchar flags = p[pos + 8];
+            pos += 9;
+            if (flags & 0x80) {
+                pos += 3 * (qsizetype(2) << (flags & 0x07));
+            }
+            pos++; // LZW minimum code size
+            skipSubBlocks();
+        } else if (block == 0x21) {
+            if (pos >= size) {
+                break;
+            }
+            const uchar label = p[pos++];
+            // graphic control extension with the transparency flag
+            if (label == 0xf9 && pos + 2 <= size && (p[pos + 1] & 0x01)) {
+                header.hasAlpha = true;
+            }
+            skipSubBlocks();
+        } else {
+            // trailer or garbage
+            break;
+        }
+    }
+    // truncated files still show what's there
+    header.frameCount = qMax(1, frames);
+    header.animation = frames > 1;
+    return header.size.isValid();
+}
+} // namespace
+
+namespace jxfrstch
+{
+bool readImageHeader(const QString &fileName, ImageHeader &header)
+{
+    QFile f(fileName);
+    if (!f.open(QIODevice::ReadOnly)) {
+        header = ImageHeader();
+        return false;
+    }
+    // GIF frames and TIFF pages can be anywhere in the file, a mapping only pages in what's looked at
+    const uchar *mapped = f.size() > 0 ? f.map(0, f.size()) : nullptr;
+    if (mapped) {
+        return readImageHeader(QByteArray::fromRawData(reinterpret_cast<const char *>(mapped), f.size()), header);
+    }
+    return readImageHeader(f.readAll(), header);
+}
+
+bool readImageHeader(const QByteArray &data, ImageHeader &header)
+{
+    header = ImageHeader();
+    const auto *p = reinterpret_cast<const uchar *>(data.constData());
+    const qsizetype size = data.size();
+
+    bool ok = false;
+    if (startsWith(p, size, "\x89PNG", 4)) {
+        ok = readPng(p, size, header);
+    } else if (startsWith(p, size, "\xff\xd8", 2)) {
+        ok = readJpeg(p, size, header);
+    } else if (startsWith(p, size, "RIFF", 4)) {
+        ok = readWebp(p, size, header);
+    } else if (startsWith(p, size, "II", 2) || startsWith(p, size, "MM", 2)) {
+        ok = readTiff(p, size, header);
+    } else if (startsWith(p, size, "GIF8", 4)) {
+        ok = readGif(p, size, header);
+    }
+    if (!ok) {
+        header = ImageHeader();
+    }
+    return ok;
+}
+} // namespace jxfrstch
@@ -0,0 +1,29 @@
+#ifndef IMAGEHEADER_H
+#define IMAGEHEADER_H
+
+#include <QByteArray>
+#include <QSize>
+#include <QString>
+
+namespace jxfrstch
+{
+struct ImageHeader {
+    QSize size{};
+    int bitDepth{0};
+    int frameCount{1}; // frames of an animation, pages of a TIFF
+    bool animation{false};
+    bool hasAlpha{false};
+    QByteArray icc{};
+};
+
+/*
+ * Reads size, bit depth, frame count, alpha presence and ICC of a PNG, JPEG, WebP, TIFF or GIF
+ * from its headers and metadata chunks only, no pixel data is decoded
+ * Returns false for other formats and for files it can't make sense of, QImageReader has to answer then
+ * That includes PNGs tagged with gAMA, cHRM or sRGB but no iCCP, their profile is whatever Qt makes of them
+ */
+bool readImageHeader(const QString &fileName, ImageHeader &header);
+bool readImageHeader(const QByteArray &data, ImageHeader &header);
+} // namespace jxfrstch
+
+#endif // IMAGEHEADER_H
@@ -0,0 +1,187 @@
+#include "inputprobe.h"
+#include "imageheader.h"
+#include "jxldecoderobject.h"
+
+#include <QAtomicInt>
+#include <QDateTime>
+#include <QFileInfo>
+#include <QHash>
+#include <QImageReader>
+#include <QSet>
+#include <QThread>
+#include <QThreadPool>
+
+namespace
+{
+bool needsProbe(const jxfrstch::InputFileData &ifd, const jxfrstch::EncodeParams &params)
+{
+    const bool isJxl = QFileInfo(ifd.filename).suffix().toLower() == "jxl";
+    return !ifd.probe.isCurrent(ifd.filename) || (isJxl && ifd.probe.coalesced != params.coalesceJxlInput);
+}
+} // namespace
+
+namespace jxfrstch
+{
+bool probeInput(const QString &fileName, const EncodeParams &params, InputProbe &probe)
+{
+    probe = InputProbe();
+    const QFileInfo fi(fileName);
+    if (!fi.exists()) {
+        return false;
+    }
+
+    InputProbe res;
+    res.fileSize = fi.size();
+    res.modifiedMs = fi.lastModified().toMSecsSinceEpoch();
+
+    ImageHeader header;
+    if (fi.suffix().toLower() != "jxl" && readImageHeader(fileName, header)) {
+        res.size = header.size;
+        res.frameCount = header.frameCount;
+        res.animation = header.animation;
+        res.bitDepth = header.bitDepth;
+        res.hasAlpha = header.hasAlpha;
+        res.icc = header.icc;
+        // eg. APNG, the frames are only there if the image plugin can read them
+        if (header.animation && !QImageReader(fileName).supportsAnimation()) {
+            res.frameCount = 1;
+            res.animation = false;
+        }
+        probe = res;
+        return true;
+    }
+
+    JXLDecoderObject reader;
+    reader.setEncodeParams(params);
+    reader.setFileName(fileName);
+    if (!reader.canRead()) {
+        return false;
+    }
+
+    res.size = reader.isJxl() ? reader.getRootFrameSize() : reader.size();
+    res.frameCount = qMax(1, reader.frameCount());
+    res.animation = reader.haveAnimation();
+    res.bitDepth = reader.bitDepth();
+    res.hasAlpha = reader.hasAlpha();
+    res.coalesced = reader.isJxl() && params.coalesceJxlInput;
+    res.icc = reader.getIccProfie();
+    if (!res.size.isValid()) {
+        return false;
+    }
+    probe = res;
+    return true;
+}
+
+int refreshProbes(QVector<InputFileData> &files, const EncodeParams &params)
+{
+    // the same file is often listed many times, each one is probed once
+    QStringList stale;
+    QHash<QString, int> slotOf;
+    for (const InputFileData &ifd : std::as_const(files)) {
+        if (!slotOf.contains(ifd.filename) && needsProbe(ifd, params)) {
+            slotOf.insert(ifd.filename, stale.size());
+            stale.append(ifd.filename);
+        }
+    }
+    if (stale.isEmpty()) {
+        return 0;
+    }
+
+    QVector<InputProbe> probes(stale.size());
+    QVector<char> probed(stale.size(), 0);
+    InputProbe *probeOut = probes.data();
+    char *probedOut = probed.data();
+    QAtomicInt next(0);
+
+    // mostly waiting on the disk, JXL inputs still decode their headers on the shared pool
+    QThreadPool pool;
+    const int workers = qBound(1, QThread::idealThreadCount(), static_cast<int>(stale.size()));
+    pool.setMaxThreadCount(workers);
+    for (int i = 0; i < workers; i++) {
+        pool.start([&]() {
+            for (int n = next.fetchAndAddRelaxed(1); n < stale.size(); n = next.fetchAndAddRelaxed(1)) {
+                probedOut[n] = probeInput(stale.at(n), params, probeOut[n]);
+            }
+        });
+    }
+    pool.waitForDone();
+
+    for (InputFileData &ifd : files) {
+        const auto it = slotOf.constFind(ifd.filename);
+        if (it != slotOf.constEnd()) {
+            ifd.probe = probes.at(it.value());
+        }
+    }
+
+    int failed = 0;
+    for (const char ok : std::as_const(probed)) {
+        if (!ok) {
+            failed++;
+        }
+    }
+    return failed;
+}
+
+QVector<ProbeIssue> checkInputs(const QVector<InputFileData> &files, const EncodeParams &params)
+{
+    QVector<ProbeIssue> issues;
+    if (files.isEmpty()) {
+        return issues;
+    }
+
+    const InputProbe &first = files.first().probe;
+    const int encodeBits = static_cast<int>(bytesPerChannel(params.bitDepth)) * 8;
+    // file level issues once per file, however often it's listed
+    QSet<QString> reported;
+
+    for (const InputFileData &ifd : files) {
+        const InputProbe &probe = ifd.probe;
+        const QString name = QFileInfo(ifd.filename).fileName();
+
+        if (probe.fileSize < 0) {
+            if (!reported.contains(ifd.filename)) {
+                reported.insert(ifd.filename);
+                const QString why = QFileInfo::exists(ifd.filename) ? "can't be read" : "not found";
+                issues.append({ifd.filename, QString("%1: %2").arg(name, why), true});
+            }
+            continue;
+        }
+
+        // trimming is per entry
+        if (ifd.frameIn > 0 && ifd.frameIn >= probe.frameCount) {
+            issues.append({ifd.filename,
+                           QString("%1: frame in %2 is past its last frame (%3)").arg(name).arg(ifd.frameIn).arg(probe.frameCount - 1),
+                           true});
+        }
+
+        if (reported.contains(ifd.filename)) {
+            continue;
+        }
+        reported.insert(ifd.filename);
+
+        if (params.colorSpace == ENC_CS_RAW && first.fileSize >= 0 && probe.icc != first.icc) {
+            issues.append({ifd.filename, QString("%1: ICC profile differs from the first input, RAW keeps it unconverted").arg(name), false});
+        }
+        if (probe.hasAlpha && !params.alpha) {
+            issues.append({ifd.filename, QString("%1: has alpha, which isn't encoded").arg(name), false});
+        }
+        if (probe.bitDepth > encodeBits) {
+            issues.append({ifd.filename, QString("%1: %2 bit input, encoded as %3 bit").arg(name).arg(probe.bitDepth).arg(encodeBits), false});
+        }
+    }
+    return issues;
+}
+
+QString formatIssues(const QVector<ProbeIssue> &issues, int maxLines)
+{
+    QStringList lines;
+    for (const ProbeIssue &issue : issues) {
+        if (lines.size() == maxLines) {
+            lines.append(QString("...and %1 more").arg(issues.size() - maxLines));
+            break;
+        }
+        lines.append(issue.message);
+    }
+    return lines.join('\n');
+}
+} // namespace jxfrstch
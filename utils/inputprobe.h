@@ -0,0 +1,37 @@
+#ifndef INPUTPROBE_H
+#define INPUTPROBE_H
+
+#include <QString>
+#include <QVector>
+
+#include "jxlutils.h"
+
+namespace jxfrstch
+{
+// something about one input that doesn't fit the rest of the project
+struct ProbeIssue {
+    QString fileName;
+    QString message;
+    bool fatal{false}; // the encode can't go on with it
+};
+
+/*
+ * Size, frame count, animation, bit depth, alpha and ICC of one input, false if it can't be read
+ * PNG, JPEG, WebP, TIFF and GIF are read from their headers, JXL from its basic info and frame headers
+ */
+bool probeInput(const QString &fileName, const EncodeParams &params, InputProbe &probe);
+
+/*
+ * Probes every input whose record is missing or doesn't match the file anymore, returns how many failed
+ * Each file is probed once, across a pool of its own, so it's safe to call from any thread
+ */
+int refreshProbes(QVector<InputFileData> &files, const EncodeParams &params);
+
+// unreadable inputs, and inputs not matching the first one or the encode settings, in list order
+QVector<ProbeIssue> checkInputs(const QVector<InputFileData> &files, const EncodeParams &params);
+
+// one message per line, cut off after maxLines
+QString formatIssues(const QVector<ProbeIssue> &issues, int maxLines = 20);
+} // namespace jxfrstch
+
+#endif // INPUTPROBE_H
@@ -0,0 +1,90 @@
+#include "jpegprobe.h"
+
+#include <QMap>
+
+namespace
+{
+constexpr uchar MARKER_SOI = 0xd8;
+constexpr uchar MARKER_EOI = 0xd9;
+constexpr uchar MARKER_SOS = 0xda;
+constexpr uchar MARKER_APP2 = 0xe2;
+
+inline int readU16(const uchar *p)
+{
+    return (p[0] << 8) | p[1];
+}
+} // namespace
+
+namespace jxfrstch
+{
+bool probeJpeg(const QByteArray &data, JpegProbe &probe)
+{
+    probe = JpegProbe();
+    const auto *p = reinterpret_cast<const uchar *>(data.constData());
+    const qsizetype size = data.size();
+    if (size < 4 || p[0] != 0xff || p[1] != MARKER_SOI) {
+        return false;
+    }
+
+    static const QByteArray iccTag("ICC_PROFILE\0", 12);
+    QMap<int, QByteArray> iccChunks;
+    bool haveFrame = false;
+
+    qsizetype pos = 2;
+    while (pos + 4 <= size) {
+        if (p[pos] != 0xff) {
+            return false;
+        }
+        // fill bytes
+        while (pos + 1 < size && p[pos + 1] == 0xff) {
+            pos++;
+        }
+        if (pos + 1 >= size) {
+            break;
+        }
+        const uchar marker = p[pos + 1];
+        pos += 2;
+        if (marker == 0x01 || (marker >= 0xd0 && marker <= 0xd7)) {
+            // no payload
+            continue;
+        }
+        if (marker == MARKER_EOI || marker == MARKER_SOS) {
+            break;
+        }
+        if (pos + 2 > size) {
+            return false;
+        }
+        const int length = readU16(p + pos);
+        if (length < 2 || pos + length > size) {
+            return false;
+        }
+        const uchar *segment = p + pos + 2;
+        const int segmentSize = length - 2;
+
+        const bool isSof = (marker >= 0xc0 && marker <= 0xcf && marker != 0xc4 && marker != 0xc8 && marker != 0xcc);
+        if (isSof && !haveFrame) {
+            if (segmentSize < 6) {
+                return false;
+            }
+            haveFrame = true;
+            probe.precision = segment[0];
+            probe.size = QSize(readU16(segment + 3), readU16(segment + 1));
+            probe.components = segment[5];
+            // SOF0-2, no lossless, hierarchical or arithmetic coding
+            probe.transcodable = (marker <= 0xc2);
+        } else if (marker == MARKER_APP2 && segmentSize > iccTag.size() + 2
+                   && QByteArray::fromRawData(reinterpret_cast<const char *>(segment), iccTag.size()) == iccTag) {
+            const int seq = segment[iccTag.size()];
+            iccChunks.insert(seq,
+                             QByteArray(reinterpret_cast<const char *>(segment + iccTag.size() + 2),
+                                        segmentSize - iccTag.size() - 2));
+        }
+        pos += length;
+    }
+
+    for (const QByteArray &chunk : std::as_const(iccChunks)) {
+        probe.icc += chunk;
+    }
+    return haveFrame;
+}
+} // namespace jxfrstch
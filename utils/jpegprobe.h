@@ -0,0 +1,26 @@
+#ifndef JPEGPROBE_H
+#define JPEGPROBE_H
+
+#include <QByteArray>
+#include <QSize>
+
+namespace jxfrstch
+{
+struct JpegProbe {
+    QSize size{};
+    int components{0};
+    int precision{0};
+    // huffman coded baseline, extended or progressive, what JxlEncoderAddJPEGFrame can take
+    bool transcodable{false};
+    // reassembled from the APP2 chunks, empty if there's none
+    QByteArray icc{};
+};
+
+/*
+ * Walks the JPEG marker segments up to the first scan, without decoding anything
+ * Returns false if data isn't a JPEG or has no frame header before the scan
+ */
+bool probeJpeg(const QByteArray &data, JpegProbe &probe);
+} // namespace jxfrstch
+
+#endif // JPEGPROBE_H
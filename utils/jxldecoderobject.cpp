@@ -1,29 +1,207 @@
 #include "jxldecoderobject.h"
+#include "colortransform.h"
+#include "imageheader.h"
+#include "workpool.h"
 
 #include <QColorSpace>
 #include <QDebug>
 #include <QImage>
 #include <QImageReader>
+#include <QDateTime>
 #include <QFile>
 #include <QFileInfo>
+#include <QHash>
+#include <QMutex>
+#include <QtEndian>
+
+#include <limits>
+
+#if defined(Q_OS_UNIX)
+#include <sys/mman.h>
+#endif
 
 #include <jxl/decode_cxx.h>
 #include <jxl/color_encoding.h>
-#include <jxl/resizable_parallel_runner_cxx.h>
+#if JPEGXL_NUMERIC_VERSION >= JPEGXL_COMPUTE_NUMERIC_VERSION(0, 9, 0)
+#include <jxl/cms.h>
+#endif
 
 // #define JXL_DECODER_QDEBUG
 
 /* this chunked file loading size is completely arbitrary,
  * define as many as you need.
+ * only used when the file can't be memory mapped
  */
 // metadata loading, read 16KB per chunk
 #define METADATA_FILE_CHUNK_SIZE 16384
 // frame loading, read 4MB per chunk
 #define FRAME_FILE_CHUNK_SIZE 4194304
 
+namespace
+{
+struct FrameIndex {
+    int frameCount{0};
+    // codestream offsets of the indexed frames, only known from a jxli box
+    QVector<quint64> offsets{};
+    // ticks of every frame, only known after a header walk
+    QVector<quint32> durations{};
+};
+
+// frame counts of files decoded before, so later readers don't have to walk the codestream for them
+class FrameIndexCache
+{
+public:
+    static FrameIndexCache &instance()
+    {
+        static FrameIndexCache cache;
+        return cache;
+    }
+
+    // layers are counted as frames without coalescing, so that is part of the key
+    static QString key(const QString &fileName, bool coalesced)
+    {
+        const QFileInfo fi(fileName);
+        return QString("%1|%2|%3|%4")
+            .arg(fi.absoluteFilePath(),
+                 QString::number(fi.lastModified().toMSecsSinceEpoch()),
+                 QString::number(fi.size()),
+                 coalesced ? "c" : "l");
+    }
+
+    bool find(const QString &key, FrameIndex &index)
+    {
+        QMutexLocker locker(&mutex);
+        const auto it = entries.constFind(key);
+        if (it == entries.constEnd()) {
+            return false;
+        }
+        index = it.value();
+        return true;
+    }
+
+    void insert(const QString &key, const FrameIndex &index)
+    {
+        QMutexLocker locker(&mutex);
+        // entries are tiny, just don't let a very long session grow it forever
+        if (entries.size() >= 4096) {
+            entries.clear();
+        }
+        entries.insert(key, index);
+    }
+
+private:
+    QMutex mutex;
+    QHash<QString, FrameIndex> entries;
+};
+
+bool readVarint(const uchar *&p, const uchar *end, quint64 &value)
+{
+    value = 0;
+    for (int shift = 0; shift < 64 && p < end; shift += 7) {
+        const uchar byte = *p++;
+        value |= static_cast<quint64>(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// jxli payload: NF, TNUM, TDEN, then NF times (offset delta, ticks, displayed frames)
+bool parseFrameIndex(const QByteArray &payload, FrameIndex &index)
+{
+    const uchar *p = reinterpret_cast<const uchar *>(payload.constData());
+    const uchar *end = p + payload.size();
+
+    quint64 indexed = 0;
+    if (!readVarint(p, end, indexed) || indexed == 0 || indexed > static_cast<quint64>(payload.size())) {
+        return false;
+    }
+    if (end - p < 8) {
+        return false;
+    }
+    // tick rate, the codestream has it too
+    p += 8;
+
+    quint64 offset = 0;
+    quint64 frames = 0;
+    index.offsets.clear();
+    index.offsets.reserve(static_cast<qsizetype>(indexed));
+    for (quint64 i = 0; i < indexed; i++) {
+        quint64 delta = 0;
+        quint64 ticks = 0;
+        quint64 displayed = 0;
+        if (!readVarint(p, end, delta) || !readVarint(p, end, ticks) || !readVarint(p, end, displayed)) {
+            return false;
+        }
+        offset += delta;
+        frames += displayed;
+        index.offsets.append(offset);
+    }
+    if (frames == 0 || frames > static_cast<quint64>(std::numeric_limits<int>::max())) {
+        return false;
+    }
+    index.frameCount = static_cast<int>(frames);
+    return true;
+}
+
+// walks the container box headers only, bare codestreams have no index
+bool readFrameIndexBox(QFile &file, FrameIndex &index)
+{
+    static const QByteArray containerSignature("\x00\x00\x00\x0cJXL \x0d\x0a\x87\x0a", 12);
+    const qint64 fileSize = file.size();
+    if (!file.seek(0) || file.read(12) != containerSignature) {
+        return false;
+    }
+
+    qint64 pos = 12;
+    while (pos + 8 <= fileSize) {
+        if (!file.seek(pos)) {
+            return false;
+        }
+        const QByteArray header = file.read(8);
+        if (header.size() != 8) {
+            return false;
+        }
+        quint64 boxSize = qFromBigEndian<quint32>(header.constData());
+        qint64 headerSize = 8;
+        if (boxSize == 1) {
+            const QByteArray largeSize = file.read(8);
+            if (largeSize.size() != 8) {
+                return false;
+            }
+            boxSize = qFromBigEndian<quint64>(largeSize.constData());
+            headerSize = 16;
+        } else if (boxSize == 0) {
+            // runs to the end of the file
+            boxSize = static_cast<quint64>(fileSize - pos);
+        }
+        if (boxSize < static_cast<quint64>(headerSize) || boxSize > static_cast<quint64>(fileSize - pos)) {
+            return false;
+        }
+
+        if (header.mid(4, 4) == "jxli") {
+            return parseFrameIndex(file.read(static_cast<qint64>(boxSize) - headerSize), index);
+        }
+        pos += static_cast<qint64>(boxSize);
+    }
+    return false;
+}
+} // namespace
+
 class Q_DECL_HIDDEN JXLDecoderObject::Private
 {
 public:
+    bool setInitialInput(qint64 chunkSize, bool sequential);
+    bool feedMoreInput(qint64 chunkSize);
+    void closeInput();
+    QImage::Format targetFormat() const;
+    bool beginFrames();
+    bool readFrameHeader();
+    bool walkFrameHeaders();
+    void requestOutputColor();
+    bool setPixelFormat(QImage::Format format);
+
     bool isJxl{false};
     bool isDecodeable{true};
     bool isCMYK{false};
@@ -31,10 +209,14 @@ public:
     bool isLast{false};
     bool readingSet{false};
     bool oneShotDecode{false};
+    // skipFrames() stopped at the header of the next frame to read
+    bool headerPending{false};
     double frameDurationMs{0.0};
     int rootWidth{0};
     int rootHeight{0};
+    // 0 = not known before the last frame is read
     int numFrames{0};
+    int framesRead{0};
 
     QSize rootSize{};
     QByteArray rootICC{};
@@ -43,17 +225,27 @@ public:
     QString inputFileName{};
     QString inputFileSuffix{};
     QString frameName{};
+    QString frameIndexKey{};
     QStringList oneShotSuffixes{};
 
     jxfrstch::EncodeParams params{};
+    QImage::Format outputFormat{QImage::Format_Invalid};
+    EncodeColorSpace outputColorSpace{ENC_CS_RAW};
+    QByteArray targetICC{};
+    // what decoded frames are tagged with, the target once libjxl took it
+    QColorSpace outputTag{};
+    bool inTargetColorSpace{false};
 
     QImageReader reader;
     QFile jxlFile;
 
     JxlDecoderPtr dec;
-    JxlResizableParallelRunnerPtr runner;
+    // whole file when mapped, jxlRawInputData is only used for chunked reads
+    const uchar *mappedInput{nullptr};
+    const uint8_t *inputData{nullptr};
+    size_t inputSize{0};
     QByteArray jxlRawInputData{};
-    QByteArray m_rawData{};
+    FrameIndex frameIndex{};
 
     JxlBasicInfo m_info{};
     JxlExtraChannelInfo m_extra{};
@@ -61,6 +253,314 @@ public:
     JxlFrameHeader m_header{};
 };
 
+// maps the whole file and hands it to libjxl at once, otherwise falls back to reading chunkSize chunks
+bool JXLDecoderObject::Private::setInitialInput(qint64 chunkSize, bool sequential)
+{
+    mappedInput = nullptr;
+    const qint64 fileSize = jxlFile.size();
+    if (fileSize > 0 && static_cast<quint64>(fileSize) <= std::numeric_limits<size_t>::max()) {
+        mappedInput = jxlFile.map(0, fileSize);
+    }
+
+    if (mappedInput) {
+#if defined(Q_OS_UNIX)
+        // full decodes stream through the file, the metadata pass stops after the first few pages
+        // and the default readahead already covers those
+        if (sequential) {
+            madvise(const_cast<uchar *>(mappedInput), static_cast<size_t>(fileSize), MADV_SEQUENTIAL);
+        }
+#else
+        Q_UNUSED(sequential);
+#endif
+        jxlRawInputData.clear();
+        inputData = reinterpret_cast<const uint8_t *>(mappedInput);
+        inputSize = static_cast<size_t>(fileSize);
+    } else {
+        jxlRawInputData = jxlFile.read(chunkSize);
+        inputData = reinterpret_cast<const uint8_t *>(jxlRawInputData.constData());
+        inputSize = static_cast<size_t>(jxlRawInputData.size());
+    }
+
+    if (JXL_DEC_SUCCESS != JxlDecoderSetInput(dec.get(), inputData, inputSize)) {
+        errStr = "JxlDecoderSetInput failed";
+        return false;
+    }
+    if (mappedInput) {
+        // everything is there, libjxl reports truncated files as errors instead of asking for more
+        JxlDecoderCloseInput(dec.get());
+    }
+    return true;
+}
+
+bool JXLDecoderObject::Private::feedMoreInput(qint64 chunkSize)
+{
+    if (mappedInput || jxlFile.atEnd()) {
+        closeInput();
+        errStr = "Error, already provided all input";
+        return false;
+    }
+    JxlDecoderReleaseInput(dec.get());
+    jxlRawInputData = jxlFile.read(chunkSize);
+    inputData = reinterpret_cast<const uint8_t *>(jxlRawInputData.constData());
+    inputSize = static_cast<size_t>(jxlRawInputData.size());
+    if (JXL_DEC_SUCCESS != JxlDecoderSetInput(dec.get(), inputData, inputSize)) {
+        errStr = "JxlDecoderSetInput failed";
+        return false;
+    }
+    return true;
+}
+
+QImage::Format JXLDecoderObject::Private::targetFormat() const
+{
+    if (outputFormat != QImage::Format_Invalid) {
+        return outputFormat;
+    }
+    switch (params.bitDepth) {
+    case ENC_BIT_16:
+        return QImage::Format_RGBA64;
+    case ENC_BIT_16F:
+        return QImage::Format_RGBA16FPx4;
+    case ENC_BIT_32F:
+        return QImage::Format_RGBA32FPx4;
+    default:
+        break;
+    }
+    return QImage::Format_RGBA8888;
+}
+
+// libjxl layout matching the QImage format, so frames land in the image bits as they are
+bool JXLDecoderObject::Private::setPixelFormat(QImage::Format format)
+{
+    m_pixelFormat = JxlPixelFormat{};
+    m_pixelFormat.endianness = JXL_NATIVE_ENDIAN;
+    m_pixelFormat.num_channels = 4;
+    switch (format) {
+    case QImage::Format_RGBA8888:
+    case QImage::Format_RGBX8888:
+        m_pixelFormat.data_type = JXL_TYPE_UINT8;
+        break;
+    case QImage::Format_RGB888:
+        m_pixelFormat.data_type = JXL_TYPE_UINT8;
+        m_pixelFormat.num_channels = 3;
+        break;
+    case QImage::Format_RGBA64:
+    case QImage::Format_RGBX64:
+        m_pixelFormat.data_type = JXL_TYPE_UINT16;
+        break;
+    case QImage::Format_RGBA16FPx4:
+    case QImage::Format_RGBX16FPx4:
+        m_pixelFormat.data_type = JXL_TYPE_FLOAT16;
+        break;
+    case QImage::Format_RGBA32FPx4:
+    case QImage::Format_RGBX32FPx4:
+        m_pixelFormat.data_type = JXL_TYPE_FLOAT;
+        break;
+    default:
+        return false;
+    }
+    // QImage scanlines are padded to 4 bytes
+    m_pixelFormat.align = 4;
+    return true;
+}
+
+// opens the file for the actual decode, runs once before the first frame is read or skipped
+bool JXLDecoderObject::Private::beginFrames()
+{
+    if (!jxlFile.open(QIODevice::ReadOnly)) {
+        errStr = "Failed to open input jxl";
+        return false;
+    }
+    if (!setInitialInput(FRAME_FILE_CHUNK_SIZE, true)) {
+        closeInput();
+        return false;
+    }
+
+    if (JXL_DEC_SUCCESS
+        != JxlDecoderSubscribeEvents(dec.get(), JXL_DEC_COLOR_ENCODING | JXL_DEC_FULL_IMAGE | JXL_DEC_FRAME)) {
+        errStr = "JxlDecoderSubscribeEvents failed";
+        return false;
+    }
+    if (JXL_DEC_SUCCESS != JxlDecoderSetParallelRunner(dec.get(), jxfrstch::parallelRunner, nullptr)) {
+        errStr = "JxlDecoderSetParallelRunner failed";
+        return false;
+    }
+
+    if (JXL_DEC_SUCCESS != JxlDecoderSetDecompressBoxes(dec.get(), JXL_TRUE)) {
+        errStr = "JxlDecoderSetDecompressBoxes failed";
+        return false;
+    };
+
+    if (JXL_DEC_SUCCESS != JxlDecoderSetRenderSpotcolors(dec.get(), JXL_TRUE)) {
+        errStr = "JxlDecoderSetRenderSpotcolors failed";
+        return false;
+    };
+    if (JXL_DEC_SUCCESS != JxlDecoderSetCoalescing(dec.get(), params.coalesceJxlInput ? JXL_TRUE : JXL_FALSE)) {
+        errStr = "JxlDecoderSetCoalescing failed";
+        return false;
+    };
+    outputTag = QColorSpace::fromIccProfile(rootICC);
+    inTargetColorSpace = (outputColorSpace == ENC_CS_RAW);
+    readingSet = false;
+    return true;
+}
+
+// the output encoding can only be picked once libjxl has reported the file's own
+void JXLDecoderObject::Private::requestOutputColor()
+{
+    if (outputColorSpace == ENC_CS_RAW) {
+        return;
+    }
+    const QColorSpace target = jxfrstch::targetColorSpace(outputColorSpace, targetICC);
+    if (!target.isValid()) {
+        return;
+    }
+    if (outputTag == target) {
+        outputTag = target;
+        inTargetColorSpace = true;
+        return;
+    }
+    // the preferred profile has to match gray vs color, leave gray files to the converter
+    if (m_info.num_color_channels != 3) {
+        return;
+    }
+
+    JxlColorEncoding encoding{};
+    const bool named = (outputColorSpace != ENC_CS_INHERIT_FIRST || targetICC.isEmpty());
+    switch (outputColorSpace) {
+    case ENC_CS_SRGB_LINEAR:
+        JxlColorEncodingSetToLinearSRGB(&encoding, JXL_FALSE);
+        break;
+    case ENC_CS_P3:
+        JxlColorEncodingSetToSRGB(&encoding, JXL_FALSE);
+        encoding.primaries = JXL_PRIMARIES_P3;
+        break;
+    default:
+        // inheriting from an untagged first frame ends up as sRGB as well
+        JxlColorEncodingSetToSRGB(&encoding, JXL_FALSE);
+        break;
+    }
+
+    if (named && m_info.uses_original_profile == JXL_FALSE) {
+        // XYB can be rendered to any encoding without a CMS
+        if (JXL_DEC_SUCCESS == JxlDecoderSetPreferredColorProfile(dec.get(), &encoding)) {
+            outputTag = target;
+            inTargetColorSpace = true;
+        }
+        return;
+    }
+
+#if JPEGXL_NUMERIC_VERSION >= JPEGXL_COMPUTE_NUMERIC_VERSION(0, 9, 0)
+    if (JXL_DEC_SUCCESS != JxlDecoderSetCms(dec.get(), *JxlGetDefaultCms())) {
+        return;
+    }
+    const JxlDecoderStatus status = named
+        ? JxlDecoderSetOutputColorProfile(dec.get(), &encoding, nullptr, 0)
+        : JxlDecoderSetOutputColorProfile(dec.get(),
+                                          nullptr,
+                                          reinterpret_cast<const uint8_t *>(targetICC.constData()),
+                                          static_cast<size_t>(targetICC.size()));
+    if (status == JXL_DEC_SUCCESS) {
+        outputTag = target;
+        inTargetColorSpace = true;
+    }
+#endif
+}
+
+bool JXLDecoderObject::Private::walkFrameHeaders()
+{
+    QFile file(inputFileName);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+    QByteArray buffer;
+    const uchar *data = file.map(0, file.size());
+    if (!data) {
+        buffer = file.readAll();
+        data = reinterpret_cast<const uchar *>(buffer.constData());
+    }
+
+    // only frame headers, frames nobody asked pixels for are jumped over
+    JxlDecoderPtr walker = JxlDecoderMake(nullptr);
+    if (!walker || JXL_DEC_SUCCESS != JxlDecoderSubscribeEvents(walker.get(), JXL_DEC_FRAME)
+        || JXL_DEC_SUCCESS != JxlDecoderSetCoalescing(walker.get(), params.coalesceJxlInput ? JXL_TRUE : JXL_FALSE)
+        || JXL_DEC_SUCCESS != JxlDecoderSetInput(walker.get(), data, static_cast<size_t>(file.size()))) {
+        return false;
+    }
+    JxlDecoderCloseInput(walker.get());
+
+    QVector<quint32> durations;
+    for (;;) {
+        const JxlDecoderStatus status = JxlDecoderProcessInput(walker.get());
+        if (status == JXL_DEC_FRAME) {
+            JxlFrameHeader header{};
+            if (JXL_DEC_SUCCESS != JxlDecoderGetFrameHeader(walker.get(), &header)) {
+                return false;
+            }
+            durations.append(header.duration);
+        } else if (status == JXL_DEC_SUCCESS) {
+            break;
+        } else {
+            // truncated or broken, reading it will say so
+            return false;
+        }
+    }
+    if (durations.isEmpty()) {
+        return false;
+    }
+
+    numFrames = static_cast<int>(durations.size());
+    frameIndex.frameCount = numFrames;
+    frameIndex.durations = durations;
+    if (!frameIndexKey.isEmpty()) {
+        FrameIndexCache::instance().insert(frameIndexKey, frameIndex);
+    }
+    return true;
+}
+
+bool JXLDecoderObject::Private::readFrameHeader()
+{
+    if (JXL_DEC_SUCCESS != JxlDecoderGetFrameHeader(dec.get(), &m_header)) {
+        errStr = "JxlDecoderGetFrameHeader failed";
+        return false;
+    }
+    isLast = (m_header.is_last == JXL_TRUE);
+    framesRead++;
+    if (isLast && numFrames != framesRead && !frameIndexKey.isEmpty()) {
+        // first full walk of this file, remember what it had
+        numFrames = framesRead;
+        frameIndex.frameCount = framesRead;
+        FrameIndexCache::instance().insert(frameIndexKey, frameIndex);
+    }
+    currentRect = QRect(static_cast<int>(m_header.layer_info.crop_x0),
+                        static_cast<int>(m_header.layer_info.crop_y0),
+                        static_cast<int>(m_header.layer_info.xsize),
+                        static_cast<int>(m_header.layer_info.ysize));
+
+    const uint32_t nameLength = m_header.name_length + 1;
+    if (nameLength > 0) {
+        QByteArray rawFrameName(nameLength, 0x0);
+        if (JXL_DEC_SUCCESS != JxlDecoderGetFrameName(dec.get(), rawFrameName.data(), nameLength)) {
+            errStr = "JxlDecoderGetFrameName failed";
+            return false;
+        }
+        frameName = QString::fromUtf8(rawFrameName);
+    } else {
+        frameName = QString();
+    }
+    return true;
+}
+
+void JXLDecoderObject::Private::closeInput()
+{
+    JxlDecoderCloseInput(dec.get());
+    JxlDecoderReleaseInput(dec.get());
+    // closing also unmaps
+    jxlFile.close();
+    mappedInput = nullptr;
+    inputData = nullptr;
+    inputSize = 0;
+}
+
 JXLDecoderObject::JXLDecoderObject()
     : d(new Private)
 {
@@ -106,10 +606,9 @@ void JXLDecoderObject::resetJxlDecoder()
     if (d->jxlFile.isOpen()) {
         d->jxlFile.close();
     };
+    d->mappedInput = nullptr;
     if (!d->dec)
         d->dec = JxlDecoderMake(nullptr);
-    if (!d->runner)
-        d->runner = JxlResizableParallelRunnerMake(nullptr);
 
     JxlDecoderReset(d->dec.get());
 
@@ -118,18 +617,21 @@ void JXLDecoderObject::resetJxlDecoder()
     d->isLast = false;
     d->readingSet = false;
     d->oneShotDecode = false;
+    d->headerPending = false;
     d->frameDurationMs = 0.0;
     d->rootWidth = 0;
     d->rootHeight = 0;
     d->numFrames = 0;
+    d->framesRead = 0;
     d->rootSize = QSize();
     d->currentRect = QRect();
     d->errStr = QString();
     d->frameName = QString();
+    d->frameIndexKey = QString();
+    d->frameIndex = FrameIndex();
 
     d->rootICC.clear();
     d->jxlRawInputData.clear();
-    d->m_rawData.clear();
 }
 
 bool JXLDecoderObject::isJxl()
@@ -139,9 +641,9 @@ bool JXLDecoderObject::isJxl()
 
 bool JXLDecoderObject::decodeJxlMetadata()
 {
-    // read only basic info and color encoding
-    if (!d->dec || !d->runner) {
-        d->errStr = "No dec or no runner";
+    // read only basic info and color encoding, frames are counted while read() decodes them
+    if (!d->dec) {
+        d->errStr = "No dec";
         return false;
     }
     if (!d->jxlFile.open(QIODevice::ReadOnly)) {
@@ -154,10 +656,27 @@ bool JXLDecoderObject::decodeJxlMetadata()
     //     return false;
     // }
 
-    d->jxlRawInputData = d->jxlFile.read(METADATA_FILE_CHUNK_SIZE);
+    d->frameIndexKey = FrameIndexCache::key(d->inputFileName, d->params.coalesceJxlInput);
+    if (FrameIndexCache::instance().find(d->frameIndexKey, d->frameIndex)) {
+        d->numFrames = d->frameIndex.frameCount;
+    } else if (d->params.coalesceJxlInput && readFrameIndexBox(d->jxlFile, d->frameIndex)) {
+        // jxli counts displayed frames, which only matches what we read once layers are coalesced
+        d->numFrames = d->frameIndex.frameCount;
+    } else {
+        d->frameIndex = FrameIndex();
+    }
+    if (!d->jxlFile.seek(0)) {
+        d->errStr = "Failed to rewind input jxl";
+        d->jxlFile.close();
+        return false;
+    }
 
-    const auto validation = JxlSignatureCheck(reinterpret_cast<const uint8_t *>(d->jxlRawInputData.constData()),
-                                              static_cast<size_t>(d->jxlRawInputData.size()));
+    if (!d->setInitialInput(METADATA_FILE_CHUNK_SIZE, false)) {
+        d->closeInput();
+        return false;
+    }
+
+    const auto validation = JxlSignatureCheck(d->inputData, d->inputSize);
 
     switch (validation) {
     case JXL_SIG_NOT_ENOUGH_BYTES:
@@ -171,22 +690,15 @@ bool JXLDecoderObject::decodeJxlMetadata()
     }
 
     if (JXL_DEC_SUCCESS
-        != JxlDecoderSubscribeEvents(d->dec.get(), JXL_DEC_BASIC_INFO | JXL_DEC_COLOR_ENCODING | JXL_DEC_FRAME)) {
+        != JxlDecoderSubscribeEvents(d->dec.get(), JXL_DEC_BASIC_INFO | JXL_DEC_COLOR_ENCODING)) {
         d->errStr = "JxlDecoderSubscribeEvents failed";
         return false;
     }
-    if (JXL_DEC_SUCCESS != JxlDecoderSetParallelRunner(d->dec.get(), JxlResizableParallelRunner, d->runner.get())) {
+    if (JXL_DEC_SUCCESS != JxlDecoderSetParallelRunner(d->dec.get(), jxfrstch::parallelRunner, nullptr)) {
         d->errStr = "JxlDecoderSetParallelRunner failed";
         return false;
     }
 
-    if (JXL_DEC_SUCCESS
-        != JxlDecoderSetInput(d->dec.get(),
-                              reinterpret_cast<const uint8_t *>(d->jxlRawInputData.constData()),
-                              static_cast<size_t>(d->jxlRawInputData.size()))) {
-        d->errStr = "JxlDecoderSetInput failed";
-        return false;
-    };
     if (JXL_DEC_SUCCESS != JxlDecoderSetDecompressBoxes(d->dec.get(), JXL_TRUE)) {
         d->errStr = "JxlDecoderSetDecompressBoxes failed";
         return false;
@@ -214,22 +726,9 @@ bool JXLDecoderObject::decodeJxlMetadata()
             d->errStr = "Decoder error";
             return false;
         } else if (status == JXL_DEC_NEED_MORE_INPUT) {
-            if (d->jxlFile.atEnd()) {
-                d->jxlFile.close();
-                JxlDecoderCloseInput(d->dec.get());
-                JxlDecoderReleaseInput(d->dec.get());
-                d->errStr = "Error, already provided all input";
+            if (!d->feedMoreInput(METADATA_FILE_CHUNK_SIZE)) {
                 return false;
             }
-            JxlDecoderReleaseInput(d->dec.get());
-            d->jxlRawInputData = d->jxlFile.read(METADATA_FILE_CHUNK_SIZE);
-            if (JXL_DEC_SUCCESS
-                != JxlDecoderSetInput(d->dec.get(),
-                                      reinterpret_cast<const uint8_t *>(d->jxlRawInputData.constData()),
-                                      static_cast<size_t>(d->jxlRawInputData.size()))) {
-                d->errStr = "JxlDecoderSetInput failed";
-                return false;
-            };
         } else if (status == JXL_DEC_BASIC_INFO) {
             if (JXL_DEC_SUCCESS != JxlDecoderGetBasicInfo(d->dec.get(), &d->m_info)) {
                 d->errStr = "JxlDecoderGetBasicInfo failed";
@@ -257,13 +756,6 @@ bool JXLDecoderObject::decodeJxlMetadata()
             qDebug() << "Original profile?" << d->m_info.uses_original_profile;
             qDebug() << "Has preview?" << d->m_info.have_preview << d->m_info.preview.xsize << "x" << d->m_info.preview.ysize;
 #endif
-            const uint32_t numthreads = [&]() {
-                return JxlResizableParallelRunnerSuggestThreads(d->m_info.xsize, d->m_info.ysize);
-            }();
-#ifdef JXL_DECODER_QDEBUG
-            qDebug() << "Threads set:" << numthreads;
-#endif
-            JxlResizableParallelRunnerSetThreads(d->runner.get(), numthreads);
             d->jxlHasAnim = (d->m_info.have_animation == JXL_TRUE);
             d->rootSize = QSize(d->m_info.xsize, d->m_info.ysize);
             d->rootWidth = d->rootSize.width();
@@ -274,25 +766,6 @@ bool JXLDecoderObject::decodeJxlMetadata()
                                     / static_cast<double>(d->m_info.animation.tps_numerator));
             }
 
-            // d->m_pixelFormat.data_type = JXL_TYPE_FLOAT;
-            switch (d->params.bitDepth) {
-            case ENC_BIT_8:
-                d->m_pixelFormat.data_type = JXL_TYPE_UINT8;
-                break;
-            case ENC_BIT_16:
-                d->m_pixelFormat.data_type = JXL_TYPE_UINT16;
-                break;
-            case ENC_BIT_16F:
-                d->m_pixelFormat.data_type = JXL_TYPE_FLOAT16;
-                break;
-            case ENC_BIT_32F:
-                d->m_pixelFormat.data_type = JXL_TYPE_FLOAT;
-                break;
-            default:
-                d->m_pixelFormat.data_type = JXL_TYPE_UINT8;
-                break;
-            }
-            d->m_pixelFormat.num_channels = 4;
         } else if (status == JXL_DEC_COLOR_ENCODING) {
             size_t iccSize = 0;
 
@@ -320,12 +793,11 @@ bool JXLDecoderObject::decodeJxlMetadata()
                 d->errStr = "JxlDecoderGetColorAsICCProfile failed";
                 return false;
             }
-        } else if (status == JXL_DEC_FRAME) {
-            d->numFrames++;
+            // that's all we need, don't walk the rest of the codestream
+            d->closeInput();
+            break;
         } else if (status == JXL_DEC_SUCCESS) {
-            d->jxlFile.close();
-            JxlDecoderCloseInput(d->dec.get());
-            JxlDecoderReleaseInput(d->dec.get());
+            d->closeInput();
             break;
         }
     }
@@ -345,6 +817,22 @@ void JXLDecoderObject::setEncodeParams(const jxfrstch::EncodeParams &params)
     d->params = params;
 }
 
+void JXLDecoderObject::setOutputFormat(QImage::Format format)
+{
+    d->outputFormat = format;
+}
+
+void JXLDecoderObject::setOutputColorSpace(EncodeColorSpace target, const QByteArray &rootICC)
+{
+    d->outputColorSpace = target;
+    d->targetICC = rootICC;
+}
+
+bool JXLDecoderObject::hasTargetColorSpace() const
+{
+    return d->isJxl && d->inTargetColorSpace;
+}
+
 QSize JXLDecoderObject::getRootFrameSize() const
 {
     if (!d->isJxl) {
@@ -358,6 +846,10 @@ QSize JXLDecoderObject::getRootFrameSize() const
 QByteArray JXLDecoderObject::getIccProfie() const
 {
     if (!d->isJxl) {
+        jxfrstch::ImageHeader header;
+        if (jxfrstch::readImageHeader(d->inputFileName, header)) {
+            return header.icc;
+        }
         return QImage(d->inputFileName).colorSpace().iccProfile();
     } else if (d->isJxl) {
         return d->rootICC;
@@ -380,11 +872,56 @@ int JXLDecoderObject::imageCount() const
     if (!d->isJxl) {
         return d->reader.imageCount();
     } else if (d->isJxl) {
-        return d->numFrames;
+        // without an index, at least one more frame follows until the last one is read
+        return qMax(d->numFrames, d->isLast ? d->framesRead : d->framesRead + 1);
     }
     return 1;
 }
 
+int JXLDecoderObject::frameCount()
+{
+    if (!d->isJxl) {
+        return d->reader.imageCount();
+    }
+    if (!d->isDecodeable) {
+        return 0;
+    }
+    if (d->numFrames > 0) {
+        return d->numFrames;
+    }
+    return d->walkFrameHeaders() ? d->numFrames : 0;
+}
+
+void JXLDecoderObject::setFrameCountHint(int count)
+{
+    if (!d->isJxl || count <= 0 || d->numFrames > 0) {
+        return;
+    }
+    d->numFrames = count;
+    d->frameIndex.frameCount = count;
+    if (!d->frameIndexKey.isEmpty()) {
+        FrameIndexCache::instance().insert(d->frameIndexKey, d->frameIndex);
+    }
+}
+
+int JXLDecoderObject::bitDepth() const
+{
+    if (d->isJxl) {
+        return static_cast<int>(d->m_info.bits_per_sample);
+    }
+    // the format the handler would read into, known from the header
+    const QPixelFormat pf = QImage::toPixelFormat(d->reader.imageFormat());
+    return pf.colorModel() == QPixelFormat::Grayscale ? pf.brightnessSize() : pf.redSize();
+}
+
+bool JXLDecoderObject::hasAlpha() const
+{
+    if (d->isJxl) {
+        return d->m_info.alpha_bits > 0;
+    }
+    return QImage::toPixelFormat(d->reader.imageFormat()).alphaUsage() == QPixelFormat::UsesAlpha;
+}
+
 int JXLDecoderObject::nextImageDelay() const
 {
     if (!d->isJxl) {
@@ -416,7 +953,7 @@ bool JXLDecoderObject::canRead() const
         if (!d->isDecodeable) {
             return false;
         }
-        return !d->isLast;
+        return d->headerPending || !d->isLast;
     }
     return false;
 }
@@ -430,54 +967,38 @@ QImage JXLDecoderObject::read()
         return d->reader.read();
     } else if (d->isJxl) {
         // read full image and frame one by one
-        if (d->readingSet) {
-            if (!d->jxlFile.open(QIODevice::ReadOnly)) {
-                d->errStr = "Failed to open input jxl";
-                return QImage();
-            }
-            d->jxlRawInputData.clear();
-            d->jxlRawInputData = d->jxlFile.read(FRAME_FILE_CHUNK_SIZE);
+        if (d->readingSet && !d->beginFrames()) {
+            return QImage();
+        }
+        d->headerPending = false;
 
-            if (JXL_DEC_SUCCESS
-                != JxlDecoderSubscribeEvents(d->dec.get(), JXL_DEC_FULL_IMAGE | JXL_DEC_FRAME)) {
-                d->errStr = "JxlDecoderSubscribeEvents failed";
-                return QImage();
+        const QImage::Format outFormat = d->targetFormat();
+        // libjxl fills the 4th channel with alpha if there is any, decode with it and drop it after
+        const QImage::Format decodeFormat = [&]() {
+            if (d->m_info.alpha_bits == 0) {
+                return outFormat;
             }
-            if (JXL_DEC_SUCCESS != JxlDecoderSetParallelRunner(d->dec.get(), JxlResizableParallelRunner, d->runner.get())) {
-                d->errStr = "JxlDecoderSetParallelRunner failed";
-                return QImage();
+            switch (outFormat) {
+            case QImage::Format_RGBX8888:
+                return QImage::Format_RGBA8888;
+            case QImage::Format_RGBX64:
+                return QImage::Format_RGBA64;
+            case QImage::Format_RGBX16FPx4:
+                return QImage::Format_RGBA16FPx4;
+            case QImage::Format_RGBX32FPx4:
+                return QImage::Format_RGBA32FPx4;
+            default:
+                break;
             }
-
-            if (JXL_DEC_SUCCESS
-                != JxlDecoderSetInput(d->dec.get(),
-                                      reinterpret_cast<const uint8_t *>(d->jxlRawInputData.constData()),
-                                      static_cast<size_t>(d->jxlRawInputData.size()))) {
-                d->errStr = "JxlDecoderSetInput failed";
-                return QImage();
-            };
-            // JxlDecoderCloseInput(d->dec.get());
-            if (JXL_DEC_SUCCESS != JxlDecoderSetDecompressBoxes(d->dec.get(), JXL_TRUE)) {
-                d->errStr = "JxlDecoderSetDecompressBoxes failed";
-                return QImage();
-            };
-
-            if (JXL_DEC_SUCCESS != JxlDecoderSetRenderSpotcolors(d->dec.get(), JXL_TRUE)) {
-                d->errStr = "JxlDecoderSetRenderSpotcolors failed";
-                return QImage();
-            };
-            if (JXL_DEC_SUCCESS != JxlDecoderSetCoalescing(d->dec.get(), d->params.coalesceJxlInput ? JXL_TRUE : JXL_FALSE)) {
-                d->errStr = "JxlDecoderSetCoalescing failed";
-                return QImage();
-            };
-            const uint32_t numthreads = [&]() {
-                return JxlResizableParallelRunnerSuggestThreads(d->m_info.xsize, d->m_info.ysize);
-            }();
-            JxlResizableParallelRunnerSetThreads(d->runner.get(), numthreads);
-            d->readingSet = false;
+            return outFormat;
+        }();
+        if (!d->setPixelFormat(decodeFormat)) {
+            d->errStr = "Unsupported output format";
+            d->closeInput();
+            return QImage();
         }
 
-        d->m_rawData.clear();
-
+        QImage buff;
         bool decodeSuccess = false;
         for(;;) {
 #ifdef JXL_DECODER_QDEBUG
@@ -492,110 +1013,141 @@ QImage JXLDecoderObject::read()
                 d->errStr = "Decoder error";
                 break;
             } else if (status == JXL_DEC_NEED_MORE_INPUT) {
-                if (d->jxlFile.atEnd()) {
-                    d->jxlFile.close();
-                    JxlDecoderCloseInput(d->dec.get());
-                    JxlDecoderReleaseInput(d->dec.get());
-                    d->errStr = "Error, already provided all input";
+                if (!d->feedMoreInput(FRAME_FILE_CHUNK_SIZE)) {
                     break;
                 }
-                JxlDecoderReleaseInput(d->dec.get());
-                d->jxlRawInputData = d->jxlFile.read(FRAME_FILE_CHUNK_SIZE);
-                if (JXL_DEC_SUCCESS
-                    != JxlDecoderSetInput(d->dec.get(),
-                                          reinterpret_cast<const uint8_t *>(d->jxlRawInputData.constData()),
-                                          static_cast<size_t>(d->jxlRawInputData.size()))) {
-                    d->errStr = "JxlDecoderSetInput failed";
-                    break;
-                };
             }  else if (status == JXL_DEC_NEED_IMAGE_OUT_BUFFER) {
                 size_t rawSize = 0;
                 if (JXL_DEC_SUCCESS != JxlDecoderImageOutBufferSize(d->dec.get(), &d->m_pixelFormat, &rawSize)) {
                     d->errStr = "JxlDecoderImageOutBufferSize failed";
                     break;
                 }
-                d->m_rawData.resize(static_cast<int>(rawSize));
+                buff = QImage(d->currentRect.size(), decodeFormat);
+                if (buff.isNull() || static_cast<size_t>(buff.sizeInBytes()) != rawSize) {
+                    d->errStr = "Failed to allocate output frame";
+                    break;
+                }
                 if (JXL_DEC_SUCCESS
                     != JxlDecoderSetImageOutBuffer(d->dec.get(),
                                                    &d->m_pixelFormat,
-                                                   reinterpret_cast<uint8_t *>(d->m_rawData.data()),
-                                                   static_cast<size_t>(d->m_rawData.size()))) {
+                                                   reinterpret_cast<uint8_t *>(buff.bits()),
+                                                   rawSize)) {
                     d->errStr = "JxlDecoderSetImageOutBuffer failed";
                     break;
                 }
+            } else if (status == JXL_DEC_COLOR_ENCODING) {
+                d->requestOutputColor();
             } else if (status == JXL_DEC_FRAME) {
-                if (JXL_DEC_SUCCESS != JxlDecoderGetFrameHeader(d->dec.get(), &d->m_header)) {
-                    d->errStr = "JxlDecoderGetFrameHeader failed";
+                if (!d->readFrameHeader()) {
                     break;
                 }
-                d->isLast = (d->m_header.is_last == JXL_TRUE);
-
-                const uint32_t nameLength = d->m_header.name_length + 1;
-                if (nameLength > 0) {
-                    QByteArray rawFrameName(nameLength, 0x0);
-                    if (JXL_DEC_SUCCESS != JxlDecoderGetFrameName(d->dec.get(), rawFrameName.data(), nameLength)) {
-                        d->errStr = "JxlDecoderGetFrameName failed";
-                        break;
-                    }
-                    d->frameName = QString::fromUtf8(rawFrameName);
-                } else {
-                    d->frameName = QString();
-                }
             } else if (status == JXL_DEC_FULL_IMAGE) {
                 if (!d->isLast) {
                     decodeSuccess = true;
                     break;
                 }
             } else if (status == JXL_DEC_SUCCESS && d->isLast) {
-                d->jxlFile.close();
-                JxlDecoderCloseInput(d->dec.get());
-                JxlDecoderReleaseInput(d->dec.get());
+                d->closeInput();
                 decodeSuccess = true;
                 break;
             }
         }
 
         if (!decodeSuccess) {
-            d->jxlFile.close();
-            JxlDecoderCloseInput(d->dec.get());
-            JxlDecoderReleaseInput(d->dec.get());
+            d->closeInput();
             return QImage();
         }
 
-        d->currentRect = QRect(static_cast<int>(d->m_header.layer_info.crop_x0),
-                               static_cast<int>(d->m_header.layer_info.crop_y0),
-                               static_cast<int>(d->m_header.layer_info.xsize),
-                               static_cast<int>(d->m_header.layer_info.ysize));
+        buff.setColorSpace(d->outputTag);
+        if (buff.format() != outFormat) {
+            // same depth, done in place
+            buff.convertTo(outFormat);
+        }
 
-        const QImage::Format fmt = [&]() {
-            switch (d->params.bitDepth) {
-            case ENC_BIT_8:
-                return QImage::Format_RGBA8888;
-                break;
-            case ENC_BIT_16:
-                return QImage::Format_RGBA64;
-                break;
-            case ENC_BIT_16F:
-                return QImage::Format_RGBA16FPx4;
-                break;
-            case ENC_BIT_32F:
-                return QImage::Format_RGBA32FPx4;
-                break;
-            default:
-                break;
+        return buff;
+    }
+    return QImage();
+}
+
+void JXLDecoderObject::skipFrames(int count, int *skippedDelay)
+{
+    if (count <= 0 || !canRead()) {
+        return;
+    }
+    if (!d->isJxl) {
+        if (d->oneShotSuffixes.contains(d->inputFileSuffix)) {
+            d->oneShotDecode = true;
+            return;
+        }
+        for (int i = 0; i < count && d->reader.canRead(); i++) {
+            // not every handler can jump, reading still leaves out every conversion
+            if (!d->reader.jumpToNextImage()) {
+                d->reader.read();
             }
-            return QImage::Format_RGBA8888;
-        }();
+            if (skippedDelay) {
+                *skippedDelay += d->reader.nextImageDelay();
+            }
+        }
+        return;
+    }
+
+    if (d->readingSet && !d->beginFrames()) {
+        d->isDecodeable = false;
+        return;
+    }
+    if (d->headerPending) {
+        // that frame is already under way, decoding it is the only way past
+        read();
+        if (skippedDelay) {
+            *skippedDelay += nextImageDelay();
+        }
+        if (--count == 0 || !canRead()) {
+            return;
+        }
+    }
 
-        QImage buff(d->currentRect.width(), d->currentRect.height(), fmt);
+    // skipped frames never show up as events, their durations come from walking the headers
+    if (skippedDelay && d->jxlHasAnim && (!d->frameIndex.durations.isEmpty() || d->walkFrameHeaders())) {
+        const int end = qMin(d->framesRead + count, static_cast<int>(d->frameIndex.durations.size()));
+        for (int i = d->framesRead; i < end; i++) {
+            *skippedDelay += static_cast<int>(d->frameDurationMs * d->frameIndex.durations.at(i));
+        }
+    }
 
-        buff.setColorSpace(QColorSpace::fromIccProfile(d->rootICC));
-        memcpy(buff.bits(), d->m_rawData.constData(), d->m_rawData.size());
-        d->m_rawData.clear();
+    // libjxl still walks the skipped frames, but only renders what later frames reference
+    JxlDecoderSkipFrames(d->dec.get(), static_cast<size_t>(count));
+    d->framesRead += count;
 
-        return buff;
+    // run up to the next header so canRead() knows whether anything is left
+    for (;;) {
+        const JxlDecoderStatus status = JxlDecoderProcessInput(d->dec.get());
+        if (status == JXL_DEC_ERROR) {
+            d->errStr = "Decoder error";
+            d->isDecodeable = false;
+            d->closeInput();
+            return;
+        } else if (status == JXL_DEC_NEED_MORE_INPUT) {
+            if (!d->feedMoreInput(FRAME_FILE_CHUNK_SIZE)) {
+                d->isDecodeable = false;
+                return;
+            }
+        } else if (status == JXL_DEC_COLOR_ENCODING) {
+            d->requestOutputColor();
+        } else if (status == JXL_DEC_FRAME) {
+            if (!d->readFrameHeader()) {
+                d->isDecodeable = false;
+                d->closeInput();
+                return;
+            }
+            d->headerPending = true;
+            return;
+        } else if (status == JXL_DEC_SUCCESS) {
+            // skipped past the last frame
+            d->isLast = true;
+            d->closeInput();
+            return;
+        }
     }
-    return QImage();
 }
 
 JxlFrameHeader JXLDecoderObject::getJxlFrameHeader() const
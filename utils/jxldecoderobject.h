@@ -15,14 +15,38 @@ public:
     ~JXLDecoderObject();
 
     void setEncodeParams(const jxfrstch::EncodeParams &params);
+    /*
+     * Format JXL frames are decoded straight into, Format_Invalid (default) = RGBA of the params bit depth
+     * RGBA/RGBX 8888, 64, 16FPx4, 32FPx4 and RGB888 are supported, other inputs come back as QImageReader reads them
+     */
+    void setOutputFormat(QImage::Format format);
+    // JXL frames are decoded straight to the project color space where libjxl can do it, ENC_CS_RAW = keep the file's
+    void setOutputColorSpace(EncodeColorSpace target, const QByteArray &rootICC);
+    // the JXL frames read need no color conversion anymore
+    bool hasTargetColorSpace() const;
     void setFileName(const QString &inputFilename);
 
     bool isJxl();
     QImage read();
+    /*
+     * Drops the next count frames without converting them, JXL frames aren't even rendered
+     * JXL inputs stop at the next frame header, so canRead() is exact afterwards
+     * Header, name, rect and delay then describe the next frame, query them before skipping
+     * skippedDelay, if given, gets the delays of the skipped frames added (JXL ones cost a header walk, once per file)
+     */
+    void skipFrames(int count, int *skippedDelay = nullptr);
     void resetJxlDecoder();
 
     QSize size() const;
+    // JXL: from the frame index cache or a jxli box, otherwise frames read so far plus one until the last one
     int imageCount() const;
+    // exact, JXL inputs nothing knows the count of yet walk their frame headers once (on a decoder of its own)
+    int frameCount();
+    // JXL frame count known from elsewhere, eg. a project's probe record
+    void setFrameCountHint(int count);
+    // bits per color sample, without decoding pixels
+    int bitDepth() const;
+    bool hasAlpha() const;
     bool haveAnimation() const;
     bool canRead() const;
     QString errorString() const;
@@ -1,10 +1,18 @@
 #include "jxlencoderobject.h"
 #include "jxldecoderobject.h"
+#include "chunkedimageframe.h"
+#include "framediff.h"
+#include "framepipeline.h"
+#include "inputprobe.h"
+#include "jpegprobe.h"
+#include "workpool.h"
 
 #include <QColorSpace>
 #include <QElapsedTimer>
+#include <QEventLoop>
 #include <QFileInfo>
 #include <QImageReader>
+#include <QThreadPool>
 
 #include <jxl/color_encoding.h>
 #include <jxl/encode_cxx.h>
@@ -12,9 +20,31 @@
 
 #define USE_STREAMING_OUTPUT // need libjxl >= 0.10.0
 
-// let's disable temp file for now (set to never trigger max raw frame size)
-#define TEMP_FILE_DIR "./tempframe.bin"
-#define MAX_DECODED_BEFORE_TEMPFILE SIZE_MAX
+namespace
+{
+// prepared frame held back before submission, so identical follow-up frames can extend its duration
+struct PendingFrame {
+    bool valid{false};
+    bool isImageAnim{false};
+    int inputIndex{0};
+    int subframeIndex{0};
+    int imageCount{1};
+    qint64 decodeNs{0};
+    size_t contentHash{0};
+
+    QPoint anchor{};
+    QImage source{}; // uncropped frame this one displays, only kept for auto crop
+    QImage image{}; // converted frame, encoded in place when pixels is empty
+    QRect roi{}; // area of image encoded as this frame
+    QByteArray pixels{};
+    QSharedPointer<FrameSpillFile> spill{};
+    QSharedPointer<StreamedImageSource> stream{};
+    QByteArray jpegData{}; // recompressed as is instead of encoded from pixels
+    QSize frameSize{};
+    QString frameName{};
+    JxlFrameHeader header{};
+};
+} // namespace
 
 class Q_DECL_HIDDEN JXLEncoderObject::Private
 {
@@ -24,6 +54,8 @@ public:
     bool abortCompleteFile{true};
     bool isUnsavedChanges{false};
     bool isAborted{false};
+    bool encodeToMemory{false};
+    bool encodeSucceeded{false};
 
     int rootWidth{0};
     int rootHeight{0};
@@ -31,9 +63,13 @@ public:
     QByteArray rootICC{};
 
     QImage prevFrame;
+    QByteArray encodedData;
 
     QElapsedTimer elt;
     quint64 totalFramesProcessed{0};
+    quint64 totalFramesMerged{0};
+    quint64 totalFramesDeduped{0};
+    quint64 totalBytesDeduped{0};
     double totalAccumulatedMpps{0.0};
     double totalAccumulatedDecMpps{0.0};
 
@@ -42,7 +78,8 @@ public:
 
     QObject *parent{nullptr};
     JxlEncoderPtr enc;
-    JxlResizableParallelRunnerPtr runner;
+    // cap on the shared pool, read on every runner call
+    jxfrstch::RunnerLimit runnerLimit;
 };
 
 JXLEncoderObject::JXLEncoderObject(QObject *parent)
@@ -65,6 +102,36 @@ void JXLEncoderObject::abortEncode(bool completeFile)
     mutex.unlock();
 }
 
+void JXLEncoderObject::setEncodeToMemory(bool enabled)
+{
+    d->encodeToMemory = enabled;
+}
+
+QByteArray JXLEncoderObject::takeEncodedData()
+{
+    return std::exchange(d->encodedData, QByteArray());
+}
+
+void JXLEncoderObject::setThreadBudget(int threads)
+{
+    // takes effect from the next runner call, even mid-frame, 0 = back to the params' thread count
+    d->runnerLimit.maxThreads.storeRelaxed(threads > 0 ? threads : d->params.encodeThreads);
+}
+
+int JXLEncoderObject::suggestedThreads() const
+{
+    if (d->params.encodeThreads > 0) {
+        return d->params.encodeThreads;
+    }
+    return static_cast<int>(JxlResizableParallelRunnerSuggestThreads(static_cast<uint64_t>(d->rootSize.width()),
+                                                                      static_cast<uint64_t>(d->rootSize.height())));
+}
+
+bool JXLEncoderObject::encodeSucceeded() const
+{
+    return d->encodeSucceeded;
+}
+
 bool JXLEncoderObject::resetEncoder()
 {
     d->isAborted = false;
@@ -72,12 +139,15 @@ bool JXLEncoderObject::resetEncoder()
     d->abortCompleteFile = true;
     d->idat.clear();
     d->totalFramesProcessed = 0;
+    d->totalFramesMerged = 0;
+    d->totalFramesDeduped = 0;
+    d->totalBytesDeduped = 0;
     d->totalAccumulatedMpps = 0.0;
     d->totalAccumulatedDecMpps = 0.0;
     d->prevFrame = QImage();
     d->elt.invalidate();
 
-    if (!d->enc || !d->runner) {
+    if (!d->enc) {
         return false;
     }
     JxlEncoderReset(d->enc.get());
@@ -87,6 +157,11 @@ bool JXLEncoderObject::resetEncoder()
 
 bool JXLEncoderObject::cleanupEncoder()
 {
+#ifdef USE_STREAMING_OUTPUT
+    // streamed output only replaces the target once it's complete, failed encodes leave nothing behind
+    // (and removing here would delete a file that was never overwritten)
+    return true;
+#else
     QFileInfo fi(d->params.outputFileName);
     if (!fi.exists()) {
         return true;
@@ -95,11 +170,14 @@ bool JXLEncoderObject::cleanupEncoder()
         return QFile::remove(fi.absoluteFilePath());
     }
     return true;
+#endif
 }
 
 void JXLEncoderObject::setEncodeParams(const jxfrstch::EncodeParams &params)
 {
     d->params = params;
+    // each runner call is sized from its own task count, only an explicit thread count caps it
+    d->runnerLimit.maxThreads.storeRelaxed(params.encodeThreads);
 }
 
 void JXLEncoderObject::appendInputFiles(const jxfrstch::InputFileData &ifd)
@@ -113,34 +191,39 @@ bool JXLEncoderObject::canEncode()
         return false;
     }
 
-    emit sigStatusText("Parsing first image information...");
+    emit sigStatusText("Probing inputs...");
     QCoreApplication::processEvents();
 
-    QFileInfo fst(d->idat.first().filename);
-
-    if (fst.suffix().toLower() != "jxl") {
-        QImage firstLayer(d->idat.first().filename);
-        if (firstLayer.isNull()) {
-            emit sigStatusText("Error: failed to load first image!");
-            return false;
-        }
+    // headers only, all inputs at once, the event loop keeps running meanwhile
+    QVector<jxfrstch::ProbeIssue> issues;
+    {
+        QEventLoop loop;
+        QThreadPool::globalInstance()->start([&]() {
+            jxfrstch::refreshProbes(d->idat, d->params);
+            issues = jxfrstch::checkInputs(d->idat, d->params);
+            QMetaObject::invokeMethod(&loop, &QEventLoop::quit, Qt::QueuedConnection);
+        });
+        loop.exec();
+    }
 
-        QSize layerSize = firstLayer.size();
-        if (!layerSize.isValid()) {
-            emit sigStatusText("Error: failed to read first layer size!");
-            return false;
-        }
-        d->rootSize = layerSize;
-        d->rootICC = firstLayer.colorSpace().iccProfile();
-    } else {
-        JXLDecoderObject cdec(fst.absoluteFilePath());
-        if (!cdec.canRead()) {
-            return false;
+    QVector<jxfrstch::ProbeIssue> errors;
+    for (const auto &issue : std::as_const(issues)) {
+        if (issue.fatal) {
+            errors.append(issue);
+        } else {
+            emit sigStatusText(QString("Warning: %1").arg(issue.message));
         }
-        d->rootSize = cdec.getRootFrameSize();
-        d->rootICC = cdec.getIccProfie();
+    }
+    if (!errors.isEmpty()) {
+        emit sigThrowError(QString("Some inputs can't be encoded:\n%1").arg(jxfrstch::formatIssues(errors)));
+        emit sigStatusText("Error: some inputs can't be encoded!");
+        return false;
     }
 
+    const jxfrstch::InputProbe &probe = d->idat.first().probe;
+    d->rootSize = probe.size;
+    d->rootICC = probe.icc;
+
     if (!d->enc) {
         d->enc = JxlEncoderMake(nullptr);
         if (!d->enc) {
@@ -149,20 +232,12 @@ bool JXLEncoderObject::canEncode()
         }
     }
 
-    if (!d->runner) {
-        d->runner = JxlResizableParallelRunnerMake(nullptr);
-        if (!d->runner) {
-            emit sigStatusText("Error: failed to initialize runner!");
-            return false;
-        }
-    }
-
     return true;
 }
 
 void JXLEncoderObject::run()
 {
-    doEncode();
+    d->encodeSucceeded = doEncode();
     cleanupEncoder();
     resetEncoder();
 }
@@ -178,24 +253,20 @@ bool JXLEncoderObject::doEncode()
 
 #ifdef USE_STREAMING_OUTPUT
     jxfrstch::JxlOutputProcessor outProcessor;
-    if (!outProcessor.SetOutputPath(d->params.outputFileName)) {
-        emit sigThrowError("Failed to create output file!");
+    d->encodedData.clear();
+    if (d->encodeToMemory ? !outProcessor.SetOutputBuffer() : !outProcessor.SetOutputPath(d->params.outputFileName)) {
+        emit sigThrowError(QString("Failed to create output file! %1").arg(outProcessor.ErrorString()));
         d->isAborted = true;
         return false;
     }
 #endif
 
-    if (JXL_ENC_SUCCESS != JxlEncoderSetParallelRunner(d->enc.get(), JxlResizableParallelRunner, d->runner.get())) {
+    if (JXL_ENC_SUCCESS != JxlEncoderSetParallelRunner(d->enc.get(), jxfrstch::parallelRunner, &d->runnerLimit)) {
         emit sigThrowError("JxlEncoderSetParallelRunner failed!");
         d->isAborted = true;
         return false;
     }
 
-    JxlResizableParallelRunnerSetThreads(
-        d->runner.get(),
-        JxlResizableParallelRunnerSuggestThreads(static_cast<uint64_t>(d->rootSize.width()),
-                                                 static_cast<uint64_t>(d->rootSize.height())));
-
 #ifdef USE_STREAMING_OUTPUT
     if (JXL_ENC_SUCCESS != JxlEncoderSetOutputProcessor(d->enc.get(), outProcessor.GetOutputProcessor())) {
         emit sigThrowError("JxlEncoderSetOutputProcessor failed!");
@@ -403,502 +474,533 @@ bool JXLEncoderObject::doEncode()
         }
     }
 
-    auto frameHeader = std::make_unique<JxlFrameHeader>();
-
     const int framenum = d->idat.size();
-    JXLDecoderObject reader;
-    reader.resetJxlDecoder();
-    reader.setEncodeParams(d->params);
+    const size_t byteSize = jxfrstch::bytesPerChannel(d->params.bitDepth);
 
-    bool acResetFrame = true;
-    for (int i = 0; i < framenum; i++) {
-        if (d->encodeAbort && !d->abortCompleteFile) {
-            emit sigCurrentMainProgressBar(i, true);
-            emit sigEnableSubProgressBar(false, 0);
-            emit sigStatusText("Encode aborted!");
-            d->isAborted = true;
-            return false;
+    const auto outputSizeText = [&]() {
+#ifdef USE_STREAMING_OUTPUT
+        if (outProcessor.finalized_position > (1024 * 1024 * 10)) {
+            return QString("%1 MiB").arg(static_cast<double>(outProcessor.finalized_position) / 1024.0 / 1024.0);
         }
+        return QString("%1 KiB").arg(static_cast<double>(outProcessor.finalized_position) / 1024.0);
+#else
+        return QString("0 KiB");
+#endif
+    };
 
-        const jxfrstch::InputFileData ind = d->idat.at(i);
-        emit sigCurrentMainProgressBar(i, false);
+    const auto totalSpeedText = [&]() {
+        return QString("%1 frame(s) processed, %2 merged (%3 by content hash, %4 MiB not re-encoded) | Dec: %5 MP/s "
+                       "| Enc: %6 MP/s")
+            .arg(QString::number(d->totalFramesProcessed),
+                 QString::number(d->totalFramesMerged),
+                 QString::number(d->totalFramesDeduped),
+                 QString::number(static_cast<double>(d->totalBytesDeduped) / 1024.0 / 1024.0, 'g', 4),
+                 QString::number(d->totalAccumulatedDecMpps / static_cast<double>(d->totalFramesProcessed), 'g', 4),
+                 QString::number(d->totalAccumulatedMpps / static_cast<double>(d->totalFramesProcessed), 'g', 4));
+    };
 
-        // QImageReader reader(ind.filename);
-        reader.setFileName(ind.filename);
+    // hand a prepared frame to libjxl, returns false if encoding has to stop here
+    const auto submitFrame = [&](PendingFrame &pf, bool isLastFrame) {
+        QElapsedTimer encodeTimer;
+        encodeTimer.start();
 
-        int imageframenum = 0;
-        // const bool isImageAnim = reader.imageCount() > 1 && reader.supportsAnimation();
-        const bool isImageAnim = reader.haveAnimation();
-        if (isImageAnim || reader.imageCount() > 1) {
-            emit sigEnableSubProgressBar(true, reader.imageCount());
+        if (JxlEncoderSetFrameHeader(frameSettings, &pf.header) != JXL_ENC_SUCCESS) {
+            emit sigThrowError("JxlEncoderSetFrameHeader failed!");
+            d->isAborted = true;
+            return false;
         }
 
-        while (reader.canRead()) {
-            int frameXPos = 0;
-            int frameYPos = 0;
-            if (i > 0) {
-                frameXPos = ind.frameXPos;
-                frameYPos = ind.frameYPos;
+        if (!pf.frameName.isEmpty() && pf.frameName.toUtf8().size() <= 1071) {
+            if (JxlEncoderSetFrameName(frameSettings, pf.frameName.toUtf8()) != JXL_ENC_SUCCESS) {
+                emit sigThrowError("JxlEncoderSetFrameName failed!");
+                d->isAborted = true;
+                return false;
             }
+            // in case warning is needed
+            // } else if (ind.frameName.toUtf8().size() > 1071) {
+            //     QMessageBox::warning(this,
+            //                          "Warning",
+            //                          QString("Cannot write name for frame %1, name exceeds 1071 bytes
+            //                          limit!\n(Current: %2 bytes)")
+            //                              .arg(QString::number(i + 1),
+            //                              QString::number(ind.frameName.toUtf8().size())));
+        }
 
-            QByteArray imagerawdata;
-            bool needCrop = false;
-            bool isMassive = false;
-            bool isCropEnabled = false;
-            QSize frameSize;
-            size_t frameResolution;
-            d->elt.start();
-            // QImage cFrame;
-            const size_t byteSize = [&]() {
-                switch (d->params.bitDepth) {
-                case ENC_BIT_8:
-                    return 1;
-                    break;
-                case ENC_BIT_16:
-                case ENC_BIT_16F:
-                    return 2;
-                    break;
-                case ENC_BIT_32F:
-                    return 4;
-                default:
-                    return 1;
-                    break;
-                }
-            }();
-            {
-                QImage currentFrame(reader.read());
-                QRect currentFrameRect = reader.currentImageRect();
-                if (!currentFrameRect.isValid()) {
-                    currentFrameRect = currentFrame.rect();
-                }
+        if (pf.spill && !pf.spill->map() && !d->params.chunkedFrame) {
+            // can't map it, and non-chunked input has to be in memory anyway
+            pf.spill->file()->seek(0);
+            pf.pixels = pf.spill->file()->readAll();
+            pf.spill.reset();
+        }
 
-                if (currentFrame.isNull()) {
-                    emit sigThrowError(reader.errorString());
-                    d->isAborted = true;
+        if (!pf.jpegData.isEmpty()) {
+            // reconstruction data only makes sense when the output is that one JPEG, and APP2 ICC markers are
+            // rebuilt from the codestream profile, so that has to be the JPEG's own bytes (or none, with sRGB)
+            const bool storeMetadata = framenum == 1 && !d->params.animation && d->totalFramesProcessed == 0 && [&]() {
+                jxfrstch::JpegProbe probe;
+                if (!jxfrstch::probeJpeg(pf.jpegData, probe)) {
                     return false;
                 }
-
-                const size_t uncropSize =
-                    static_cast<size_t>(currentFrame.width()) * static_cast<size_t>(currentFrame.height());
-
-                if ((d->params.autoCropFrame && !d->params.onlyCropAnimatedFile)
-                    || (isImageAnim && d->params.onlyCropAnimatedFile && d->params.autoCropFrame)
-                        && uncropSize < 50'000'000) {
-                    isCropEnabled = true;
-                    if ((isImageAnim && imageframenum == 0) || (!isImageAnim && i == 0)) {
-                        acResetFrame = true;
-                        d->prevFrame = currentFrame;
-                    } else {
-                        /* In short:
-                         * Compare 2 QImages and get a QRect where they have differences
-                         */
-                        QRect cropRect;
-                        if (d->prevFrame.size() == currentFrame.size()
-                            && d->prevFrame.sizeInBytes() == currentFrame.sizeInBytes()) {
-                            QPoint topLeft(currentFrameRect.bottomRight());
-                            QPoint bottomRight(0, 0);
-
-                            for (int h = 0; h < currentFrame.height(); h++) {
-                                for (int w = 0; w < currentFrame.width(); w++) {
-                                    const QPoint cpos(w, h);
-                                    const QColor currentPix = currentFrame.pixelColor(cpos);
-                                    const QColor prevPix = d->prevFrame.pixelColor(cpos);
-                                    const float fuzzycomparison = d->params.autoCropFuzzyComparison;
-                                    const bool fuzzy = [&]() {
-                                        if (fuzzycomparison > 0.0) {
-                                            if (qAbs(currentPix.redF() - prevPix.redF()) > fuzzycomparison)
-                                                return true;
-                                            if (qAbs(currentPix.greenF() - prevPix.greenF()) > fuzzycomparison)
-                                                return true;
-                                            if (qAbs(currentPix.blueF() - prevPix.blueF()) > fuzzycomparison)
-                                                return true;
-                                            if (qAbs(currentPix.alphaF() - prevPix.alphaF()) > fuzzycomparison)
-                                                return true;
-                                            return false;
-                                        } else {
-                                            return currentPix != prevPix;
-                                        }
-                                    }();
-
-                                    if (fuzzy) {
-                                        topLeft.setX(qMin(w, topLeft.x()));
-                                        topLeft.setY(qMin(h, topLeft.y()));
-                                        bottomRight.setX(qMax(w, bottomRight.x()));
-                                        bottomRight.setY(qMax(h, bottomRight.y()));
-                                    }
-                                }
-                            }
-
-                            if ((topLeft.x() >= currentFrame.width() - 1 || topLeft.y() >= currentFrame.height() - 1)
-                                || (bottomRight.x() < 1 || bottomRight.y() < 1)) {
-                                cropRect = QRect(0, 0, 1, 1);
-                            } else {
-                                cropRect = QRect(topLeft.x(),
-                                                 topLeft.y(),
-                                                 bottomRight.x() - topLeft.x() + 1,
-                                                 bottomRight.y() - topLeft.y() + 1);
-                            }
-
-                            if (cropRect != QRect(0, 0, currentFrame.width(), currentFrame.height())) {
-                                acResetFrame = false;
-                                if (cropRect != QRect(0, 0, 1, 1)) {
-                                    currentFrame = currentFrame.copy(cropRect);
-                                } else {
-                                    /* Fill with single, offscreen transparent pixel if no movement is detected
-                                     * Ideally this frame should be skipped and the frame before should be set
-                                     * with the correct tick (1+n of skipped frames)
-                                     */
-                                    currentFrame = QImage(1, 1, currentFrame.format());
-                                    currentFrame.fill(Qt::transparent);
-                                    topLeft = QPoint(-1, -1);
-                                }
-                                const QPoint absTopLeft = currentFrameRect.topLeft() + topLeft;
-                                currentFrameRect = currentFrame.rect();
-                                currentFrameRect.moveTopLeft(absTopLeft);
-                            } else {
-                                acResetFrame = true;
-                                d->prevFrame = currentFrame;
-                            }
-                        } else {
-                            acResetFrame = true;
-                            d->prevFrame = currentFrame;
-                        }
-                    }
+                if (d->params.colorSpace == ENC_CS_INHERIT_FIRST && !d->rootICC.isEmpty()) {
+                    return probe.icc == d->rootICC;
                 }
-
-                if ((currentFrame.width() != d->rootSize.width() || currentFrame.height() != d->rootSize.height())
-                    || ((frameXPos != 0 || frameYPos != 0) && i > 0)) {
-                    needCrop = true;
+                return probe.icc.isEmpty()
+                    && (d->params.colorSpace == ENC_CS_SRGB || d->params.colorSpace == ENC_CS_INHERIT_FIRST
+                        || d->params.colorSpace == ENC_CS_RAW);
+            }();
+            if (storeMetadata && JxlEncoderStoreJPEGMetadata(d->enc.get(), JXL_TRUE) != JXL_ENC_SUCCESS) {
+                emit sigThrowError("JxlEncoderStoreJPEGMetadata failed!");
+                d->isAborted = true;
+                return false;
+            }
+            if (JxlEncoderAddJPEGFrame(frameSettings,
+                                       reinterpret_cast<const uint8_t *>(pf.jpegData.constData()),
+                                       static_cast<size_t>(pf.jpegData.size()))
+                != JXL_ENC_SUCCESS) {
+                emit sigThrowError("JxlEncoderAddJPEGFrame failed! (libjxl built without JPEG transcoding?)");
+                d->isAborted = true;
+                return false;
+            }
+        } else if (!d->params.chunkedFrame) {
+            // unpacked frames are always full RGBA images here, identical to the interleaved layout
+            const void *buf = [&]() -> const void * {
+                if (pf.spill) {
+                    return pf.spill->map();
                 }
-                if (((currentFrameRect.x() != 0 || currentFrameRect.y() != 0) && imageframenum > 0) || !acResetFrame) {
-                    needCrop = true;
-                    // offset with set position
-                    frameXPos += currentFrameRect.x();
-                    frameYPos += currentFrameRect.y();
+                return pf.pixels.isEmpty() ? static_cast<const void *>(pf.image.constBits())
+                                           : static_cast<const void *>(pf.pixels.constData());
+            }();
+            const size_t bufSize = [&]() {
+                if (pf.spill) {
+                    return pf.spill->size();
                 }
-
-                switch (d->params.bitDepth) {
-                case ENC_BIT_8: // u8bpc
-                    currentFrame.convertTo(d->params.alpha ? QImage::Format_RGBA8888 : QImage::Format_RGBX8888);
-                    break;
-                case ENC_BIT_16: // u16bpc
-                    currentFrame.convertTo(d->params.alpha ? QImage::Format_RGBA64 : QImage::Format_RGBX64);
-                    break;
-                case ENC_BIT_16F: // f16bpc
-                    currentFrame.convertTo(d->params.alpha ? QImage::Format_RGBA16FPx4 : QImage::Format_RGBX16FPx4);
-                    break;
-                case ENC_BIT_32F: // f32bpc
-                    currentFrame.convertTo(d->params.alpha ? QImage::Format_RGBA32FPx4 : QImage::Format_RGBX32FPx4);
-                    break;
-                default:
-                    emit sigThrowError("Unsupported bit depth!");
-                    d->isAborted = true;
-                    return false;
-                    break;
+                return pf.pixels.isEmpty() ? static_cast<size_t>(pf.image.sizeInBytes())
+                                           : static_cast<size_t>(pf.pixels.size());
+            }();
+            if (JxlEncoderAddImageFrame(frameSettings, &pixelFormat, buf, bufSize) != JXL_ENC_SUCCESS) {
+                emit sigThrowError("JxlEncoderAddImageFrame failed!");
+                d->isAborted = true;
+                return false;
+            }
+        } else {
+            jxfrstch::ChunkedImageFrame ifrm(pixelFormat, byteSize, pf.frameSize);
+            // alpha with its own settings gets its own planar feed, otherwise it rides along interleaved
+            ifrm.setPlanarAlpha(d->params.alpha && d->params.losslessAlpha && d->params.distance > 0.0);
+            if (pf.stream) {
+                ifrm.inputData(pf.stream.data());
+            } else if (pf.spill) {
+                if (pf.spill->map()) {
+                    ifrm.inputData(pf.spill->map());
+                } else {
+                    ifrm.inputData(pf.spill->file());
                 }
+            } else if (pf.pixels.isEmpty()) {
+                ifrm.inputData(&pf.image, pf.roi);
+            } else {
+                ifrm.inputData(&pf.pixels);
+            }
 
-                if (d->params.colorSpace != ENC_CS_RAW) {
-                    // treat untagged as sRGB
-                    if (!currentFrame.colorSpace().isValid()) {
-                        currentFrame.setColorSpace(QColorSpace::SRgb);
-                    }
-                    switch (d->params.colorSpace) {
-                    case ENC_CS_SRGB:
-                        currentFrame.convertToColorSpace(QColorSpace::SRgb);
-                        break;
-                    case ENC_CS_SRGB_LINEAR:
-                        currentFrame.convertToColorSpace(QColorSpace::SRgbLinear);
-                        break;
-                    case ENC_CS_P3:
-                        currentFrame.convertToColorSpace(QColorSpace::DisplayP3);
-                        break;
-                    case ENC_CS_INHERIT_FIRST:
-                        if (!d->rootICC.isEmpty()) {
-                            currentFrame.convertToColorSpace(QColorSpace::fromIccProfile(d->rootICC));
-                        } else {
-                            currentFrame.convertToColorSpace(QColorSpace::SRgb);
-                        }
-                        break;
-                    default:
-                        break;
-                    }
+            if (JxlEncoderAddChunkedFrame(frameSettings, TO_JXL_BOOL(isLastFrame), ifrm.getChunkedStruct())
+                != JXL_ENC_SUCCESS) {
+                if (pf.stream && !pf.stream->errorString().isEmpty()) {
+                    emit sigThrowError(pf.stream->errorString());
+                } else {
+                    emit sigThrowError("JxlEncoderAddChunkedFrame failed!");
                 }
+                d->isAborted = true;
+                return false;
+            }
+        }
 
-                frameSize = currentFrame.size();
-                frameResolution = static_cast<size_t>(frameSize.width()) * static_cast<size_t>(frameSize.height());
-                // qDebug() << "pxsize" << frameResolution;
-
-                const size_t neededBytes = ((d->params.alpha) ? 4 : 3) * byteSize * frameResolution;
-                isMassive = (neededBytes > MAX_DECODED_BEFORE_TEMPFILE) && d->params.chunkedFrame;
-                // isMassive = true;
-                // qDebug() << "bytes" << neededBytes;
-                // imagerawdata.resize(neededBytes, 0x0);
-
-                QFile tempFrameFile(TEMP_FILE_DIR);
-                QDataStream ds = [&]() {
-                    if (isMassive) {
-                        emit sigStatusText("Input image too large, saving intermediate to disk...");
-                        // qDebug() << "tempfile path";
-                        tempFrameFile.open(QIODevice::WriteOnly);
-                        return QDataStream(&tempFrameFile);
-                    } else {
-                        // qDebug() << "memory path";
-                        return QDataStream(&imagerawdata, QIODevice::WriteOnly);
-                    }
-                }();
-
-                switch (d->params.bitDepth) {
-                case ENC_BIT_8:
-                    jxfrstch::QImageToBuffer<uint8_t>(currentFrame, ds, frameResolution, d->params.alpha);
-                    break;
-                case ENC_BIT_16:
-                    jxfrstch::QImageToBuffer<uint16_t>(currentFrame, ds, frameResolution, d->params.alpha);
-                    break;
-                case ENC_BIT_16F:
-                    jxfrstch::QImageToBuffer<qfloat16>(currentFrame, ds, frameResolution, d->params.alpha);
-                    break;
-                case ENC_BIT_32F:
-                    jxfrstch::QImageToBuffer<float>(currentFrame, ds, frameResolution, d->params.alpha);
-                    break;
-                default:
-                    break;
-                }
+        if (pf.isImageAnim || pf.imageCount > 1) {
+            emit sigStatusText(QString("Processing frame %1 of %2 (Subframe %3 of %4) | Output file size: %5")
+                                   .arg(QString::number(pf.inputIndex + 1),
+                                        QString::number(framenum),
+                                        QString::number(pf.subframeIndex + 1),
+                                        QString::number(pf.imageCount),
+                                        outputSizeText()));
+        } else {
+            emit sigStatusText(QString("Processing frame %1 of %2 | Output file size: %3")
+                                   .arg(QString::number(pf.inputIndex + 1), QString::number(framenum), outputSizeText()));
+        }
 
-                if (isMassive) {
-                    tempFrameFile.close();
-                }
+        d->totalFramesProcessed++;
 
-                // qDebug() << "Pixel allocated";
+        if (d->encodeAbort && d->abortCompleteFile) {
+            if (!d->params.chunkedFrame) {
+                JxlEncoderCloseInput(d->enc.get());
+                JxlEncoderFlushInput(d->enc.get());
             }
-
-            const uint32_t frameTick = [&]() {
-                // what the f-
-                if (!(isImageAnim || reader.imageCount() > 0)
-                    || !reader.canRead()) { // can't read == end of animation or just a single frame
-                    return ind.isPageEnd ? UINT32_MAX : ind.frameDuration; // set the frame duration
-                } else if (reader.nextImageDelay() == 0 || !d->params.animation) {
-                    return static_cast<uint32_t>(0);
-                } else {
-                    return static_cast<uint32_t>(
-                        qRound(qMax(static_cast<float>(reader.nextImageDelay()) / d->params.frameTimeMs, 1.0)));
-                }
-            }();
-
-            JxlEncoderInitFrameHeader(frameHeader.get());
-            frameHeader->duration = frameTick;
-            frameHeader->layer_info.save_as_reference = static_cast<uint32_t>(ind.isRefFrame);
-            frameHeader->layer_info.blend_info.blendmode = ind.blendMode;
-            if (d->params.alpha) {
-                frameHeader->layer_info.blend_info.alpha = 0;
+            emit sigCurrentMainProgressBar(pf.inputIndex + 1, true);
+            emit sigEnableSubProgressBar(false, 0);
+#ifdef USE_STREAMING_OUTPUT
+            if (!outProcessor.CloseOutputFile()) {
+                emit sigThrowError(QString("Failed to write output file! %1").arg(outProcessor.ErrorString()));
+                d->isAborted = true;
+                return false;
             }
-            frameHeader->layer_info.blend_info.source = static_cast<uint32_t>(ind.frameReference);
-            if (needCrop) {
-                frameHeader->layer_info.have_crop = JXL_TRUE;
-                frameHeader->layer_info.crop_x0 = static_cast<int32_t>(frameXPos);
-                frameHeader->layer_info.crop_y0 = static_cast<int32_t>(frameYPos);
-                frameHeader->layer_info.xsize = static_cast<uint32_t>(frameSize.width());
-                frameHeader->layer_info.ysize = static_cast<uint32_t>(frameSize.height());
+            d->encodedData = outProcessor.TakeBuffer();
+            emit sigStatusText(
+                QString("Encode aborted! Outputting partial image | Final output file size: %1").arg(outputSizeText()));
+            emit sigSpeedStats(totalSpeedText());
+#else
+            emit sigStatusText("Encode aborted!");
+#endif
+            d->isAborted = true;
+            return false;
+        }
+
+        if (isLastFrame) {
+            // JPEG frames don't carry the last frame flag chunked frames do
+            if (!d->params.chunkedFrame || !pf.jpegData.isEmpty()) {
+                JxlEncoderCloseInput(d->enc.get());
             }
-            QString frameName(ind.frameName);
-            if (reader.isJxl()) {
-                const JxlFrameHeader hd = reader.getJxlFrameHeader();
-                frameHeader->layer_info.blend_info = hd.layer_info.blend_info;
-                frameHeader->layer_info.save_as_reference = hd.layer_info.save_as_reference;
-                if (!reader.getFrameName().isEmpty()) {
-                    if (frameName.isEmpty()) {
-                        frameName += reader.getFrameName();
-                    } else {
-                        frameName += " - " + reader.getFrameName();
-                    }
-                    if (frameName.toUtf8().size() > 1071) {
-                        frameName.truncate(1071);
-                    }
-                }
+        }
+#ifdef USE_STREAMING_OUTPUT
+        if (!d->params.chunkedFrame) {
+            JxlEncoderFlushInput(d->enc.get());
+        }
+#endif
+        const size_t frameResolution =
+            static_cast<size_t>(pf.frameSize.width()) * static_cast<size_t>(pf.frameSize.height());
+        const double decNstoSec = static_cast<double>(pf.decodeNs) / 1.0e9;
+        const double encNstoSec = static_cast<double>(encodeTimer.nsecsElapsed()) / 1.0e9;
+
+        const double decmpps = [&]() {
+            if (decNstoSec > 0) {
+                return static_cast<double>((static_cast<double>(frameResolution) / 1000000.0) / decNstoSec);
+            } else {
+                return 0.0;
             }
+        }();
 
-            if (isCropEnabled) {
-                if (acResetFrame) {
-                    frameHeader->layer_info.save_as_reference = 1;
-                }
-                if (needCrop && !acResetFrame) {
-                    frameHeader->layer_info.blend_info.blendmode = JXL_BLEND_BLEND;
-                    frameHeader->layer_info.blend_info.source = 1;
-                }
+        const double mpps = [&]() {
+            if (encNstoSec > 0) {
+                return static_cast<double>((static_cast<double>(frameResolution) / 1000000.0) / encNstoSec);
+            } else {
+                return 0.0;
             }
+        }();
+
+        d->totalAccumulatedMpps += mpps;
+        d->totalAccumulatedDecMpps += decmpps;
+
+        emit sigSpeedStats(QString("Dec: %1 MP/s | Enc: %2 MP/s")
+                               .arg(QString::number(decmpps, 'g', 4), QString::number(mpps, 'g', 4)));
+
+        pf = PendingFrame();
+        return true;
+    };
+
+    FramePipeline pipeline;
+    // only non-chunked RGB needs a repacked buffer, everything else is read straight from the converted image
+    pipeline.setPackFrames(!d->params.chunkedFrame && !d->params.alpha);
+    // lossless JPEG recompression keeps the JPEG's own 8 bit samples, nothing cropped, noised or with alpha
+    if (d->params.distance == 0.0 && d->params.bitDepth == ENC_BIT_8 && !d->params.alpha && !d->params.autoCropFrame
+        && d->params.photonNoise == 0.0) {
+        pipeline.setJpegRecompression(d->rootSize);
+    }
+    pipeline.start(d->idat, d->params, d->rootICC);
 
-            if (JxlEncoderSetFrameHeader(frameSettings, frameHeader.get()) != JXL_ENC_SUCCESS) {
-                emit sigThrowError("JxlEncoderSetFrameHeader failed!");
+    bool acResetFrame = true;
+    int currentInput = -1;
+    int subProgressMax = 0;
+    PendingFrame held;
+    jxfrstch::PipelineFrame frm;
+    while (pipeline.next(frm)) {
+        const int i = frm.inputIndex;
+        const jxfrstch::InputFileData ind = d->idat.at(i);
+
+        if (i != currentInput) {
+            if (d->encodeAbort && !d->abortCompleteFile) {
+                emit sigCurrentMainProgressBar(i, true);
+                emit sigEnableSubProgressBar(false, 0);
+                emit sigStatusText("Encode aborted!");
                 d->isAborted = true;
                 return false;
             }
 
-            if (!frameName.isEmpty() && frameName.toUtf8().size() <= 1071) {
-                if (JxlEncoderSetFrameName(frameSettings, frameName.toUtf8()) != JXL_ENC_SUCCESS) {
-                    emit sigThrowError("JxlEncoderSetFrameName failed!");
-                    d->isAborted = true;
-                    return false;
-                }
-                // in case warning is needed
-                // } else if (ind.frameName.toUtf8().size() > 1071) {
-                //     QMessageBox::warning(this,
-                //                          "Warning",
-                //                          QString("Cannot write name for frame %1, name exceeds 1071 bytes
-                //                          limit!\n(Current: %2 bytes)")
-                //                              .arg(QString::number(i + 1),
-                //                              QString::number(ind.frameName.toUtf8().size())));
+            currentInput = i;
+            emit sigCurrentMainProgressBar(i, false);
+            if (frm.isImageAnim || frm.imageCount > 1) {
+                emit sigEnableSubProgressBar(true, frm.imageCount);
+                subProgressMax = frm.imageCount;
             }
+        } else if ((frm.isImageAnim || frm.imageCount > 1) && frm.imageCount != subProgressMax) {
+            // JXL inputs without a known frame index only find out their frame count while decoding
+            emit sigEnableSubProgressBar(true, frm.imageCount);
+            subProgressMax = frm.imageCount;
+        }
+
+        if (frm.decodeError) {
+            emit sigThrowError(frm.errorString);
+            d->isAborted = true;
+            return false;
+        }
 
-            const qint64 decodeNs = d->elt.nsecsElapsed();
+        const bool isImageAnim = frm.isImageAnim;
+        const int imageframenum = frm.subframeIndex;
+        const bool isLastFrame = (i == framenum - 1 && frm.isLastSubframe);
+        const bool isCropEnabled = frm.autoCrop;
+        const bool isFirstCropFrame = (isImageAnim && imageframenum == 0) || (!isImageAnim && i == 0);
+        const uint32_t frameTick = frm.frameTick;
+
+        int frameXPos = 0;
+        int frameYPos = 0;
+        if (i > 0) {
+            frameXPos = ind.frameXPos;
+            frameYPos = ind.frameYPos;
+        }
+        const QPoint anchor = QPoint(frameXPos, frameYPos) + frm.imageRect.topLeft();
+
+        d->elt.start();
+        QImage currentFrame = std::move(frm.image);
+        QRect currentFrameRect = frm.imageRect;
+        QRect frameRoi = currentFrame.rect();
+        const QImage sourceFrame = currentFrame;
+
+        /* Frame looks the same as the one still waiting to be submitted,
+         * extend that one instead of emitting another frame
+         */
+        const bool canExtendHeld = held.valid && held.anchor == anchor && held.header.duration > 0
+            && held.header.duration != UINT32_MAX && frameTick > 0 && frameTick < UINT32_MAX - held.header.duration
+            && ind.isRefFrame == 0 && (!frm.isJxl || frm.jxlHeader.layer_info.save_as_reference == 0);
+        const bool croppedRepeat = canExtendHeld && isCropEnabled && !isFirstCropFrame && !held.source.isNull()
+            && jxfrstch::diffBoundingRect(currentFrame, held.source, d->params.autoCropFuzzyComparison).isNull();
+        const bool hashedRepeat = canExtendHeld && !croppedRepeat && frm.contentHash != 0
+            && frm.contentHash == held.contentHash && frm.frameSize == held.frameSize && [&]() {
+                  /* drawn over the same background, and drawing it a second time must not change anything:
+                   * only REPLACE, or BLEND without alpha, where the frame covers whatever is below it
+                   * (ADD/MUL/MULADD over a slot the held frame saved into would stack up)
+                   */
+                  const JxlBlendInfo blend = frm.isJxl ? frm.jxlHeader.layer_info.blend_info : JxlBlendInfo{};
+                  const JxlBlendMode mode = frm.isJxl ? blend.blendmode : ind.blendMode;
+                  const uint32_t source = frm.isJxl ? blend.source : static_cast<uint32_t>(ind.frameReference);
+                  const bool covers = mode == JXL_BLEND_REPLACE || (mode == JXL_BLEND_BLEND && !d->params.alpha);
+                  if (!covers || mode != held.header.layer_info.blend_info.blendmode
+                      || source != held.header.layer_info.blend_info.source) {
+                      return false;
+                  }
+                  // hash collisions are unlikely, still only equal bytes are merged
+                  if (!frm.stream.isNull() || !held.stream.isNull() || !frm.jpegData.isEmpty() || !held.jpegData.isEmpty()) {
+                      return false;
+                  }
+                  if (frm.pixels.isEmpty() && held.pixels.isEmpty() && !currentFrame.isNull() && !held.image.isNull()) {
+                      return currentFrame == held.image;
+                  }
+                  // packed in RAM, spilled (mapped) or still an image, all compared in the packed layout
+                  const auto packedBytes = [&](const QByteArray &pixels,
+                                               FrameSpillFile *spill,
+                                               const QImage &image,
+                                               const QRect &roi) -> QByteArray {
+                      if (!pixels.isEmpty()) {
+                          return pixels;
+                      }
+                      if (spill) {
+                          const uchar *data = spill->map();
+                          return data ? QByteArray::fromRawData(reinterpret_cast<const char *>(data), spill->size())
+                                      : QByteArray();
+                      }
+                      QByteArray packed;
+                      if (!image.isNull()) {
+                          jxfrstch::packImageToBuffer(image, roi, packed, d->params.bitDepth, d->params.alpha);
+                      }
+                      return packed;
+                  };
+                  const QByteArray current = packedBytes(frm.pixels, frm.spill.data(), currentFrame, frameRoi);
+                  const QByteArray previous = packedBytes(held.pixels, held.spill.data(), held.image, held.roi);
+                  return !current.isEmpty() && current == previous;
+              }();
+        if (croppedRepeat || hashedRepeat) {
+            held.header.duration += frameTick;
+            held.decodeNs += frm.decodeNs + d->elt.nsecsElapsed();
+            d->totalFramesMerged++;
+            if (hashedRepeat) {
+                d->totalFramesDeduped++;
+                d->totalBytesDeduped += static_cast<quint64>(frm.frameSize.width()) * frm.frameSize.height()
+                    * (d->params.alpha ? 4 : 3) * byteSize;
+            }
 
-            if (!d->params.chunkedFrame) {
-                if (JxlEncoderAddImageFrame(frameSettings, &pixelFormat, imagerawdata.constData(), imagerawdata.size())
-                    != JXL_ENC_SUCCESS) {
-                    emit sigThrowError("JxlEncoderAddImageFrame failed!");
-                    d->isAborted = true;
+            if (isImageAnim || frm.imageCount > 1) {
+                emit sigCurrentSubProgressBar(imageframenum + 1);
+            }
+            // don't keep merging while an abort is waiting for the next submitted frame
+            if (isLastFrame || (d->encodeAbort && d->abortCompleteFile)) {
+                if (!submitFrame(held, isLastFrame)) {
                     return false;
                 }
+            }
+            if (frm.isLastSubframe) {
+                emit sigCurrentMainProgressBar(i + 1, true);
+                emit sigEnableSubProgressBar(false, 0);
+            }
+            continue;
+        }
+
+        PendingFrame next;
+        next.valid = true;
+        next.inputIndex = i;
+        next.subframeIndex = imageframenum;
+        next.imageCount = frm.imageCount;
+        next.isImageAnim = isImageAnim;
+        next.anchor = anchor;
+        next.pixels = std::move(frm.pixels);
+        next.spill = frm.spill;
+        next.stream = frm.stream;
+        next.jpegData = std::move(frm.jpegData);
+        next.frameSize = frm.frameSize;
+
+        bool needCrop = false;
+        if (isCropEnabled) {
+            next.source = sourceFrame;
+            if (isFirstCropFrame) {
+                acResetFrame = true;
+                d->prevFrame = currentFrame;
             } else {
-                jxfrstch::ChunkedImageFrame ifrm(pixelFormat, byteSize, frameSize);
-                QFile tmp(TEMP_FILE_DIR);
-                if (isMassive) {
-                    tmp.open(QIODevice::ReadOnly);
-                    ifrm.inputData(&tmp);
+                /* In short:
+                 * Compare 2 QImages and get a QRect where they have differences
+                 */
+                QRect cropRect;
+                if (d->prevFrame.size() == currentFrame.size()
+                    && d->prevFrame.sizeInBytes() == currentFrame.sizeInBytes()) {
+                    cropRect =
+                        jxfrstch::diffBoundingRect(currentFrame, d->prevFrame, d->params.autoCropFuzzyComparison);
+                    QPoint topLeft = cropRect.topLeft();
+
+                    if (cropRect != QRect(0, 0, currentFrame.width(), currentFrame.height())) {
+                        acResetFrame = false;
+                        if (!cropRect.isNull()) {
+                            // no copy, the encoder reads the crop straight from the frame
+                            frameRoi = cropRect;
+                        } else {
+                            /* Same as the reference frame but not as the previous frame,
+                             * fill with single, offscreen transparent pixel to show the reference again
+                             */
+                            currentFrame = QImage(1, 1, currentFrame.format());
+                            currentFrame.fill(Qt::transparent);
+                            frameRoi = currentFrame.rect();
+                            topLeft = QPoint(-1, -1);
+                        }
+                        const QPoint absTopLeft = currentFrameRect.topLeft() + topLeft;
+                        currentFrameRect = QRect(QPoint(0, 0), frameRoi.size());
+                        currentFrameRect.moveTopLeft(absTopLeft);
+                    } else {
+                        acResetFrame = true;
+                        d->prevFrame = currentFrame;
+                    }
                 } else {
-                    ifrm.inputData(&imagerawdata);
-                }
-
-                if (JxlEncoderAddChunkedFrame(frameSettings,
-                                              TO_JXL_BOOL(i == framenum - 1 && !reader.canRead()),
-                                              ifrm.getChunkedStruct())
-                    != JXL_ENC_SUCCESS) {
-                    emit sigThrowError("JxlEncoderAddChunkedFrame failed!");
-                    d->isAborted = true;
-                    return false;
-                }
-                if (isMassive) {
-                    tmp.close();
-                    tmp.remove();
+                    acResetFrame = true;
+                    d->prevFrame = currentFrame;
                 }
             }
+        }
 
-            bool isMb = false;
+        if (!currentFrame.isNull()) {
+            next.image = currentFrame;
+            next.roi = frameRoi;
+            next.frameSize = frameRoi.size();
+        }
+        const QSize frameSize = next.frameSize;
 
-            const double currentImageSizeKiB = [&]() {
-#ifdef USE_STREAMING_OUTPUT
-                if (outProcessor.finalized_position > (1024 * 1024 * 10)) {
-                    isMb = true;
-                    return static_cast<double>(outProcessor.finalized_position) / 1024.0 / 1024.0;
+        if ((frameSize.width() != d->rootSize.width() || frameSize.height() != d->rootSize.height())
+            || ((frameXPos != 0 || frameYPos != 0) && i > 0)) {
+            needCrop = true;
+        }
+        if (((currentFrameRect.x() != 0 || currentFrameRect.y() != 0) && imageframenum > 0) || !acResetFrame) {
+            needCrop = true;
+            // offset with set position
+            frameXPos += currentFrameRect.x();
+            frameYPos += currentFrameRect.y();
+        }
+
+        JxlFrameHeader *frameHeader = &next.header;
+        JxlEncoderInitFrameHeader(frameHeader);
+        frameHeader->duration = frameTick;
+        frameHeader->layer_info.save_as_reference = static_cast<uint32_t>(ind.isRefFrame);
+        frameHeader->layer_info.blend_info.blendmode = ind.blendMode;
+        if (d->params.alpha) {
+            frameHeader->layer_info.blend_info.alpha = 0;
+        }
+        frameHeader->layer_info.blend_info.source = static_cast<uint32_t>(ind.frameReference);
+        if (needCrop) {
+            frameHeader->layer_info.have_crop = JXL_TRUE;
+            frameHeader->layer_info.crop_x0 = static_cast<int32_t>(frameXPos);
+            frameHeader->layer_info.crop_y0 = static_cast<int32_t>(frameYPos);
+            frameHeader->layer_info.xsize = static_cast<uint32_t>(frameSize.width());
+            frameHeader->layer_info.ysize = static_cast<uint32_t>(frameSize.height());
+        }
+        next.frameName = ind.frameName;
+        if (frm.isJxl) {
+            const JxlFrameHeader hd = frm.jxlHeader;
+            frameHeader->layer_info.blend_info = hd.layer_info.blend_info;
+            frameHeader->layer_info.save_as_reference = hd.layer_info.save_as_reference;
+            if (!frm.jxlFrameName.isEmpty()) {
+                if (next.frameName.isEmpty()) {
+                    next.frameName += frm.jxlFrameName;
                 } else {
-                    isMb = false;
-                    return static_cast<double>(outProcessor.finalized_position) / 1024.0;
+                    next.frameName += " - " + frm.jxlFrameName;
                 }
-#else
-                return 0.0;
-#endif
-            }();
+                if (next.frameName.toUtf8().size() > 1071) {
+                    next.frameName.truncate(1071);
+                }
+            }
+        }
 
-            if (isImageAnim || reader.imageCount() > 1) {
-                emit sigStatusText(QString("Processing frame %1 of %2 (Subframe %3 of %4) | Output file size: %5 %6")
-                                       .arg(QString::number(i + 1),
-                                            QString::number(framenum),
-                                            QString::number(imageframenum + 1),
-                                            QString::number(reader.imageCount()),
-                                            QString::number(currentImageSizeKiB),
-                                            isMb ? "MiB" : "KiB"));
-                emit sigCurrentSubProgressBar(imageframenum + 1);
-            } else {
-                emit sigStatusText(QString("Processing frame %1 of %2 | Output file size: %3 %4")
-                                       .arg(QString::number(i + 1),
-                                            QString::number(framenum),
-                                            QString::number(currentImageSizeKiB),
-                                            isMb ? "MiB" : "KiB"));
+        if (isCropEnabled) {
+            if (acResetFrame) {
+                frameHeader->layer_info.save_as_reference = 1;
+            }
+            if (needCrop && !acResetFrame) {
+                frameHeader->layer_info.blend_info.blendmode = JXL_BLEND_BLEND;
+                frameHeader->layer_info.blend_info.source = 1;
             }
+        }
 
-            d->totalFramesProcessed++;
+        qint64 prepNs = d->elt.nsecsElapsed();
 
-            if (d->encodeAbort && d->abortCompleteFile) {
-                if (!d->params.chunkedFrame) {
-                    JxlEncoderCloseInput(d->enc.get());
-                    JxlEncoderFlushInput(d->enc.get());
-                }
-                const double finalAbortImageSizeKiB = [&]() {
-#ifdef USE_STREAMING_OUTPUT
-                    if (outProcessor.finalized_position > (1024 * 1024 * 10)) {
-                        isMb = true;
-                        return static_cast<double>(outProcessor.finalized_position) / 1024.0 / 1024.0;
-                    } else {
-                        isMb = false;
-                        return static_cast<double>(outProcessor.finalized_position) / 1024.0;
-                    }
-#else
-                    return 0.0;
-#endif
-                }();
-                emit sigCurrentMainProgressBar(i + 1, true);
-                emit sigEnableSubProgressBar(false, 0);
-#ifdef USE_STREAMING_OUTPUT
-                emit sigStatusText(QString("Encode aborted! Outputting partial image | Final output file size: %1 %2")
-                                       .arg(QString::number(finalAbortImageSizeKiB), isMb ? "MiB" : "KiB"));
-                emit sigSpeedStats(
-                    QString("%1 frame(s) processed | Dec: %2 MP/s | Enc: %3 MP/s")
-                        .arg(QString::number(d->totalFramesProcessed),
-                             QString::number(d->totalAccumulatedDecMpps / static_cast<double>(d->totalFramesProcessed),
-                                             'g',
-                                             4),
-                             QString::number(d->totalAccumulatedMpps / static_cast<double>(d->totalFramesProcessed),
-                                             'g',
-                                             4)));
-                d->isAborted = true;
-                return false;
-#else
-                emit sigStatusText("Encode aborted!");
-                d->isAborted = true;
+        // this frame differs, so the held one is final now
+        if (held.valid) {
+            if (!submitFrame(held, false)) {
                 return false;
-#endif
             }
+        }
 
-            if (i == framenum - 1 && !reader.canRead()) {
-                if (!d->params.chunkedFrame) {
-                    JxlEncoderCloseInput(d->enc.get());
-                }
-            }
-#ifdef USE_STREAMING_OUTPUT
-            if (!d->params.chunkedFrame) {
-                JxlEncoderFlushInput(d->enc.get());
-            }
-#endif
-            const qint64 encodeNs = d->elt.nsecsElapsed() - decodeNs;
-            const double decNstoSec = static_cast<double>(decodeNs) / 1.0e9;
-            const double encNstoSec = static_cast<double>(encodeNs) / 1.0e9;
-
-            const double decmpps = [&]() {
-                if (d->elt.isValid() && decNstoSec > 0) {
-                    const size_t frameres = frameResolution;
-                    return static_cast<double>((static_cast<double>(frameResolution) / 1000000.0) / decNstoSec);
-                } else {
-                    return 0.0;
-                }
-            }();
+        d->elt.restart();
+        // non-chunked input only takes contiguous buffers, so crops and RGB still get packed here
+        if (!next.image.isNull() && next.pixels.isEmpty() && !d->params.chunkedFrame
+            && !(d->params.alpha && next.roi == next.image.rect())) {
+            jxfrstch::packImageToBuffer(next.image, next.roi, next.pixels, d->params.bitDepth, d->params.alpha);
+            next.image = QImage();
+        }
+        prepNs += d->elt.nsecsElapsed();
 
-            const double mpps = [&]() {
-                if (d->elt.isValid() && encNstoSec > 0) {
-                    const size_t frameres = frameResolution;
-                    return static_cast<double>((static_cast<double>(frameResolution) / 1000000.0) / encNstoSec);
-                } else {
-                    return 0.0;
-                }
-            }();
+        // decode time is spent on the workers, plus whatever was left to do on this thread
+        next.decodeNs = frm.decodeNs + prepNs;
+        next.contentHash = frm.contentHash;
+        held = std::move(next);
 
-            d->totalAccumulatedMpps += mpps;
-            d->totalAccumulatedDecMpps += decmpps;
+        if (isImageAnim || frm.imageCount > 1) {
+            emit sigCurrentSubProgressBar(imageframenum + 1);
+        }
 
-            emit sigSpeedStats(QString("Dec: %1 MP/s | Enc: %2 MP/s")
-                                   .arg(QString::number(decmpps, 'g', 4), QString::number(mpps, 'g', 4)));
+        if (isLastFrame) {
+            if (!submitFrame(held, true)) {
+                return false;
+            }
+        }
 
-            imageframenum++;
+        if (frm.isLastSubframe) {
+            emit sigCurrentMainProgressBar(i + 1, true);
+            emit sigEnableSubProgressBar(false, 0);
+        }
+    }
+    pipeline.stop();
+
+    // last input didn't produce any frame, the held one closes the image instead
+    if (held.valid) {
+        if (!submitFrame(held, true)) {
+            return false;
         }
-        emit sigCurrentMainProgressBar(i + 1, true);
-        emit sigEnableSubProgressBar(false, 0);
     }
 
     d->elt.invalidate();
@@ -939,7 +1041,12 @@ bool JXLEncoderObject::doEncode()
 #endif
 
 #ifdef USE_STREAMING_OUTPUT
-    outProcessor.CloseOutputFile();
+    if (!outProcessor.CloseOutputFile()) {
+        emit sigThrowError(QString("Failed to write output file! %1").arg(outProcessor.ErrorString()));
+        d->isAborted = true;
+        return false;
+    }
+    d->encodedData = outProcessor.TakeBuffer();
 #endif
     bool isMb = false;
     const double finalImageSizeKiB = [&]() {
@@ -966,11 +1073,7 @@ bool JXLEncoderObject::doEncode()
 
     emit sigStatusText(QString("Encode successful | Final output file size: %1 %2")
                            .arg(QString::number(finalImageSizeKiB), isMb ? "MiB" : "KiB"));
-    emit sigSpeedStats(
-        QString("%1 frame(s) processed | Dec: %2 MP/s | Enc: %3 MP/s")
-            .arg(QString::number(d->totalFramesProcessed),
-                 QString::number(d->totalAccumulatedDecMpps / static_cast<double>(d->totalFramesProcessed), 'g', 4),
-                 QString::number(d->totalAccumulatedMpps / static_cast<double>(d->totalFramesProcessed), 'g', 4)));
+    emit sigSpeedStats(totalSpeedText());
     d->isAborted = false;
     return true;
 }
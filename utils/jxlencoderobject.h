@@ -23,6 +23,15 @@ public:
     bool resetEncoder();
     bool cleanupEncoder();
     void abortEncode(bool completeFile);
+    // encode into memory instead of params.outputFileName, collect the result with takeEncodedData()
+    void setEncodeToMemory(bool enabled);
+    QByteArray takeEncodedData();
+    // encoder thread cap on the shared pool, can change mid-encode (0 = from params)
+    void setThreadBudget(int threads);
+    // what the image wants on its own, valid after canEncode()
+    int suggestedThreads() const;
+    // result of the last run()
+    bool encodeSucceeded() const;
 
     bool doEncode();
 
@@ -0,0 +1,453 @@
+#include "outputwriter.h"
+
+#include <QDebug>
+#include <QFile>
+#include <QFileInfo>
+#include <QMutex>
+#include <QQueue>
+#include <QSaveFile>
+#include <QThread>
+#include <QWaitCondition>
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstdio>
+#include <limits>
+#include <memory>
+#include <new>
+#include <utility>
+
+#if defined(Q_OS_LINUX)
+#include <fcntl.h>
+#endif
+
+#if defined(Q_OS_WIN)
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+namespace
+{
+constexpr size_t BUFFER_BYTES = 8 * 1024 * 1024;
+constexpr int BUFFER_COUNT = 4;
+constexpr size_t BUFFER_ALIGN = 4096;
+// tail ends smaller than this aren't handed out, a fresh buffer is started instead
+constexpr size_t MIN_HANDOUT = 64 * 1024;
+// the file is preallocated in steps of at least this much
+constexpr qint64 PREALLOC_STEP = 64 * 1024 * 1024;
+
+struct AlignedDeleter {
+    void operator()(uchar *p) const
+    {
+        ::operator delete[](p, std::align_val_t(BUFFER_ALIGN));
+    }
+};
+
+struct WriteBuffer {
+    std::unique_ptr<uchar[], AlignedDeleter> data;
+    qint64 offset{0};
+    size_t fill{0};
+};
+
+enum class OutputMode {
+    Closed,
+    SaveFile, // temp file renamed on commit
+    Device, // stdout or FIFO, sequential
+    Memory
+};
+} // namespace
+
+class Q_DECL_HIDDEN OutputFileWriter::Private
+{
+public:
+    bool startIo();
+    void ioLoop();
+    void writeBuffer(const WriteBuffer &buf);
+    void submitCurrent();
+    void finish();
+    void reset();
+
+    QFileDevice *device()
+    {
+        return mode == OutputMode::SaveFile ? static_cast<QFileDevice *>(&saveFile) : &directFile;
+    }
+
+    OutputMode mode{OutputMode::Closed};
+    QSaveFile saveFile;
+    QFile directFile;
+    std::array<WriteBuffer, BUFFER_COUNT> buffers;
+    int current{-1};
+    qint64 position{0};
+
+    QByteArray memory;
+
+    // guarded by mutex
+    QMutex mutex;
+    QWaitCondition cond;
+    QQueue<int> freeBuffers;
+    QQueue<int> pending;
+    bool stopping{false};
+    QString errorString{};
+
+    // only touched by the I/O thread until it's joined (or by the encoder thread in memory mode)
+    qint64 endOffset{0};
+    qint64 allocated{0};
+
+    QScopedPointer<QThread> ioThread;
+};
+
+OutputFileWriter::OutputFileWriter()
+    : d(new Private)
+{
+}
+
+OutputFileWriter::~OutputFileWriter()
+{
+    discard();
+}
+
+bool OutputFileWriter::open(const QString &filename)
+{
+    discard();
+    d->reset();
+
+    if (filename == "-") {
+#if defined(Q_OS_WIN)
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+        // make sure nothing printed before ends up after the image
+        fflush(stdout);
+        if (!d->directFile.open(fileno(stdout), QIODevice::WriteOnly | QIODevice::Unbuffered, QFileDevice::DontCloseHandle)) {
+            d->errorString = QString("Cannot write to stdout: %1").arg(d->directFile.errorString());
+            return false;
+        }
+        d->mode = OutputMode::Device;
+        return d->startIo();
+    }
+
+    const QFileInfo fi(filename);
+    if (fi.exists() && !fi.isFile() && !fi.isDir()) {
+        // FIFO or device, a temp file can't be renamed over those
+        d->directFile.setFileName(filename);
+        if (!d->directFile.open(QIODevice::WriteOnly | QIODevice::Unbuffered)) {
+            d->errorString = QString("Cannot open %1: %2").arg(filename, d->directFile.errorString());
+            return false;
+        }
+        d->mode = OutputMode::Device;
+        return d->startIo();
+    }
+
+    d->saveFile.setFileName(filename);
+    if (!d->saveFile.open(QIODevice::WriteOnly | QIODevice::Unbuffered)) {
+        d->errorString = QString("Cannot create output file in %1: %2").arg(fi.absolutePath(), d->saveFile.errorString());
+        return false;
+    }
+    d->mode = OutputMode::SaveFile;
+    return d->startIo();
+}
+
+bool OutputFileWriter::openBuffer()
+{
+    discard();
+    d->reset();
+    d->mode = OutputMode::Memory;
+    return true;
+}
+
+bool OutputFileWriter::commit()
+{
+    if (!isOpen()) {
+        return false;
+    }
+
+    if (d->mode == OutputMode::Memory) {
+        d->memory.truncate(static_cast<qsizetype>(d->endOffset));
+        d->mode = OutputMode::Closed;
+        return true;
+    }
+
+    d->finish();
+    const OutputMode mode = d->mode;
+    d->mode = OutputMode::Closed;
+
+    if (mode == OutputMode::Device) {
+        d->directFile.close();
+        return d->errorString.isEmpty();
+    }
+
+    if (!d->errorString.isEmpty()) {
+        d->saveFile.cancelWriting();
+        d->saveFile.commit();
+        return false;
+    }
+    // drop whatever was preallocated past the last byte written
+    if (d->saveFile.size() != d->endOffset && !d->saveFile.resize(d->endOffset)) {
+        d->errorString = QString("Cannot truncate output file: %1").arg(d->saveFile.errorString());
+        d->saveFile.cancelWriting();
+        d->saveFile.commit();
+        return false;
+    }
+    if (!d->saveFile.commit()) {
+        d->errorString = QString("Cannot save output file: %1").arg(d->saveFile.errorString());
+        return false;
+    }
+    return true;
+}
+
+void OutputFileWriter::discard()
+{
+    if (!isOpen()) {
+        return;
+    }
+    // the I/O thread looks at the mode, so it's only changed once that's done
+    d->finish();
+    const OutputMode mode = d->mode;
+    d->mode = OutputMode::Closed;
+    switch (mode) {
+    case OutputMode::SaveFile:
+        // commit() after cancelWriting() removes the temp file right away
+        d->saveFile.cancelWriting();
+        d->saveFile.commit();
+        break;
+    case OutputMode::Device:
+        // whatever already went down the pipe is gone, just stop
+        d->directFile.close();
+        break;
+    case OutputMode::Memory:
+        d->memory.clear();
+        break;
+    default:
+        break;
+    }
+}
+
+bool OutputFileWriter::isOpen() const
+{
+    return d->mode != OutputMode::Closed;
+}
+
+bool OutputFileWriter::isSeekable() const
+{
+    return d->mode != OutputMode::Device;
+}
+
+QString OutputFileWriter::errorString() const
+{
+    QMutexLocker locker(&d->mutex);
+    return d->errorString;
+}
+
+QByteArray OutputFileWriter::takeBuffer()
+{
+    // not committed yet
+    if (d->mode == OutputMode::Memory) {
+        return QByteArray();
+    }
+    return std::exchange(d->memory, QByteArray());
+}
+
+void *OutputFileWriter::getBuffer(size_t *size)
+{
+    if (d->mode == OutputMode::Memory) {
+        // written straight into the result, capped so the array only grows in reasonable steps
+        *size = std::min(*size, BUFFER_BYTES);
+        const qint64 needed = d->position + static_cast<qint64>(*size);
+        if (needed > d->memory.size()) {
+            if (needed > d->memory.capacity()) {
+                d->memory.reserve(static_cast<qsizetype>(std::max(needed, static_cast<qint64>(d->memory.capacity()) * 2)));
+            }
+            d->memory.resize(static_cast<qsizetype>(needed));
+        }
+        return d->memory.data() + d->position;
+    }
+
+    if (d->current >= 0) {
+        const size_t room = BUFFER_BYTES - d->buffers[d->current].fill;
+        if (room < std::min(*size, MIN_HANDOUT)) {
+            d->submitCurrent();
+        }
+    }
+    if (d->current < 0) {
+        QMutexLocker locker(&d->mutex);
+        while (d->freeBuffers.isEmpty()) {
+            d->cond.wait(&d->mutex);
+        }
+        d->current = d->freeBuffers.dequeue();
+        d->buffers[d->current].offset = d->position;
+        d->buffers[d->current].fill = 0;
+    }
+
+    WriteBuffer &buf = d->buffers[d->current];
+    *size = std::min(*size, BUFFER_BYTES - buf.fill);
+    return buf.data.get() + buf.fill;
+}
+
+void OutputFileWriter::releaseBuffer(size_t writtenBytes)
+{
+    if (d->mode == OutputMode::Memory) {
+        d->position += static_cast<qint64>(writtenBytes);
+        d->endOffset = std::max(d->endOffset, d->position);
+        return;
+    }
+
+    if (d->current < 0) {
+        return;
+    }
+    WriteBuffer &buf = d->buffers[d->current];
+    buf.fill += writtenBytes;
+    d->position += static_cast<qint64>(writtenBytes);
+    if (buf.fill >= BUFFER_BYTES) {
+        d->submitCurrent();
+    }
+}
+
+void OutputFileWriter::seek(uint64_t position)
+{
+    if (static_cast<qint64>(position) == d->position) {
+        return;
+    }
+    if (!isSeekable()) {
+        qWarning() << "Seek on non-seekable output ignored";
+        return;
+    }
+    // libjxl seeks back to patch box sizes and the TOC, buffers are written in submission
+    // order, so the patch lands after whatever it overwrites
+    d->submitCurrent();
+    d->position = static_cast<qint64>(position);
+}
+
+void OutputFileWriter::Private::reset()
+{
+    current = -1;
+    position = 0;
+    stopping = false;
+    errorString.clear();
+    endOffset = 0;
+    allocated = 0;
+    memory.clear();
+}
+
+bool OutputFileWriter::Private::startIo()
+{
+    for (int i = 0; i < BUFFER_COUNT; i++) {
+        if (!buffers[i].data) {
+            buffers[i].data.reset(static_cast<uchar *>(::operator new[](BUFFER_BYTES, std::align_val_t(BUFFER_ALIGN))));
+        }
+    }
+    freeBuffers.clear();
+    pending.clear();
+    for (int i = 0; i < BUFFER_COUNT; i++) {
+        freeBuffers.enqueue(i);
+    }
+
+    ioThread.reset(QThread::create([this]() {
+        ioLoop();
+    }));
+    ioThread->start();
+    return true;
+}
+
+void OutputFileWriter::Private::submitCurrent()
+{
+    if (current < 0) {
+        return;
+    }
+    QMutexLocker locker(&mutex);
+    if (buffers[current].fill == 0) {
+        freeBuffers.enqueue(current);
+    } else {
+        pending.enqueue(current);
+    }
+    current = -1;
+    cond.wakeAll();
+}
+
+void OutputFileWriter::Private::finish()
+{
+    submitCurrent();
+    {
+        QMutexLocker locker(&mutex);
+        stopping = true;
+        cond.wakeAll();
+    }
+    if (ioThread) {
+        ioThread->wait();
+        ioThread.reset();
+    }
+}
+
+void OutputFileWriter::Private::ioLoop()
+{
+    for (;;) {
+        int index = 0;
+        bool failed = false;
+        {
+            QMutexLocker locker(&mutex);
+            while (pending.isEmpty() && !stopping) {
+                cond.wait(&mutex);
+            }
+            if (pending.isEmpty()) {
+                return;
+            }
+            index = pending.dequeue();
+            failed = !errorString.isEmpty();
+        }
+
+        // after a failure buffers are only recycled, the encode is lost anyway
+        if (!failed) {
+            writeBuffer(buffers[index]);
+        }
+
+        QMutexLocker locker(&mutex);
+        freeBuffers.enqueue(index);
+        cond.wakeAll();
+    }
+}
+
+void OutputFileWriter::Private::writeBuffer(const WriteBuffer &buf)
+{
+    QFileDevice *dev = device();
+    const qint64 end = buf.offset + static_cast<qint64>(buf.fill);
+#if defined(Q_OS_LINUX)
+    if (mode == OutputMode::SaveFile && end > allocated) {
+        const qint64 target = std::max(end, allocated + std::max(PREALLOC_STEP, allocated / 8));
+        const int ret = posix_fallocate(dev->handle(), static_cast<off_t>(allocated), static_cast<off_t>(target - allocated));
+        if (ret == 0) {
+            allocated = target;
+        } else if (ret == ENOSPC) {
+            QMutexLocker locker(&mutex);
+            errorString = QString("Not enough space for output file in %1")
+                              .arg(QFileInfo(dev->fileName()).absolutePath());
+            return;
+        } else {
+            // filesystem can't preallocate, just write
+            allocated = std::numeric_limits<qint64>::max();
+        }
+    }
+#endif
+
+    QString error;
+    if (mode == OutputMode::SaveFile && !dev->seek(buf.offset)) {
+        error = QString("Cannot seek output file: %1").arg(dev->errorString());
+    } else {
+        const char *p = reinterpret_cast<const char *>(buf.data.get());
+        qint64 left = static_cast<qint64>(buf.fill);
+        while (left > 0) {
+            const qint64 n = dev->write(p, left);
+            if (n <= 0) {
+                error = QString("Failed to write %1 bytes to output: %2")
+                            .arg(QString::number(left), dev->errorString());
+                break;
+            }
+            p += n;
+            left -= n;
+        }
+    }
+    if (!error.isEmpty()) {
+        QMutexLocker locker(&mutex);
+        errorString = error;
+        return;
+    }
+    endOffset = std::max(endOffset, end);
+}
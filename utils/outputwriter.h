@@ -0,0 +1,51 @@
+#ifndef OUTPUTWRITER_H
+#define OUTPUTWRITER_H
+
+#include <QByteArray>
+#include <QScopedPointer>
+#include <QString>
+
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * Backing store for JxlOutputProcessor: hands libjxl slices of a small ring of large aligned buffers
+ * and writes filled ones from a background thread, so the encoder thread never blocks on disk
+ * unless every buffer is still queued
+ *
+ * Regular files are written to a temporary file next to the output (grown with fallocate on Linux)
+ * that only replaces the output path on commit(), a failed or aborted encode leaves any existing file untouched
+ * "-" (stdout) and existing non-regular files (FIFOs, character devices) are written in order and directly,
+ * those aren't seekable so libjxl has to be told to only hand out finalized bytes
+ * openBuffer() keeps the whole output in memory instead, written in place without the I/O thread
+ */
+class OutputFileWriter
+{
+public:
+    OutputFileWriter();
+    ~OutputFileWriter();
+
+    bool open(const QString &filename);
+    bool openBuffer();
+    // flushes all queued buffers, trims the preallocation and renames the temp file over the output
+    bool commit();
+    // drops everything written so far
+    void discard();
+    bool isOpen() const;
+    bool isSeekable() const;
+    QString errorString() const;
+
+    // output of a committed openBuffer() session
+    QByteArray takeBuffer();
+
+    // JxlEncoderOutputProcessor callbacks, only called from the encoder thread
+    void *getBuffer(size_t *size);
+    void releaseBuffer(size_t writtenBytes);
+    void seek(uint64_t position);
+
+private:
+    class Private;
+    QScopedPointer<Private> d;
+};
+
+#endif // OUTPUTWRITER_H
@@ -0,0 +1,321 @@
+#include "pixelpack.h"
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64)
+#define PIXELPACK_X86
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define PIXELPACK_TARGET(x)
+#else
+#define PIXELPACK_TARGET(x) __attribute__((target(x)))
+#endif
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#define PIXELPACK_NEON
+#include <arm_neon.h>
+#endif
+
+namespace
+{
+using RowFn = void (*)(const uint8_t *src, uint8_t *dst, size_t width);
+
+// one pixel at a time, BPC known at compile time so the memcpy turns into plain moves
+template<size_t BPC>
+void dropXScalar(const uint8_t *src, uint8_t *dst, size_t width)
+{
+    for (size_t x = 0; x < width; x++) {
+        memcpy(dst, src, 3 * BPC);
+        src += 4 * BPC;
+        dst += 3 * BPC;
+    }
+}
+
+// strided gather of one channel, src already points at the wanted channel of the first pixel
+template<size_t BPC>
+void extractScalar(const uint8_t *src, uint8_t *dst, size_t width, size_t channels)
+{
+    const size_t step = channels * BPC;
+    for (size_t x = 0; x < width; x++) {
+        memcpy(dst, src, BPC);
+        src += step;
+        dst += BPC;
+    }
+}
+
+#if defined(PIXELPACK_X86)
+/*
+ * The SIMD kernels store full registers, so the last few pixels of a row
+ * (where a store would run past the packed row) are left to the scalar loop
+ */
+
+// 12 packed bytes out of 16, the rest is zeroed
+const uint8_t SHUF_U8[16] = {0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, 0x80, 0x80, 0x80, 0x80};
+const uint8_t SHUF_U16[16] = {0, 1, 2, 3, 4, 5, 8, 9, 10, 11, 12, 13, 0x80, 0x80, 0x80, 0x80};
+
+PIXELPACK_TARGET("ssse3")
+void dropXSsse3U8(const uint8_t *src, uint8_t *dst, size_t width)
+{
+    const __m128i shuf = _mm_loadu_si128(reinterpret_cast<const __m128i *>(SHUF_U8));
+    size_t x = 0;
+    for (; x + 6 <= width; x += 4) {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + x * 4));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + x * 3), _mm_shuffle_epi8(v, shuf));
+    }
+    dropXScalar<1>(src + x * 4, dst + x * 3, width - x);
+}
+
+PIXELPACK_TARGET("ssse3")
+void dropXSsse3U16(const uint8_t *src, uint8_t *dst, size_t width)
+{
+    const __m128i shuf = _mm_loadu_si128(reinterpret_cast<const __m128i *>(SHUF_U16));
+    size_t x = 0;
+    for (; x + 3 <= width; x += 2) {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + x * 8));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + x * 6), _mm_shuffle_epi8(v, shuf));
+    }
+    dropXScalar<2>(src + x * 8, dst + x * 6, width - x);
+}
+
+// a 32 bit pixel is a whole register already, the next store overwrites the X channel
+PIXELPACK_TARGET("sse2")
+void dropXSse2U32(const uint8_t *src, uint8_t *dst, size_t width)
+{
+    size_t x = 0;
+    for (; x + 2 <= width; x++) {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + x * 16));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + x * 12), v);
+    }
+    dropXScalar<4>(src + x * 16, dst + x * 12, width - x);
+}
+
+// in-lane shuffle leaves 12 bytes at the bottom of each lane, then the dwords get joined
+PIXELPACK_TARGET("avx2")
+void dropXAvx2U8(const uint8_t *src, uint8_t *dst, size_t width)
+{
+    const __m256i shuf = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i *>(SHUF_U8)));
+    const __m256i join = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7);
+    size_t x = 0;
+    // 16 pixels in, 48 bytes out per round
+    for (; x + 19 <= width; x += 16) {
+        const __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + x * 4));
+        const __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + x * 4 + 32));
+        const __m256i pa = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(a, shuf), join);
+        const __m256i pb = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(b, shuf), join);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + x * 3), pa);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + x * 3 + 24), pb);
+    }
+    dropXSsse3U8(src + x * 4, dst + x * 3, width - x);
+}
+
+PIXELPACK_TARGET("avx2")
+void dropXAvx2U16(const uint8_t *src, uint8_t *dst, size_t width)
+{
+    const __m256i shuf = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i *>(SHUF_U16)));
+    const __m256i join = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7);
+    size_t x = 0;
+    // 8 pixels in, 48 bytes out per round
+    for (; x + 10 <= width; x += 8) {
+        const __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + x * 8));
+        const __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + x * 8 + 32));
+        const __m256i pa = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(a, shuf), join);
+        const __m256i pb = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(b, shuf), join);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + x * 6), pa);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + x * 6 + 24), pb);
+    }
+    dropXSsse3U16(src + x * 8, dst + x * 6, width - x);
+}
+
+PIXELPACK_TARGET("avx2")
+void dropXAvx2U32(const uint8_t *src, uint8_t *dst, size_t width)
+{
+    const __m256i join = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7);
+    size_t x = 0;
+    // 4 pixels in, 48 bytes out per round
+    for (; x + 5 <= width; x += 4) {
+        const __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + x * 16));
+        const __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + x * 16 + 32));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + x * 12), _mm256_permutevar8x32_epi32(a, join));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + x * 12 + 24), _mm256_permutevar8x32_epi32(b, join));
+    }
+    dropXSse2U32(src + x * 16, dst + x * 12, width - x);
+}
+
+bool cpuHasSsse3()
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+    int info[4];
+    __cpuid(info, 1);
+    return (info[2] & (1 << 9)) != 0;
+#else
+    return __builtin_cpu_supports("ssse3");
+#endif
+}
+
+bool cpuHasAvx2()
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+    int info[4];
+    __cpuid(info, 1);
+    const bool osxsave = (info[2] & (1 << 27)) != 0;
+    const bool avx = (info[2] & (1 << 28)) != 0;
+    if (!osxsave || !avx || (_xgetbv(0) & 0x6) != 0x6) {
+        return false;
+    }
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+#if defined(PIXELPACK_NEON)
+// structured loads/stores do the deinterleaving for us
+void dropXNeonU8(const uint8_t *src, uint8_t *dst, size_t width)
+{
+    size_t x = 0;
+    for (; x + 16 <= width; x += 16) {
+        const uint8x16x4_t v = vld4q_u8(src + x * 4);
+        vst3q_u8(dst + x * 3, uint8x16x3_t{{v.val[0], v.val[1], v.val[2]}});
+    }
+    dropXScalar<1>(src + x * 4, dst + x * 3, width - x);
+}
+
+void dropXNeonU16(const uint8_t *src, uint8_t *dst, size_t width)
+{
+    size_t x = 0;
+    for (; x + 8 <= width; x += 8) {
+        const uint16x8x4_t v = vld4q_u16(reinterpret_cast<const uint16_t *>(src + x * 8));
+        vst3q_u16(reinterpret_cast<uint16_t *>(dst + x * 6), uint16x8x3_t{{v.val[0], v.val[1], v.val[2]}});
+    }
+    dropXScalar<2>(src + x * 8, dst + x * 6, width - x);
+}
+
+void dropXNeonU32(const uint8_t *src, uint8_t *dst, size_t width)
+{
+    size_t x = 0;
+    for (; x + 4 <= width; x += 4) {
+        const uint32x4x4_t v = vld4q_u32(reinterpret_cast<const uint32_t *>(src + x * 16));
+        vst3q_u32(reinterpret_cast<uint32_t *>(dst + x * 12), uint32x4x3_t{{v.val[0], v.val[1], v.val[2]}});
+    }
+    dropXScalar<4>(src + x * 16, dst + x * 12, width - x);
+}
+#endif
+
+struct DropXKernels {
+    RowFn u8{dropXScalar<1>};
+    RowFn u16{dropXScalar<2>};
+    RowFn u32{dropXScalar<4>};
+    const char *name{"scalar"};
+};
+
+DropXKernels pickKernels()
+{
+    DropXKernels k;
+#if defined(PIXELPACK_X86)
+    k.u32 = dropXSse2U32;
+    k.name = "sse2";
+    if (cpuHasSsse3()) {
+        k.u8 = dropXSsse3U8;
+        k.u16 = dropXSsse3U16;
+        k.name = "ssse3";
+    }
+    if (cpuHasAvx2()) {
+        k.u8 = dropXAvx2U8;
+        k.u16 = dropXAvx2U16;
+        k.u32 = dropXAvx2U32;
+        k.name = "avx2";
+    }
+#elif defined(PIXELPACK_NEON)
+    k.u8 = dropXNeonU8;
+    k.u16 = dropXNeonU16;
+    k.u32 = dropXNeonU32;
+    k.name = "neon";
+#endif
+    return k;
+}
+
+const DropXKernels &kernels()
+{
+    static const DropXKernels k = pickKernels();
+    return k;
+}
+} // namespace
+
+namespace jxfrstch
+{
+void packInterleavedRows(const void *src,
+                         size_t srcStride,
+                         void *dst,
+                         size_t dstStride,
+                         size_t width,
+                         size_t height,
+                         size_t bytesPerChannel,
+                         bool alpha)
+{
+    const auto *s = static_cast<const uint8_t *>(src);
+    auto *d = static_cast<uint8_t *>(dst);
+
+    if (alpha) {
+        const size_t rowBytes = width * 4 * bytesPerChannel;
+        if (srcStride == rowBytes && dstStride == rowBytes) {
+            memcpy(d, s, rowBytes * height);
+            return;
+        }
+        for (size_t y = 0; y < height; y++) {
+            memcpy(d + y * dstStride, s + y * srcStride, rowBytes);
+        }
+        return;
+    }
+
+    const RowFn fn = [&]() {
+        switch (bytesPerChannel) {
+        case 2:
+            return kernels().u16;
+        case 4:
+            return kernels().u32;
+        default:
+            return kernels().u8;
+        }
+    }();
+    for (size_t y = 0; y < height; y++) {
+        fn(s + y * srcStride, d + y * dstStride, width);
+    }
+}
+
+void extractChannelRows(const void *src,
+                        size_t srcStride,
+                        void *dst,
+                        size_t dstStride,
+                        size_t width,
+                        size_t height,
+                        size_t bytesPerChannel,
+                        size_t channels,
+                        size_t channel)
+{
+    const auto *s = static_cast<const uint8_t *>(src);
+    auto *d = static_cast<uint8_t *>(dst);
+    for (size_t y = 0; y < height; y++) {
+        const uint8_t *srow = s + y * srcStride + channel * bytesPerChannel;
+        uint8_t *drow = d + y * dstStride;
+        switch (bytesPerChannel) {
+        case 2:
+            extractScalar<2>(srow, drow, width, channels);
+            break;
+        case 4:
+            extractScalar<4>(srow, drow, width, channels);
+            break;
+        default:
+            extractScalar<1>(srow, drow, width, channels);
+            break;
+        }
+    }
+}
+
+const char *packKernelName()
+{
+    return kernels().name;
+}
+} // namespace jxfrstch
@@ -0,0 +1,40 @@
+#ifndef PIXELPACK_H
+#define PIXELPACK_H
+
+#include <cstddef>
+
+namespace jxfrstch
+{
+/*
+ * Packs rows of 4 channel interleaved pixels (QImage RGBA/RGBX formats) into the
+ * interleaved layout libjxl expects, RGBA stays RGBA and RGBX drops the X channel
+ *
+ * Channel type doesn't matter here, only its size (1, 2 or 4 bytes), so 16 bit float
+ * and 16 bit integer share the same kernel. Both strides are in bytes, dst has to be
+ * preallocated to at least dstStride * (height - 1) + width * channels * bytesPerChannel
+ */
+void packInterleavedRows(const void *src,
+                         size_t srcStride,
+                         void *dst,
+                         size_t dstStride,
+                         size_t width,
+                         size_t height,
+                         size_t bytesPerChannel,
+                         bool alpha);
+
+// copies a single channel out of interleaved rows into a planar buffer (eg. alpha for a libjxl extra channel)
+void extractChannelRows(const void *src,
+                        size_t srcStride,
+                        void *dst,
+                        size_t dstStride,
+                        size_t width,
+                        size_t height,
+                        size_t bytesPerChannel,
+                        size_t channels,
+                        size_t channel);
+
+// name of the RGBX to RGB kernel picked for this CPU
+const char *packKernelName();
+} // namespace jxfrstch
+
+#endif // PIXELPACK_H
@@ -0,0 +1,231 @@
+#include "projectfile.h"
+
+#include <QCborMap>
+#include <QCborValue>
+#include <QCryptographicHash>
+#include <QFile>
+#include <QHash>
+#include <QJsonArray>
+#include <QJsonObject>
+#include <QJsonValue>
+
+namespace
+{
+QByteArray iccKey(const QByteArray &icc)
+{
+    return QCryptographicHash::hash(icc, QCryptographicHash::Sha1).toHex();
+}
+
+// per file probe record, ICC profiles are shared through the project's profile table by their hash
+QJsonObject probeToJson(const jxfrstch::InputProbe &probe, QJsonObject &iccTable)
+{
+    QJsonObject obj;
+    obj["fileSize"] = probe.fileSize;
+    obj["mtime"] = probe.modifiedMs;
+    obj["width"] = probe.size.width();
+    obj["height"] = probe.size.height();
+    obj["frames"] = probe.frameCount;
+    obj["bitDepth"] = probe.bitDepth;
+    obj["anim"] = probe.animation;
+    obj["alpha"] = probe.hasAlpha;
+    obj["coalesced"] = probe.coalesced;
+    if (!probe.icc.isEmpty()) {
+        const QString key = QString::fromLatin1(iccKey(probe.icc));
+        if (!iccTable.contains(key)) {
+            iccTable[key] = QString::fromLatin1(probe.icc.toBase64());
+        }
+        obj["icc"] = key;
+    }
+    return obj;
+}
+
+jxfrstch::InputProbe probeFromJson(const QJsonObject &obj, const QHash<QString, QByteArray> &iccTable)
+{
+    jxfrstch::InputProbe probe;
+    const QString key = obj.value("icc").toString();
+    if (!key.isEmpty() && !iccTable.contains(key)) {
+        // profile missing, can't be trusted
+        return probe;
+    }
+    probe.fileSize = static_cast<qint64>(obj.value("fileSize").toDouble(-1));
+    probe.modifiedMs = static_cast<qint64>(obj.value("mtime").toDouble(0));
+    probe.size = QSize(obj.value("width").toInt(0), obj.value("height").toInt(0));
+    probe.frameCount = obj.value("frames").toInt(0);
+    probe.bitDepth = obj.value("bitDepth").toInt(0);
+    probe.animation = obj.value("anim").toBool(false);
+    probe.hasAlpha = obj.value("alpha").toBool(false);
+    probe.coalesced = obj.value("coalesced").toBool(false);
+    probe.icc = iccTable.value(key);
+    // records without the alpha flag predate it, probe those again
+    if (!probe.size.isValid() || probe.frameCount <= 0 || !obj.contains("alpha")) {
+        probe.fileSize = -1;
+    }
+    return probe;
+}
+} // namespace
+
+namespace jxfrstch
+{
+bool readProjectFile(const QString &filename, ProjectData &project)
+{
+    QByteArray binsave;
+    if (!filename.isEmpty()) {
+        QFile inF(filename);
+        inF.open(QIODevice::ReadOnly);
+        if (inF.isReadable()) {
+            binsave = inF.readAll();
+        } else {
+            inF.close();
+            return false;
+        }
+        inF.close();
+    }
+
+    if (binsave.isEmpty()) {
+        return false;
+    }
+
+    const QJsonObject loadjs = QCborValue::fromCbor(binsave).toMap().toJsonObject();
+    if (loadjs.isEmpty()) {
+        return false;
+    }
+
+    EncodeParams &params = project.params;
+    params.alpha = loadjs.value("useAlpha").toBool(true);
+    params.premulAlpha = loadjs.value("usePremulAlpha").toBool(false);
+    params.losslessAlpha = loadjs.value("useLosslessAlpha").toBool(true);
+    params.bitDepth = static_cast<EncodeBitDepth>(loadjs.value("bitdepth").toInt(0));
+    params.distance = loadjs.value("encDistance").toDouble(0.0);
+    params.effort = loadjs.value("encEffort").toInt(1);
+    params.numerator = loadjs.value("numerator").toInt(1);
+    params.denominator = loadjs.value("denominator").toInt(1);
+    params.loops = loadjs.value("numLoops").toInt(0);
+    params.animation = loadjs.value("useAnimation").toBool(true);
+    params.colorSpace = static_cast<EncodeColorSpace>(loadjs.value("colorSpace").toInt(0));
+    params.photonNoise = loadjs.value("photonNoise").toDouble(0.0);
+    params.autoCropFrame = loadjs.value("autoCrop").toBool(false);
+    params.autoCropFuzzyComparison = static_cast<float>(loadjs.value("autoCropThr").toDouble(0.0));
+    params.onlyCropAnimatedFile = loadjs.value("autoCropOnlyFile").toBool(false);
+    params.lookaheadFrames = loadjs.value("lookahead").toInt(4);
+    params.spillThresholdMiB = loadjs.value("spillThreshold").toInt(0);
+    params.scratchDir = loadjs.value("scratchDir").toString();
+    params.frameCacheMiB = loadjs.value("frameCache").toInt(0);
+    params.frameCacheDiskMiB = loadjs.value("frameCacheDisk").toInt(0);
+    params.frameCacheDir = loadjs.value("frameCacheDir").toString();
+    if (params.numerator > 0) {
+        params.frameTimeMs = (static_cast<double>(params.denominator * 1000) / static_cast<double>(params.numerator));
+    }
+
+    QHash<QString, QByteArray> iccTable;
+    const QJsonObject iccjs = loadjs.value("iccProfiles").toObject();
+    for (auto it = iccjs.constBegin(); it != iccjs.constEnd(); ++it) {
+        iccTable.insert(it.key(), QByteArray::fromBase64(it.value().toString().toLatin1()));
+    }
+
+    project.files.clear();
+    if (loadjs.value("fileList").isArray()) {
+        const QJsonArray farray = loadjs.value("fileList").toArray();
+        for (const auto &fs : farray) {
+            const QJsonObject ff = fs.toObject();
+            const QString tmpFile = ff.value("filename").toString();
+            if (tmpFile.isEmpty()) {
+                continue;
+            }
+
+            InputFileData ifd;
+            ifd.filename = tmpFile;
+            ifd.blendMode = static_cast<JxlBlendMode>(ff.value("blend").toInt(2));
+            ifd.frameDuration = ff.value("frameDur").toInt(1);
+            ifd.frameReference = ff.value("frameRef").toInt(0);
+            ifd.isPageEnd = ff.value("frameEndP").toBool(false);
+            ifd.isRefFrame = [&]() {
+                if (ff.value("isRef").isBool()) {
+                    return ff.value("isRef").toBool(false) ? 1 : 0;
+                }
+                return ff.value("isRef").toInt(0);
+            }();
+            ifd.frameXPos = ff.value("frameXPos").toInt(0);
+            ifd.frameYPos = ff.value("frameYPos").toInt(0);
+            ifd.frameName = ff.value("frameName").toString();
+            ifd.frameIn = qMax(0, ff.value("frameIn").toInt(0));
+            ifd.frameOut = qMax(-1, ff.value("frameOut").toInt(-1));
+            ifd.frameStep = qMax(1, ff.value("frameStep").toInt(1));
+            if (ff.value("probe").isObject()) {
+                ifd.probe = probeFromJson(ff.value("probe").toObject(), iccTable);
+            }
+            project.files.append(ifd);
+        }
+    }
+
+    return true;
+}
+
+bool writeProjectFile(const QString &filename, const ProjectData &project)
+{
+    QJsonArray files;
+    QJsonObject iccTable;
+    for (const auto &ifd : project.files) {
+        QJsonObject jsobj;
+
+        jsobj["filename"] = ifd.filename;
+        jsobj["isRef"] = ifd.isRefFrame;
+        if (ifd.isPageEnd) {
+            jsobj["frameDur"] = 1;
+            jsobj["frameEndP"] = true;
+        } else {
+            jsobj["frameDur"] = static_cast<int>(ifd.frameDuration);
+            jsobj["frameEndP"] = false;
+        }
+        jsobj["frameRef"] = ifd.frameReference;
+        jsobj["frameXPos"] = ifd.frameXPos;
+        jsobj["frameYPos"] = ifd.frameYPos;
+        jsobj["blend"] = ifd.blendMode;
+        jsobj["frameName"] = ifd.frameName;
+        jsobj["frameIn"] = ifd.frameIn;
+        jsobj["frameOut"] = ifd.frameOut;
+        jsobj["frameStep"] = ifd.frameStep;
+        if (ifd.probe.fileSize >= 0) {
+            jsobj["probe"] = probeToJson(ifd.probe, iccTable);
+        }
+        files.append(jsobj);
+    }
+
+    const EncodeParams &params = project.params;
+    QJsonObject sets;
+    sets["useAlpha"] = params.alpha;
+    sets["usePremulAlpha"] = params.premulAlpha;
+    sets["useLosslessAlpha"] = params.losslessAlpha;
+    sets["bitdepth"] = params.bitDepth;
+    sets["encDistance"] = params.distance;
+    sets["encEffort"] = params.effort;
+    sets["numerator"] = params.numerator;
+    sets["denominator"] = params.denominator;
+    sets["numLoops"] = params.loops;
+    sets["useAnimation"] = params.animation;
+    sets["colorSpace"] = params.colorSpace;
+    sets["photonNoise"] = params.photonNoise;
+    sets["autoCrop"] = params.autoCropFrame;
+    sets["autoCropThr"] = params.autoCropFuzzyComparison;
+    sets["autoCropOnlyFile"] = params.onlyCropAnimatedFile;
+    sets["lookahead"] = params.lookaheadFrames;
+    sets["spillThreshold"] = params.spillThresholdMiB;
+    sets["scratchDir"] = params.scratchDir;
+    sets["frameCache"] = params.frameCacheMiB;
+    sets["frameCacheDisk"] = params.frameCacheDiskMiB;
+    sets["frameCacheDir"] = params.frameCacheDir;
+    sets["fileList"] = files;
+    sets["iccProfiles"] = iccTable;
+
+    const QByteArray binsave = QCborValue::fromJsonValue(sets).toCbor();
+
+    QFile outF(filename);
+    outF.open(QIODevice::WriteOnly);
+    if (!outF.isWritable()) {
+        outF.close();
+        return false;
+    }
+    const bool written = (outF.write(binsave) == binsave.size());
+    outF.close();
+    return written;
+}
+} // namespace jxfrstch
@@ -0,0 +1,25 @@
+#ifndef PROJECTFILE_H
+#define PROJECTFILE_H
+
+#include <QString>
+#include <QVector>
+
+#include "jxlutils.h"
+
+namespace jxfrstch
+{
+/*
+ * .frstch project, a CBOR encoded map of global settings and the frame list
+ * Frames can carry the probe record of their file, with the ICC profiles in a table of their own
+ * Output file name is not part of the project
+ */
+struct ProjectData {
+    EncodeParams params{};
+    QVector<InputFileData> files{};
+};
+
+bool readProjectFile(const QString &filename, ProjectData &project);
+bool writeProjectFile(const QString &filename, const ProjectData &project);
+} // namespace jxfrstch
+
+#endif // PROJECTFILE_H
@@ -0,0 +1,194 @@
+#include "streamedimage.h"
+#include "framepipeline.h"
+
+#include <QImageIOHandler>
+#include <QImageReader>
+#include <QList>
+#include <QMutex>
+#include <QWaitCondition>
+
+#include <cstring>
+
+namespace
+{
+// smaller images are simply decoded whole
+constexpr qint64 STREAM_MIN_PIXELS = 50'000'000;
+// strips are whole chunked encoder tile rows, taller ones while they stay below the byte cap
+constexpr int STRIP_MIN_ROWS = 2048;
+constexpr qint64 STRIP_MAX_BYTES = 256LL << 20;
+// a tile can straddle two strips
+constexpr int STRIP_CACHE = 2;
+
+struct CachedStrip {
+    int index;
+    QImage image;
+};
+
+// shares the strip's pixels, the strip stays alive until the last region of it is gone
+QImage subImage(const QImage &strip, const QRect &rect)
+{
+    const uchar *bits = strip.constBits() + static_cast<qsizetype>(rect.y()) * strip.bytesPerLine()
+        + static_cast<qsizetype>(rect.x()) * (strip.depth() / 8);
+    return QImage(
+        bits,
+        rect.width(),
+        rect.height(),
+        strip.bytesPerLine(),
+        strip.format(),
+        [](void *info) {
+            delete static_cast<QImage *>(info);
+        },
+        new QImage(strip));
+}
+} // namespace
+
+class Q_DECL_HIDDEN StreamedImageSource::Private
+{
+public:
+    QImage strip(int index);
+    QImage decodeStrip(int index);
+
+    QString filename{};
+    QSize size{};
+    jxfrstch::EncodeParams params{};
+    QByteArray rootICC{};
+    QString errorString{};
+    int stripRows{STRIP_MIN_ROWS};
+
+    // most recently used first
+    QList<CachedStrip> cache;
+    // strip being decoded, one at a time so strips come in order and memory stays bounded
+    int decoding{-1};
+    QMutex mutex;
+    QWaitCondition cond;
+};
+
+StreamedImageSource::StreamedImageSource(const QString &filename,
+                                         const jxfrstch::EncodeParams &params,
+                                         const QByteArray &rootICC)
+    : d(new Private)
+{
+    d->filename = filename;
+    d->params = params;
+    d->rootICC = rootICC;
+    d->size = QImageReader(filename).size();
+    const qint64 rowBytes = qMax<qint64>(1, d->size.width()) * 4 * static_cast<qint64>(jxfrstch::bytesPerChannel(params.bitDepth));
+    d->stripRows = static_cast<int>(qMax<qint64>(1, STRIP_MAX_BYTES / rowBytes / STRIP_MIN_ROWS) * STRIP_MIN_ROWS);
+}
+
+StreamedImageSource::~StreamedImageSource() = default;
+
+bool StreamedImageSource::canStream(const QString &filename)
+{
+    QImageReader reader(filename);
+    if (!reader.canRead() || !reader.supportsOption(QImageIOHandler::ClipRect)) {
+        return false;
+    }
+    if (reader.supportsAnimation() && reader.imageCount() > 1) {
+        return false;
+    }
+    const QSize sz = reader.size();
+    return sz.isValid() && static_cast<qint64>(sz.width()) * static_cast<qint64>(sz.height()) >= STREAM_MIN_PIXELS;
+}
+
+QSize StreamedImageSource::size() const
+{
+    return d->size;
+}
+
+QImage StreamedImageSource::region(const QRect &rect)
+{
+    const int first = rect.top() / d->stripRows;
+    const int last = rect.bottom() / d->stripRows;
+    if (first == last) {
+        const QImage strip = d->strip(first);
+        if (strip.isNull()) {
+            return QImage();
+        }
+        return subImage(strip, rect.translated(0, -first * d->stripRows));
+    }
+
+    // across a strip boundary, put together from both
+    QImage image;
+    for (int i = first; i <= last; i++) {
+        const QImage strip = d->strip(i);
+        if (strip.isNull()) {
+            return QImage();
+        }
+        if (image.isNull()) {
+            image = QImage(rect.size(), strip.format());
+        }
+        const int stripTop = i * d->stripRows;
+        const int y0 = qMax(rect.top(), stripTop);
+        const int y1 = qMin(rect.bottom(), stripTop + strip.height() - 1);
+        const qsizetype rowBytes = static_cast<qsizetype>(rect.width()) * (strip.depth() / 8);
+        for (int y = y0; y <= y1; y++) {
+            memcpy(image.scanLine(y - rect.top()),
+                   strip.constScanLine(y - stripTop) + static_cast<qsizetype>(rect.x()) * (strip.depth() / 8),
+                   rowBytes);
+        }
+    }
+    return image;
+}
+
+QString StreamedImageSource::errorString() const
+{
+    QMutexLocker locker(&d->mutex);
+    return d->errorString;
+}
+
+QImage StreamedImageSource::Private::strip(int index)
+{
+    QMutexLocker locker(&mutex);
+    for (;;) {
+        for (int i = 0; i < cache.size(); i++) {
+            if (cache.at(i).index == index) {
+                cache.move(i, 0);
+                return cache.first().image;
+            }
+        }
+        if (decoding < 0) {
+            break;
+        }
+        cond.wait(&mutex);
+    }
+
+    decoding = index;
+    locker.unlock();
+    const QImage image = decodeStrip(index);
+    locker.relock();
+
+    decoding = -1;
+    if (!image.isNull()) {
+        cache.prepend(CachedStrip{index, image});
+        while (cache.size() > STRIP_CACHE) {
+            cache.removeLast();
+        }
+    }
+    cond.wakeAll();
+    return image;
+}
+
+QImage StreamedImageSource::Private::decodeStrip(int index)
+{
+    const int top = index * stripRows;
+    const QRect rect(0, top, size.width(), qMin(stripRows, size.height() - top));
+
+    // Qt readers can't resume where the last read stopped, a full width strip at least
+    // serves every tile of its rows from a single decode
+    QImageReader reader(filename);
+    reader.setClipRect(rect);
+    QImage image = reader.read();
+    if (image.isNull() || image.size() != rect.size()) {
+        QMutexLocker locker(&mutex);
+        errorString = QString("Failed to decode rows %1-%2 of %3: %4")
+                          .arg(QString::number(rect.top()), QString::number(rect.bottom()), filename, reader.errorString());
+        return QImage();
+    }
+    if (!FramePipeline::convertFrame(image, params, rootICC)) {
+        QMutexLocker locker(&mutex);
+        errorString = "Unsupported bit depth!";
+        return QImage();
+    }
+    return image;
+}
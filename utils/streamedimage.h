@@ -0,0 +1,32 @@
+#ifndef STREAMEDIMAGE_H
+#define STREAMEDIMAGE_H
+
+#include "jxlutils.h"
+#include <QString>
+
+/*
+ * Decodes a still, non-JXL image in full width row strips with QImageReader::setClipRect,
+ * converted to the encode format and color space, for the chunked encoder to pull tiles from
+ * Only the last two strips are kept, so memory follows the strip size instead of the image size
+ * Stock Qt only decodes regions of JPEG, so PNG and TIFF inputs are still decoded whole
+ */
+class StreamedImageSource
+{
+public:
+    StreamedImageSource(const QString &filename, const jxfrstch::EncodeParams &params, const QByteArray &rootICC);
+    ~StreamedImageSource();
+
+    // header only check whether the file's reader can decode regions and is big enough to bother
+    static bool canStream(const QString &filename);
+
+    QSize size() const;
+    // safe to call from several threads, returns a null image on failure
+    QImage region(const QRect &rect);
+    QString errorString() const;
+
+private:
+    class Private;
+    QScopedPointer<Private> d;
+};
+
+#endif // STREAMEDIMAGE_H
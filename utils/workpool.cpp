@@ -0,0 +1,257 @@
+#include "workpool.h"
+
+#include <QList>
+#include <QMutex>
+#include <QThread>
+#include <QVector>
+#include <QWaitCondition>
+
+#include <algorithm>
+#include <atomic>
+
+#if defined(Q_OS_LINUX)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace
+{
+// one parallelFor in flight, lives on the caller's stack
+struct Call {
+    // 64 bit so claiming past the end can't wrap around
+    std::atomic<uint64_t> next{0};
+    uint64_t end{0};
+    const std::function<void(uint32_t, int)> *fn{nullptr};
+    // guarded by the pool mutex
+    int maxSlots{1};
+    int slots{0};
+    int active{0};
+};
+
+void runCall(Call &call, int slot)
+{
+    for (uint64_t i = call.next.fetch_add(1, std::memory_order_relaxed); i < call.end;
+         i = call.next.fetch_add(1, std::memory_order_relaxed)) {
+        (*call.fn)(static_cast<uint32_t>(i), slot);
+    }
+}
+
+void applyPinning(int worker, bool pin)
+{
+#if defined(Q_OS_LINUX)
+    const int cores = qMax(1, QThread::idealThreadCount());
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (pin) {
+        // core 0 is left to whoever calls in
+        CPU_SET((worker + 1) % cores, &set);
+    } else {
+        for (int c = 0; c < cores; c++) {
+            CPU_SET(c, &set);
+        }
+    }
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+    Q_UNUSED(worker);
+    Q_UNUSED(pin);
+#endif
+}
+} // namespace
+
+namespace jxfrstch
+{
+class Q_DECL_HIDDEN WorkPool::Private
+{
+public:
+    void workerLoop(int worker);
+
+    QMutex mutex;
+    QWaitCondition workCond;
+    QWaitCondition doneCond;
+    QList<Call *> calls;
+    bool stopping{false};
+    std::atomic<bool> pinning{false};
+    QVector<QThread *> workers;
+};
+
+WorkPool &WorkPool::instance()
+{
+    static WorkPool pool;
+    return pool;
+}
+
+WorkPool::WorkPool()
+    : d(new Private)
+{
+    // the caller always works along, so one less than the core count
+    const int count = qMax(0, QThread::idealThreadCount() - 1);
+    for (int i = 0; i < count; i++) {
+        QThread *t = QThread::create([this, i]() {
+            d->workerLoop(i);
+        });
+        t->start();
+        d->workers.append(t);
+    }
+}
+
+WorkPool::~WorkPool()
+{
+    {
+        QMutexLocker locker(&d->mutex);
+        d->stopping = true;
+        d->workCond.wakeAll();
+    }
+    for (QThread *t : std::as_const(d->workers)) {
+        t->wait();
+        delete t;
+    }
+}
+
+int WorkPool::maxThreads() const
+{
+    return static_cast<int>(d->workers.size()) + 1;
+}
+
+void WorkPool::setPinning(bool enabled)
+{
+    // workers pick it up the next time they join a call
+    d->pinning.store(enabled, std::memory_order_relaxed);
+}
+
+bool WorkPool::parallelFor(uint32_t begin,
+                           uint32_t end,
+                           int maxThreads,
+                           const std::function<bool(int threads)> &init,
+                           const std::function<void(uint32_t index, int slot)> &fn)
+{
+    if (begin >= end) {
+        return true;
+    }
+
+    int threads = this->maxThreads();
+    if (maxThreads > 0) {
+        threads = std::min(threads, maxThreads);
+    }
+    threads = static_cast<int>(std::min<uint64_t>(static_cast<uint64_t>(threads), end - begin));
+
+    if (init && !init(threads)) {
+        return false;
+    }
+    if (threads == 1) {
+        for (uint32_t i = begin; i < end; i++) {
+            fn(i, 0);
+        }
+        return true;
+    }
+
+    Call call;
+    call.next.store(begin, std::memory_order_relaxed);
+    call.end = end;
+    call.fn = &fn;
+    call.maxSlots = threads;
+    // slot 0 is the caller
+    call.slots = 1;
+    call.active = 1;
+    {
+        QMutexLocker locker(&d->mutex);
+        d->calls.append(&call);
+        for (int i = 1; i < threads; i++) {
+            d->workCond.wakeOne();
+        }
+    }
+
+    runCall(call, 0);
+
+    QMutexLocker locker(&d->mutex);
+    // every index is taken at this point, only wait for the ones still running
+    d->calls.removeOne(&call);
+    call.active--;
+    while (call.active > 0) {
+        d->doneCond.wait(&d->mutex);
+    }
+    return true;
+}
+
+void WorkPool::parallelRows(int rows, int minRows, const std::function<void(int y0, int y1)> &fn)
+{
+    if (rows <= 0) {
+        return;
+    }
+    const int bands = qBound(1, rows / qMax(1, minRows), maxThreads());
+    parallelFor(0, static_cast<uint32_t>(bands), 0, {}, [&](uint32_t b, int) {
+        const int y0 = static_cast<int>(static_cast<qint64>(rows) * b / bands);
+        const int y1 = static_cast<int>(static_cast<qint64>(rows) * (b + 1) / bands);
+        fn(y0, y1);
+    });
+}
+
+JxlParallelRetCode parallelRunner(void *runnerOpaque,
+                                  void *jpegxlOpaque,
+                                  JxlParallelRunInit init,
+                                  JxlParallelRunFunction func,
+                                  uint32_t startRange,
+                                  uint32_t endRange)
+{
+    if (startRange > endRange) {
+        return JXL_PARALLEL_RET_RUNNER_ERROR;
+    }
+    const auto *limit = static_cast<const RunnerLimit *>(runnerOpaque);
+    const int cap = limit ? limit->maxThreads.loadRelaxed() : 0;
+
+    // a failing init's own code goes back to libjxl
+    JxlParallelRetCode initRet = JXL_PARALLEL_RET_SUCCESS;
+    const bool ok = WorkPool::instance().parallelFor(
+        startRange,
+        endRange,
+        cap,
+        [&](int threads) {
+            initRet = init(jpegxlOpaque, static_cast<size_t>(threads));
+            return initRet == JXL_PARALLEL_RET_SUCCESS;
+        },
+        [&](uint32_t index, int slot) {
+            func(jpegxlOpaque, index, static_cast<size_t>(slot));
+        });
+    if (ok) {
+        return JXL_PARALLEL_RET_SUCCESS;
+    }
+    return initRet != JXL_PARALLEL_RET_SUCCESS ? initRet : JXL_PARALLEL_RET_RUNNER_ERROR;
+}
+
+void WorkPool::Private::workerLoop(int worker)
+{
+    bool pinned = false;
+    QMutexLocker locker(&mutex);
+    for (;;) {
+        Call *call = nullptr;
+        for (Call *c : std::as_const(calls)) {
+            if (c->slots < c->maxSlots && c->next.load(std::memory_order_relaxed) < c->end) {
+                call = c;
+                break;
+            }
+        }
+        if (!call) {
+            if (stopping) {
+                return;
+            }
+            workCond.wait(&mutex);
+            continue;
+        }
+
+        const int slot = call->slots++;
+        call->active++;
+        locker.unlock();
+
+        const bool pin = pinning.load(std::memory_order_relaxed);
+        if (pin != pinned) {
+            applyPinning(worker, pin);
+            pinned = pin;
+        }
+        runCall(*call, slot);
+
+        locker.relock();
+        if (--call->active == 0) {
+            doneCond.wakeAll();
+        }
+    }
+}
+} // namespace jxfrstch
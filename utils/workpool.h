@@ -0,0 +1,68 @@
+#ifndef WORKPOOL_H
+#define WORKPOOL_H
+
+#include <QAtomicInt>
+#include <QScopedPointer>
+
+#include <cstdint>
+#include <functional>
+
+#include <jxl/parallel_runner.h>
+
+namespace jxfrstch
+{
+/*
+ * One process-wide pool of worker threads, shared by libjxl (the encoder and every decoder, through
+ * parallelRunner below) and our own pixel kernels, so overlapping decode and encode don't oversubscribe
+ *
+ * A parallel call publishes its index range and runs on the calling thread as well, idle workers join any
+ * call in flight and take indices one at a time until the range runs out. Parallelism is sized per call:
+ * never more threads than indices, the pool or the caller's cap
+ */
+class WorkPool
+{
+public:
+    static WorkPool &instance();
+    ~WorkPool();
+
+    // workers plus the calling thread
+    int maxThreads() const;
+
+    // pins worker n to core n + 1 (the calling threads are left alone), only does anything on Linux
+    void setPinning(bool enabled);
+
+    /*
+     * Runs fn(index, slot) for every index in [begin, end) on up to maxThreads threads (0 = no cap)
+     * slot is unique among the threads of this call and below the thread count passed to init,
+     * init runs first on the calling thread, returning false cancels the call
+     */
+    bool parallelFor(uint32_t begin,
+                     uint32_t end,
+                     int maxThreads,
+                     const std::function<bool(int threads)> &init,
+                     const std::function<void(uint32_t index, int slot)> &fn);
+
+    // splits rows into bands of at least minRows and runs fn(y0, y1) on each
+    void parallelRows(int rows, int minRows, const std::function<void(int y0, int y1)> &fn);
+
+private:
+    WorkPool();
+    class Private;
+    QScopedPointer<Private> d;
+};
+
+// per-client cap for parallelRunner, passed as its runner_opaque (nullptr = whole pool)
+struct RunnerLimit {
+    QAtomicInt maxThreads{0};
+};
+
+// JxlParallelRunner on top of WorkPool
+JxlParallelRetCode parallelRunner(void *runnerOpaque,
+                                  void *jpegxlOpaque,
+                                  JxlParallelRunInit init,
+                                  JxlParallelRunFunction func,
+                                  uint32_t startRange,
+                                  uint32_t endRange);
+} // namespace jxfrstch
+
+#endif // WORKPOOL_H